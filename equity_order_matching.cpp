@@ -1,6 +1,7 @@
 
 #include <iostream>
 #include <map>
+#include <set>
 #include <cassert>
 #include <unordered_map>
 #include <unordered_set>
@@ -10,6 +11,55 @@
 #include <string>
 #include <cassert>
 #include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
+#include <cinttypes>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <type_traits>
+#include <fstream>
+#include <stdexcept>
+#include <deque>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <poll.h>
+#include <cerrno>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <csignal>
+#endif
+#elif defined(_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#endif
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define EOM_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define EOM_TARGET(isa)
+#else
+#define EOM_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 struct order_data_key
 {
@@ -26,6 +76,12 @@ enum class order_type : int {
     market
   , limit
   , limit_ioc
+  // held off the book until a trade reaches the stop price, then a market order
+  , stop
+  // same, then a limit order
+  , stop_limit
+  // a limit order which trades its whole quantity in one matching run or not at all
+  , limit_fok
 };
 
 char order_type_to_char(order_type ot)
@@ -39,6 +95,15 @@ char order_type_to_char(order_type ot)
   if (ot == order_type::limit_ioc) {
     return 'I';
   }
+  if (ot == order_type::stop) {
+    return 'S';
+  }
+  if (ot == order_type::stop_limit) {
+    return 'T';
+  }
+  if (ot == order_type::limit_fok) {
+    return 'F';
+  }
   assert(false);
   return 'E';
 }
@@ -46,6 +111,10 @@ char order_type_to_char(order_type ot)
 class order_data
 {
 public:
+  order_data()
+    :order_data(0, 0, std::string(), 0.0f, 0, order_side::buy, order_type::limit)
+  {
+  }
   order_data(uint64_t id, uint32_t tim, const std::string& nam, float price, uint64_t q, order_side os, order_type ot)
   : m_id(id)
   , m_time(tim)
@@ -101,15 +170,61 @@ public:
   {
     return m_matched_q;
   }
+  void set_matched_q(uint64_t q)
+  {
+    m_matched_q = q;
+  }
+  // time a good till time order expires at, 0 for orders which do not expire
+  uint32_t get_expire_time() const
+  {
+    return m_expire_time;
+  }
+  void set_expire_time(uint32_t tim)
+  {
+    m_expire_time = tim;
+  }
+  // price a trade has to reach for a stop order to enter the book, 0 for other orders
+  float get_stop_price() const
+  {
+    return m_stop_price;
+  }
+  void set_stop_price(float p)
+  {
+    m_stop_price = p;
+  }
+  // quantity the first execution of the order has to reach, 0 for orders without
+  // a minimum; fill or kill orders have their whole quantity as minimum
+  uint64_t get_min_q() const
+  {
+    return m_min_q;
+  }
+  void set_min_q(uint64_t q)
+  {
+    m_min_q = q;
+  }
+  // quantity an iceberg order shows at a time, the rest is held in reserve;
+  // 0 for orders which show all of it
+  uint64_t get_peak() const
+  {
+    return m_peak;
+  }
+  void set_peak(uint64_t q)
+  {
+    m_peak = q;
+  }
 private:
   uint64_t m_id;
   uint32_t m_time;
+  uint32_t m_expire_time = 0;
   std::string m_symbol;
   float m_price;
+  float m_stop_price = 0.0f;
   uint64_t m_q;
   order_side m_order_side;
   order_type m_order_type;
   uint64_t m_matched_q = 0;
+  uint64_t m_min_q = 0;
+  uint64_t m_peak = 0;
 
   void add_matched_q(uint64_t q)
   {
@@ -206,32 +321,50 @@ public:
 using limit_order_buy = order_buy;
 
 
+// maps a price to an unsigned key which orders the same way as the float,
+// so price levels are compared as integers; 0.0f and -0.0f get the same key
+uint32_t price_to_key(float price)
+{
+  if (price == 0.0f) {
+    price = 0.0f;
+  }
+  uint32_t bits;
+  std::memcpy(&bits, &price, sizeof(bits));
+  return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+float key_to_price(uint32_t key)
+{
+  uint32_t bits = (key & 0x80000000u) ? (key & 0x7fffffffu) : ~key;
+  float price;
+  std::memcpy(&price, &bits, sizeof(price));
+  return price;
+}
+
+// order of the price levels of a side, rank maps a price key to a value which
+// grows towards the better price (and back, it is its own inverse), tick_rank
+// does the same for a price in ticks
 struct limit_order_buy_less
 {
-  bool operator()(const order_data_key& k1, const order_data_key& k2) const
+  static uint32_t rank(uint32_t key)
   {
-    if (k1.m_price < k2.m_price) {
-      return false;
-    }
-    if (k1.m_price > k2.m_price) {
-      return true;
-    }
-    return k1.m_time < k2.m_time;
+    return key;
+  }
+  static int64_t tick_rank(int64_t tick)
+  {
+    return tick;
   }
 };
 
 struct limit_order_sell_less
 {
-  bool operator()(const order_data_key& k1, const order_data_key& k2) const
+  static uint32_t rank(uint32_t key)
   {
-    if (k1.m_price < k2.m_price) {
-      return true;
-    }
-    if (k1.m_price > k2.m_price) {
-      return false;
-    }
-
-    return k1.m_time < k2.m_time;
+    return ~key;
+  }
+  static int64_t tick_rank(int64_t tick)
+  {
+    return -tick;
   }
 };
 
@@ -348,1251 +481,9713 @@ void basic_limit_orders_matching_tests()
 }
 
 
-template <class Ord, class Cmp>
-class limit_order_queue : public std::multimap<order_data_key, Ord, Cmp>
+template <typename E>
+constexpr auto to_underlying(E e) noexcept
+{
+  return static_cast<std::underlying_type_t<E>>(e);
+}
+
+class snapshot_error : public std::runtime_error
 {
 public:
-  bool put_order(const Ord& o)
+  explicit snapshot_error(const std::string& msg)
+    :std::runtime_error(msg)
   {
-    if (m_ids.count(o.get_id()) != 0) {
-      return false;
-    }
-    auto iter = this->insert(std::make_pair(o.get_key(), o));
-    m_ids.insert(std::make_pair(o.get_id(), iter));
-    if (o.is_ioc()) {
-      m_ioc.insert(o.get_id());
-    }
-    return true;
+
   }
-  bool cancel_order(uint64_t id, bool check_ioc = true)
+};
+
+// appends plain values to a byte buffer in host byte order
+class snapshot_writer
+{
+public:
+  template <class T>
+  void put(const T& val)
   {
-    auto elem = m_ids.find(id);
-    if (elem == m_ids.end()) {
-      return false;
-    }
-    if (check_ioc) {
-      if (elem->second->second.is_ioc()) {
-        m_ioc.erase(id);
-      }
-    }
-    this->erase(elem->second);
-    m_ids.erase(elem);
-    return true;
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be written");
+    m_buf.append(reinterpret_cast<const char*>(&val), sizeof(T));
   }
-  void drop_ioc()
+  void put_string(const std::string& str)
   {
-    for (auto id : m_ioc) {
-      cancel_order(id, false);
-    }
-    m_ioc.clear();
+    put(static_cast<uint32_t>(str.size()));
+    m_buf.append(str);
   }
-  bool id_exists(uint64_t id) const
+  // seven bits per byte, small values first
+  void put_varint(uint64_t val)
   {
-    auto cnt = m_ids.count(id);
-    if (cnt > 0) {
-      return true;
+    while (val >= 0x80) {
+      m_buf.push_back(static_cast<char>(val | 0x80));
+      val >>= 7;
     }
-    return false;
+    m_buf.push_back(static_cast<char>(val));
   }
-  float get_best_price() const
+  const std::string& get_data() const
   {
-    assert(!this->empty());
-    auto iter = this->begin();
-    return iter->second.get_price();
+    return m_buf;
   }
-  Ord& top_order()
+  void reserve(size_t size)
   {
-    assert(!this->empty());
-    auto iter = this->begin();
-    return iter->second;
+    m_buf.reserve(size);
   }
-  void pop_order()
+  void shrink_to_fit()
   {
-    assert(!this->empty());
-    auto iter = this->begin();
-    m_ids.erase(iter->second.get_id());
-    this->erase(iter);
+    m_buf.shrink_to_fit();
   }
+private:
+  std::string m_buf;
+};
+
+// reads values written by snapshot_writer from a byte range it does not own
+class snapshot_reader
+{
+public:
+  snapshot_reader(const char* data, size_t size)
+    :m_cur(data)
+    ,m_end(data + size)
+  {
 
-  using queue_iter = typename std::multimap<order_data_key, Ord, Cmp>::iterator;
-  queue_iter find_order_iter(uint64_t ord_id)
+  }
+  template <class T>
+  T get()
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "only plain values can be read");
+    check(sizeof(T));
+    T val;
+    std::memcpy(&val, m_cur, sizeof(T));
+    m_cur += sizeof(T);
+    return val;
+  }
+  std::string get_string()
   {
-    auto iter = m_ids.find(ord_id);
-    if (iter == m_ids.end()) {
-      return this->end();
+    auto size = get<uint32_t>();
+    check(size);
+    std::string ret(m_cur, size);
+    m_cur += size;
+    return ret;
+  }
+  uint64_t get_varint()
+  {
+    uint64_t val = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      auto byte = static_cast<uint8_t>(get<char>());
+      val |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return val;
+      }
     }
-    return iter->second;
+    throw snapshot_error("varint is too long");
+  }
+  size_t get_remaining() const
+  {
+    return m_end - m_cur;
   }
 private:
-  std::unordered_map<uint64_t, queue_iter> m_ids;
-  std::unordered_set<uint64_t> m_ioc;
+  void check(size_t size) const
+  {
+    if (static_cast<size_t>(m_end - m_cur) < size) {
+      throw snapshot_error("snapshot is truncated");
+    }
+  }
+  const char* m_cur;
+  const char* m_end;
 };
 
-class limit_order_buy_queue: public limit_order_queue<limit_order_buy, limit_order_buy_less>
+// one resting order in a snapshot, the key price differs from the order price
+// for market orders, whose price is set to the matched price, and for pending
+// stop orders, which are filed under their stop price
+struct snapshot_order_record
 {
-public:
+  uint64_t m_id;
+  uint64_t m_q;
+  uint64_t m_matched_q;
+  uint64_t m_seq;
+  uint64_t m_min_q;
+  uint64_t m_peak;
+  uint64_t m_reserve;
+  float m_price;
+  float m_key_price;
+  uint8_t m_order_side;
+  uint8_t m_order_type;
+  uint8_t m_ioc;
+  uint8_t m_pad;
 };
 
-class limit_order_sell_queue: public limit_order_queue<limit_order_sell, limit_order_sell_less>
+// the side and type of a record come from a file or the history, values out of
+// range would reach the dispatch tables of the engine
+void check_order_record(const snapshot_order_record& rec)
 {
-public:
-};
-
-
-//template <class Ord>
-//class market_order_cont : public std::unordered_map<uint64_t, Ord>
-//{
-//public:
-//  bool id_exists(uint64_t id) const
-//  {
-//    auto cnt = this->count(id);
-//    if (cnt > 0) {
-//      return true;
-//    }
-//    return false;
-//  }
-//
-//  bool put_order(const Ord& o)
-//  {
-//    auto ret = this->insert(std::make_pair(o.get_id(), o));
-//    return ret.second;
-//  }
-//  bool cancel_order(uint64_t id)
-//  {
-//    auto iter = this->find(id);
-//    if (iter == this->end()) {
-//      return false;
-//    }
-//    this->erase(iter);
-//    return true;
-//  }
-//};
+  if (rec.m_order_side > to_underlying(order_side::buy) || rec.m_order_type > to_underlying(order_type::limit_fok)) {
+    throw snapshot_error("snapshot order side or type out of range");
+  }
+}
 
-using market_order_buy_cont = limit_order_queue<limit_order_buy, limit_order_buy_less>;
-using market_order_sell_cont = limit_order_queue<limit_order_sell, limit_order_sell_less>;
+struct identity_key
+{
+  uint64_t operator()(uint64_t key) const
+  {
+    return key;
+  }
+};
 
-void basic_buy_queue_tests()
+struct first_key
 {
+  template <class P>
+  uint64_t operator()(const P& p) const
   {
-    limit_order_buy_queue bq;
-    limit_order_buy b1({ 1, 1, "n", 1.0f, 1, order_side::buy, order_type::limit});
-    bq.put_order(b1);
+    return p.first;
+  }
+};
 
-    limit_order_buy b2({ 2, 1, "n", 1.0f, 1, order_side::buy, order_type::limit});
-    bq.put_order(b2);
+// open addressing table of entries keyed by an order id, robin hood probing keeps
+// every entry close to its home slot and erase shifts the following entries back
+// instead of leaving tombstones; entries move on insert and erase, so iterators
+// and references only hold until the next change of the table
+template <class T, class KeyOf>
+class flat_id_table
+{
+public:
+  template <class Table, class Value>
+  class basic_iterator
+  {
+  public:
+    basic_iterator(Table* table, size_t pos)
+      :m_table(table)
+      ,m_pos(pos)
+    {
+      skip_empty();
+    }
+    Value& operator*() const
+    {
+      return m_table->m_slots[m_pos];
+    }
+    Value* operator->() const
+    {
+      return &m_table->m_slots[m_pos];
+    }
+    basic_iterator& operator++()
+    {
+      ++m_pos;
+      skip_empty();
+      return *this;
+    }
+    bool operator==(const basic_iterator& other) const
+    {
+      return m_pos == other.m_pos;
+    }
+    bool operator!=(const basic_iterator& other) const
+    {
+      return m_pos != other.m_pos;
+    }
+  private:
+    friend class flat_id_table;
 
-    assert(bq.size() == 2);
+    void skip_empty()
     {
-      auto iter = bq.begin();
-      assert(iter->second.get_id() == 1);
-      ++iter;
-      assert(iter->second.get_id() == 2);
+      while (m_pos < m_table->m_dist.size() && m_table->m_dist[m_pos] == 0) {
+        ++m_pos;
+      }
     }
-  }
-  {
-    limit_order_buy_queue bq;
-    limit_order_buy b1({ 1, 2, "n", 1.0f, 1, order_side::buy, order_type::limit });
-    bq.put_order(b1);
 
-    limit_order_buy b2({ 2, 1, "n", 1.0f, 1, order_side::buy, order_type::limit });
-    bq.put_order(b2);
+    Table* m_table;
+    size_t m_pos;
+  };
+  using iterator = basic_iterator<flat_id_table, T>;
+  using const_iterator = basic_iterator<const flat_id_table, const T>;
 
-    assert(bq.size() == 2);
-    {
-      auto iter = bq.begin();
-      assert(iter->second.get_id() == 2);
-      ++iter;
-      assert(iter->second.get_id() == 1);
+  explicit flat_id_table(size_t expected = 0)
+  {
+    reserve(expected);
+  }
+  iterator begin()
+  {
+    return iterator(this, 0);
+  }
+  iterator end()
+  {
+    return iterator(this, m_dist.size());
+  }
+  const_iterator begin() const
+  {
+    return const_iterator(this, 0);
+  }
+  const_iterator end() const
+  {
+    return const_iterator(this, m_dist.size());
+  }
+  size_t size() const
+  {
+    return m_size;
+  }
+  bool empty() const
+  {
+    return m_size == 0;
+  }
+  size_t capacity() const
+  {
+    return m_dist.size();
+  }
+  // makes room for count entries without growing
+  void reserve(size_t count)
+  {
+    size_t cap = 16;
+    while (cap / 8 * 7 < count) {
+      cap *= 2;
+    }
+    if (count > 0 && cap > capacity()) {
+      rehash(cap);
     }
   }
-
+  // drops the entries and keeps the slots
+  void clear()
   {
-    limit_order_buy_queue bq;
-    limit_order_buy b1({ 1, 1, "n", 2.0f, 1, order_side::buy, order_type::limit });
-    bq.put_order(b1);
-
-    limit_order_buy b2({ 2, 1, "n", 1.0f, 1, order_side::buy, order_type::limit });
-    bq.put_order(b2);
-
-    assert(bq.size() == 2);
-    {
-      auto iter = bq.begin();
-      assert(iter->second.get_id() == 1);
-      ++iter;
-      assert(iter->second.get_id() == 2);
+    if (m_size == 0) {
+      return;
     }
+    for (size_t i = 0; i < m_dist.size(); ++i) {
+      if (m_dist[i] != 0) {
+        m_slots[i] = T();
+        m_dist[i] = 0;
+      }
+    }
+    m_size = 0;
   }
-}
-
-void basic_sell_queue_tests()
-{
+  iterator find(uint64_t key)
   {
-    limit_order_sell_queue bq;
-    limit_order_sell b1({ 1, 1, "n", 1.0f, 1, order_side::sell, order_type::limit });
-    bq.put_order(b1);
-
-    limit_order_sell b2({ 2, 1, "n", 1.0f, 1, order_side::sell, order_type::limit });
-    bq.put_order(b2);
-
-    assert(bq.size() == 2);
-    {
-      auto iter = bq.begin();
-      assert(iter->second.get_id() == 1);
-      ++iter;
-      assert(iter->second.get_id() == 2);
+    return iterator(this, locate(key));
+  }
+  const_iterator find(uint64_t key) const
+  {
+    return const_iterator(this, locate(key));
+  }
+  size_t count(uint64_t key) const
+  {
+    return locate(key) != capacity() ? 1 : 0;
+  }
+  // the entry is not added if its key is already there
+  std::pair<iterator, bool> insert(T value)
+  {
+    auto key = KeyOf()(value);
+    auto pos = locate(key);
+    if (pos != capacity()) {
+      return std::make_pair(iterator(this, pos), false);
     }
+    if ((m_size + 1) > capacity() / 8 * 7) {
+      rehash(capacity() == 0 ? 16 : capacity() * 2);
+    }
+    pos = place(std::move(value));
+    return std::make_pair(iterator(this, pos), true);
   }
+  void erase(iterator iter)
   {
-    limit_order_sell_queue bq;
-    limit_order_sell b1({ 1, 2, "n", 1.0f, 1, order_side::sell, order_type::limit });
-    bq.put_order(b1);
-
-    limit_order_sell b2({ 2, 1, "n", 1.0f, 1, order_side::sell, order_type::limit });
-    bq.put_order(b2);
-
-    assert(bq.size() == 2);
-    {
-      auto iter = bq.begin();
-      assert(iter->second.get_id() == 2);
-      ++iter;
-      assert(iter->second.get_id() == 1);
+    auto pos = iter.m_pos;
+    auto next = (pos + 1) & m_mask;
+    while (m_dist[next] > 1) {
+      m_slots[pos] = std::move(m_slots[next]);
+      m_dist[pos] = static_cast<uint8_t>(m_dist[next] - 1);
+      pos = next;
+      next = (next + 1) & m_mask;
     }
+    m_slots[pos] = T();
+    m_dist[pos] = 0;
+    --m_size;
   }
+  size_t erase(uint64_t key)
   {
-    limit_order_sell_queue bq;
-    limit_order_sell b1({ 1, 1, "n", 2.0f, 1, order_side::sell, order_type::limit });
-    bq.put_order(b1);
-
-    limit_order_sell b2({ 2, 1, "n", 1.0f, 1, order_side::sell, order_type::limit });
-    bq.put_order(b2);
+    auto pos = locate(key);
+    if (pos == capacity()) {
+      return 0;
+    }
+    erase(iterator(this, pos));
+    return 1;
+  }
+private:
+  // a probe this long means a poor spread of the keys, the table grows instead
+  static const uint8_t max_dist = 255;
 
-    assert(bq.size() == 2);
-    {
-      auto iter = bq.begin();
-      assert(iter->second.get_id() == 2);
-      ++iter;
-      assert(iter->second.get_id() == 1);
+  size_t home(uint64_t key) const
+  {
+    // splitmix64 finalizer, ids are often dense and would otherwise cluster
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return static_cast<size_t>(key) & m_mask;
+  }
+  // slot of key or capacity() if it is not there
+  size_t locate(uint64_t key) const
+  {
+    if (m_size == 0) {
+      return capacity();
+    }
+    auto pos = home(key);
+    // an entry further from its home than key would be ends the search
+    for (uint8_t d = 1; m_dist[pos] >= d; ++d) {
+      if (KeyOf()(m_slots[pos]) == key) {
+        return pos;
+      }
+      pos = (pos + 1) & m_mask;
+    }
+    return capacity();
+  }
+  // adds a key which is not in the table yet and returns its slot, richer
+  // entries on the way give their slot up and move on
+  size_t place(T value)
+  {
+    auto key = KeyOf()(value);
+    auto pos = home(key);
+    uint8_t d = 1;
+    size_t ret = capacity();
+    for (;;) {
+      if (m_dist[pos] == 0) {
+        m_slots[pos] = std::move(value);
+        m_dist[pos] = d;
+        ++m_size;
+        return ret == capacity() ? pos : ret;
+      }
+      if (m_dist[pos] < d) {
+        std::swap(value, m_slots[pos]);
+        std::swap(d, m_dist[pos]);
+        if (ret == capacity()) {
+          ret = pos;
+        }
+      }
+      pos = (pos + 1) & m_mask;
+      if (++d == max_dist) {
+        rehash(capacity() * 2);
+        place(std::move(value));
+        return locate(key);
+      }
+    }
+  }
+  void rehash(size_t cap)
+  {
+    std::vector<T> slots(cap);
+    std::vector<uint8_t> dist(cap, 0);
+    slots.swap(m_slots);
+    dist.swap(m_dist);
+    m_mask = cap - 1;
+    m_size = 0;
+    for (size_t i = 0; i < dist.size(); ++i) {
+      if (dist[i] != 0) {
+        place(std::move(slots[i]));
+      }
     }
   }
-}
 
-template <typename E>
-constexpr auto to_underlying(E e) noexcept
+  std::vector<T> m_slots;
+  // probe length plus one of the entry in each slot, 0 for an empty slot
+  std::vector<uint8_t> m_dist;
+  size_t m_mask = 0;
+  size_t m_size = 0;
+};
+
+using flat_id_set = flat_id_table<uint64_t, identity_key>;
+
+template <class V>
+class flat_id_map : public flat_id_table<std::pair<uint64_t, V>, first_key>
 {
-  return static_cast<std::underlying_type_t<E>>(e);
+public:
+  using base = flat_id_table<std::pair<uint64_t, V>, first_key>;
+  using base::base;
+
+  std::pair<typename base::iterator, bool> emplace(uint64_t key, V value)
+  {
+    return this->insert(std::make_pair(key, std::move(value)));
+  }
+  V& operator[](uint64_t key)
+  {
+    return emplace(key, V()).first->second;
+  }
+};
+
+// hot part of a resting order, stored contiguously per price level in priority
+// order; the sequence is assigned by the engine when it accepts the order
+struct hot_order
+{
+  uint64_t m_seq;
+  uint64_t m_q;
+  uint32_t m_handle;
+};
+
+struct hot_order_less
+{
+  bool operator()(const hot_order& o1, const hot_order& o2) const
+  {
+    return o1.m_seq < o2.m_seq;
+  }
+};
+
+// the rest of a resting order, touched on fill reporting, amends and cancels only;
+// the sequence locates the hot record within its level
+struct cold_order
+{
+  uint64_t m_id;
+  uint64_t m_matched_q;
+  uint64_t m_seq;
+  // minimum quantity until the order first trades, then 0
+  uint64_t m_min_q;
+  // iceberg orders: the size of a shown slice and the hidden rest behind the one
+  // in the book
+  uint64_t m_peak;
+  uint64_t m_reserve;
+  uint32_t m_key;
+  // set to the matched price for market orders
+  float m_price;
+  uint8_t m_order_side;
+  uint8_t m_order_type;
+  uint8_t m_ioc;
+};
+
+// orders of one price; cancelled orders stay behind as tombstones until they
+// outnumber the live ones, m_head skips the ones already matched. The totals
+// are kept as orders come, trade and go, m_conditional_q is the part of m_q
+// of orders with a minimum quantity which have not traded yet and m_reserve
+// the hidden quantity of the icebergs, which is not in m_q
+struct price_level
+{
+  std::vector<hot_order> m_orders;
+  size_t m_head = 0;
+  size_t m_live = 0;
+  uint64_t m_q = 0;
+  uint64_t m_conditional_q = 0;
+  uint64_t m_reserve = 0;
+};
+
+// counts the values of a below v; the widest variant the cpu supports is
+// picked once at startup, the others stay around for testing
+size_t count_less_scalar(const int32_t* a, size_t n, int32_t v)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    count += a[i] < v ? 1 : 0;
+  }
+  return count;
 }
 
-std::string float_to_string(float val)
+#if defined(EOM_X86)
+EOM_TARGET("sse2")
+size_t count_less_sse2(const int32_t* a, size_t n, int32_t v)
 {
-  std::ostringstream str;
-  str.precision(2);
-  str.setf(std::ios::fixed, std::ios::floatfield);
-  str << val;
-  return str.str();
+  __m128i vv = _mm_set1_epi32(v);
+  __m128i acc = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(vv, x));
+  }
+  alignas(16) int32_t lanes[4];
+  _mm_store_si128(reinterpret_cast<__m128i*>(lanes), acc);
+  size_t count = static_cast<size_t>(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+  return count + count_less_scalar(a + i, n - i, v);
 }
 
-struct matched_result_detail
+EOM_TARGET("avx2")
+size_t count_less_avx2(const int32_t* a, size_t n, int32_t v)
 {
-  std::string m_symb;
-  struct matched_buy {
-    uint64_t m_order_id;
-    order_type m_order_type;
-    uint64_t m_q;
-    float m_price;
+  __m256i vv = _mm256_set1_epi32(v);
+  __m256i acc = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(vv, x));
+  }
+  alignas(32) int32_t lanes[8];
+  _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  size_t count = 0;
+  for (auto lane : lanes) {
+    count += static_cast<size_t>(lane);
+  }
+  return count + count_less_scalar(a + i, n - i, v);
+}
 
-    std::string to_string() const
-    {
-      std::string ret;
+bool cpu_has_avx2()
+{
+#if defined(_MSC_VER)
+  int regs[4];
+  __cpuid(regs, 0);
+  if (regs[0] < 7) {
+    return false;
+  }
+  __cpuid(regs, 1);
+  // osxsave and avx, then the os must save the ymm state
+  if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+    return false;
+  }
+  __cpuidex(regs, 7, 0);
+  return (regs[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+#endif
 
-      ret += std::to_string(m_order_id);
-      ret += ',';
-      ret += order_type_to_char(m_order_type);
-      ret += ',';
-      ret += std::to_string(m_q);
-      ret += ',';
-      ret += float_to_string(m_price);
+using count_less_func = size_t (*)(const int32_t*, size_t, int32_t);
 
-      return ret;
-    }
-  };
-  struct matched_sell {
-    float m_price;
-    uint64_t m_q;
-    order_type m_order_type;
-    uint64_t m_id;
+count_less_func select_count_less()
+{
+#if defined(EOM_X86)
+  if (cpu_has_avx2()) {
+    return &count_less_avx2;
+  }
+  return &count_less_sse2;
+#else
+  return &count_less_scalar;
+#endif
+}
 
-    std::string to_string() const
-    {
-      std::string ret;
+const count_less_func count_less = select_count_less();
 
-      ret += float_to_string(m_price);
-      ret += ',';
-      ret += std::to_string(m_q);
-      ret += ',';
-      ret += order_type_to_char(m_order_type);
-      ret += ',';
-      ret += std::to_string(m_id);
-      return ret;
+// the price levels of one side as a sorted array, best price at the back so
+// that levels come and go at the end of the array near the touch; a search
+// counts the keys below the wanted one in the window next to the touch with
+// simd and only falls back to a binary search for prices deeper in the book
+template <class Cmp>
+class price_level_index
+{
+public:
+  size_t size() const
+  {
+    return m_ranks.size();
+  }
+  bool empty() const
+  {
+    return m_ranks.empty();
+  }
+  void clear()
+  {
+    m_ranks.clear();
+    m_slots.clear();
+    m_pool.clear();
+    m_free.clear();
+  }
+  const price_level* find(uint32_t key) const
+  {
+    auto r = rank(key);
+    auto pos = search(r);
+    return pos < size() && m_ranks[pos] == r ? &m_pool[m_slots[pos]] : nullptr;
+  }
+  price_level* find(uint32_t key)
+  {
+    return const_cast<price_level*>(static_cast<const price_level_index*>(this)->find(key));
+  }
+  // returns the level of key, an empty one is added if there is none
+  price_level& get(uint32_t key)
+  {
+    auto r = rank(key);
+    auto pos = search(r);
+    if (pos < size() && m_ranks[pos] == r) {
+      return m_pool[m_slots[pos]];
     }
-  };
-
-  matched_buy m_matched_buy;
-  matched_sell m_matched_sell;
+    uint32_t slot;
+    if (!m_free.empty()) {
+      slot = m_free.back();
+      m_free.pop_back();
+    }
+    else {
+      slot = static_cast<uint32_t>(m_pool.size());
+      m_pool.emplace_back();
+    }
+    m_ranks.insert(m_ranks.begin() + pos, r);
+    m_slots.insert(m_slots.begin() + pos, slot);
+    return m_pool[slot];
+  }
+  void erase(uint32_t key)
+  {
+    auto r = rank(key);
+    auto pos = m_ranks.back() == r ? size() - 1 : search(r);
+    assert(pos < size() && m_ranks[pos] == r);
+    // the level keeps its capacity for the next price using the slot
+    auto& lvl = m_pool[m_slots[pos]];
+    lvl.m_orders.clear();
+    lvl.m_head = 0;
+    lvl.m_live = 0;
+    lvl.m_q = 0;
+    lvl.m_conditional_q = 0;
+    lvl.m_reserve = 0;
+    m_free.push_back(m_slots[pos]);
+    m_ranks.erase(m_ranks.begin() + pos);
+    m_slots.erase(m_slots.begin() + pos);
+  }
+  uint32_t best_key() const
+  {
+    return key_of(m_ranks.back());
+  }
+  price_level& best()
+  {
+    return m_pool[m_slots.back()];
+  }
+  const price_level& best() const
+  {
+    return m_pool[m_slots.back()];
+  }
+  // calls f(key, level) from the best price on while it returns true
+  template <class F>
+  void for_each(F f) const
+  {
+    for (size_t i = size(); i-- > 0; ) {
+      if (!f(key_of(m_ranks[i]), m_pool[m_slots[i]])) {
+        return;
+      }
+    }
+  }
+private:
+  static const size_t touch_window = 64;
 
-  std::string to_string() const
+  // ranks grow towards the best price and are biased so that a signed compare orders them
+  static int32_t rank(uint32_t key)
   {
-    std::string ret;
+    return static_cast<int32_t>(Cmp::rank(key) ^ 0x80000000u);
+  }
+  static uint32_t key_of(int32_t r)
+  {
+    return Cmp::rank(static_cast<uint32_t>(r) ^ 0x80000000u);
+  }
+  // position of the first rank not below r
+  size_t search(int32_t r) const
+  {
+    auto n = size();
+    size_t window = n < touch_window ? n : touch_window;
+    auto start = n - window;
+    if (window == n || m_ranks[start] < r) {
+      return start + count_less(m_ranks.data() + start, window, r);
+    }
+    return std::lower_bound(m_ranks.begin(), m_ranks.begin() + start, r) - m_ranks.begin();
+  }
 
-    ret += m_symb;
-    ret += '|';
-    ret += m_matched_buy.to_string();
-    ret += '|';
-    ret += m_matched_sell.to_string();
+  std::vector<int32_t> m_ranks;
+  // position of the level of each rank in m_pool
+  std::vector<uint32_t> m_slots;
+  std::vector<price_level> m_pool;
+  std::vector<uint32_t> m_free;
+};
 
-    return ret;
+// index of the highest set bit of a non zero word
+unsigned highest_bit(uint64_t x)
+{
+#if defined(_MSC_VER)
+  unsigned long idx;
+  if (_BitScanReverse(&idx, static_cast<unsigned long>(x >> 32))) {
+    return idx + 32;
   }
-};
+  _BitScanReverse(&idx, static_cast<unsigned long>(x));
+  return idx;
+#else
+  return 63 - __builtin_clzll(x);
+#endif
+}
 
-enum class amend_result {
-  not_found
-  , failed
-  , ok
-  , executed
-};
+unsigned lowest_bit(uint64_t x)
+{
+#if defined(_MSC_VER)
+  unsigned long idx;
+  if (_BitScanForward(&idx, static_cast<unsigned long>(x))) {
+    return idx;
+  }
+  _BitScanForward(&idx, static_cast<unsigned long>(x >> 32));
+  return idx + 32;
+#else
+  return __builtin_ctzll(x);
+#endif
+}
 
-class order_engine
+// the price levels of one side as a three level occupancy bitmap over a window
+// of cent ticks around the touch, the best level is found with one bit scan per
+// level no matter how many levels are between it and the previous best. Prices
+// off the cent grid or outside the window go to a price_level_index, the window
+// moves to a better price which falls above it. Bitmap words and level slots are
+// only allocated for the occupied parts of the window, engines are copied into
+// the history at every timestamp
+template <class Cmp>
+class price_tick_index
 {
 public:
-  order_engine()
+  size_t size() const
   {
-    init_put_func();
+    return m_count + m_far.size();
+  }
+  bool empty() const
+  {
+    return size() == 0;
+  }
+  void clear()
+  {
+    m_l1.clear();
+    m_l2 = 0;
+    m_dir.clear();
+    m_blocks.clear();
+    m_free_blocks.clear();
+    m_pages.clear();
+    m_free_pages.clear();
+    m_pool.clear();
+    m_free.clear();
+    m_count = 0;
+    m_base = 0;
+    m_far.clear();
+  }
+  const price_level* find(uint32_t key) const
+  {
+    uint32_t off;
+    if (!window_offset(key, off)) {
+      return m_far.find(key);
+    }
+    if ((m_l2 & bit(off >> 12)) == 0 || (word(off >> 6) & bit(off)) == 0) {
+      return nullptr;
+    }
+    return &level_at(off);
+  }
+  price_level* find(uint32_t key)
+  {
+    return const_cast<price_level*>(static_cast<const price_tick_index*>(this)->find(key));
   }
+  // returns the level of key, an empty one is added if there is none
+  price_level& get(uint32_t key)
+  {
+    int64_t r;
+    if (!tick_rank(key, r)) {
+      return m_far.get(key);
+    }
+    if (m_count == 0 || static_cast<uint64_t>(r - m_base) >= window_size) {
+      // worse prices stay far, a better one means the touch has drifted out of the window
+      if (m_count != 0 && (r < m_base || m_far.find(key) != nullptr)) {
+        return m_far.get(key);
+      }
+      move_window(r);
+    }
+    return add(static_cast<uint32_t>(r - m_base));
+  }
+  void erase(uint32_t key)
+  {
+    uint32_t off;
+    if (!window_offset(key, off)) {
+      m_far.erase(key);
+      return;
+    }
+    remove(off);
+  }
+  uint32_t best_key() const
+  {
+    if (far_is_best()) {
+      return m_far.best_key();
+    }
+    return key_of(best_offset());
+  }
+  price_level& best()
+  {
+    return const_cast<price_level&>(static_cast<const price_tick_index*>(this)->best());
+  }
+  const price_level& best() const
+  {
+    if (far_is_best()) {
+      return m_far.best();
+    }
+    return level_at(best_offset());
+  }
+  // calls f(key, level) from the best price on while it returns true
+  template <class F>
+  void for_each(F f) const
+  {
+    // merges the window levels into the far ones
+    auto off = m_count != 0 ? best_offset() : window_size;
+    bool stopped = false;
+    m_far.for_each([&](uint32_t key, const price_level& lvl) {
+      for (; off != window_size && Cmp::rank(key_of(off)) > Cmp::rank(key); off = prev_offset(off)) {
+        if (!f(key_of(off), level_at(off))) {
+          stopped = true;
+          return false;
+        }
+      }
+      return f(key, lvl);
+    });
+    for (; !stopped && off != window_size; off = prev_offset(off)) {
+      if (!f(key_of(off), level_at(off))) {
+        return;
+      }
+    }
+  }
+private:
+  static const uint32_t window_bits = 16;
+  static const uint32_t window_size = 1u << window_bits;
+  static const uint32_t no_index = UINT32_MAX;
 
-  bool put_order(const order_data& d, order_side os, order_type ot)
+  // the bottom words of 4096 ticks and the slot pages of the non zero ones
+  struct tick_block
   {
-    if (id_exists(d.get_id())) {
+    std::array<uint64_t, 64> m_bits;
+    std::array<uint32_t, 64> m_pages;
+  };
+
+  static uint64_t bit(uint32_t pos)
+  {
+    return uint64_t(1) << (pos & 63);
+  }
+  // rank of the cent tick of key, growing towards the better price; false for
+  // prices off the grid
+  static bool tick_rank(uint32_t key, int64_t& r)
+  {
+    auto price = key_to_price(key);
+    if (!(std::fabs(price) < 1e9f)) {
       return false;
     }
-
-    auto ret = m_put_func.at(to_underlying(os)).at(to_underlying(ot))(d);
- 
-    return ret;
+    auto cents = static_cast<double>(price) * 100.0;
+    auto tick = static_cast<int64_t>(cents < 0 ? cents - 0.5 : cents + 0.5);
+    if (static_cast<float>(tick * 0.01) != price) {
+      return false;
+    }
+    r = Cmp::tick_rank(tick);
+    return true;
   }
-
-  amend_result amend_order(const order_data& od)
+  bool window_offset(uint32_t key, uint32_t& off) const
   {
-    {
-      auto res = try_amend_order_in_limit_queue(m_limit_buy_queue, od);
-      switch (res) {
-      case amend_result::failed:
-      case amend_result::ok:
-      case amend_result::executed:
-        return res;
-      case amend_result::not_found:
-        break;// continue
-      };
+    int64_t r;
+    if (m_count == 0 || !tick_rank(key, r) || static_cast<uint64_t>(r - m_base) >= window_size) {
+      return false;
     }
-    {
-      auto res = try_amend_order_in_limit_queue(m_limit_sell_queue, od);
-      switch (res) {
-      case amend_result::failed:
-      case amend_result::ok:
-      case amend_result::executed:
-        return res;
-      case amend_result::not_found:
-        break;// continue
-      };
+    off = static_cast<uint32_t>(r - m_base);
+    return true;
+  }
+  uint32_t key_of(uint32_t off) const
+  {
+    return price_to_key(static_cast<float>(Cmp::tick_rank(m_base + off) * 0.01));
+  }
+  bool far_is_best() const
+  {
+    return m_count == 0 || (!m_far.empty() && Cmp::rank(m_far.best_key()) > Cmp::rank(key_of(best_offset())));
+  }
+  uint32_t& slot_at(uint32_t off)
+  {
+    return m_pages[m_blocks[m_dir[off >> 12]].m_pages[(off >> 6) & 63]][off & 63];
+  }
+  const price_level& level_at(uint32_t off) const
+  {
+    return m_pool[m_pages[m_blocks[m_dir[off >> 12]].m_pages[(off >> 6) & 63]][off & 63]];
+  }
+  const uint64_t& word(uint32_t w) const
+  {
+    return m_blocks[m_dir[w >> 6]].m_bits[w & 63];
+  }
+  uint32_t best_offset() const
+  {
+    auto w1 = highest_bit(m_l2);
+    auto w = (w1 << 6) + highest_bit(m_l1[w1]);
+    return (w << 6) + highest_bit(word(w));
+  }
+  // highest occupied offset below off, window_size if there is none
+  uint32_t prev_offset(uint32_t off) const
+  {
+    auto w = off >> 6;
+    auto below = word(w) & (bit(off) - 1);
+    if (below != 0) {
+      return (w << 6) + highest_bit(below);
     }
-    {
-      auto res = try_amend_order_in_limit_queue(m_market_order_buy_cont, od);
-      switch (res) {
-      case amend_result::failed:
-      case amend_result::ok:
-      case amend_result::executed:
-        return res;
-      case amend_result::not_found:
-        break;// continue
-      };
+    auto w1 = w >> 6;
+    below = m_l1[w1] & (bit(w) - 1);
+    if (below == 0) {
+      below = m_l2 & (bit(w1) - 1);
+      if (below == 0) {
+        return window_size;
+      }
+      w1 = highest_bit(below);
+      below = m_l1[w1];
     }
-    {
-      auto res = try_amend_order_in_limit_queue(m_market_order_sell_cont, od);
-      switch (res) {
-      case amend_result::failed:
-      case amend_result::ok:
-      case amend_result::executed:
-        return res;
-      case amend_result::not_found:
-          break;
-      };
+    w = (w1 << 6) + highest_bit(below);
+    return (w << 6) + highest_bit(word(w));
+  }
+  price_level& add(uint32_t off)
+  {
+    auto w = off >> 6;
+    auto w1 = w >> 6;
+    if ((m_l2 & bit(w1)) == 0) {
+      if (!m_free_blocks.empty()) {
+        m_dir[w1] = m_free_blocks.back();
+        m_free_blocks.pop_back();
+      }
+      else {
+        m_dir[w1] = static_cast<uint32_t>(m_blocks.size());
+        m_blocks.emplace_back();
+      }
+      m_blocks[m_dir[w1]].m_bits.fill(0);
+      m_l2 |= bit(w1);
+    }
+    auto& blk = m_blocks[m_dir[w1]];
+    auto& bits = blk.m_bits[w & 63];
+    if ((bits & bit(off)) != 0) {
+      return m_pool[slot_at(off)];
+    }
+    if (bits == 0) {
+      if (!m_free_pages.empty()) {
+        blk.m_pages[w & 63] = m_free_pages.back();
+        m_free_pages.pop_back();
+      }
+      else {
+        blk.m_pages[w & 63] = static_cast<uint32_t>(m_pages.size());
+        m_pages.emplace_back();
+      }
+    }
+    bits |= bit(off);
+    m_l1[w1] |= bit(w);
+    ++m_count;
+    uint32_t slot;
+    if (!m_free.empty()) {
+      slot = m_free.back();
+      m_free.pop_back();
+    }
+    else {
+      slot = static_cast<uint32_t>(m_pool.size());
+      m_pool.emplace_back();
+    }
+    slot_at(off) = slot;
+    return m_pool[slot];
+  }
+  void remove(uint32_t off)
+  {
+    auto slot = slot_at(off);
+    // the level keeps its capacity for the next price using the slot
+    auto& lvl = m_pool[slot];
+    lvl.m_orders.clear();
+    lvl.m_head = 0;
+    lvl.m_live = 0;
+    lvl.m_q = 0;
+    lvl.m_conditional_q = 0;
+    lvl.m_reserve = 0;
+    m_free.push_back(slot);
+    --m_count;
+    auto w = off >> 6;
+    auto w1 = w >> 6;
+    auto& blk = m_blocks[m_dir[w1]];
+    auto& bits = blk.m_bits[w & 63];
+    bits &= ~bit(off);
+    if (bits != 0) {
+      return;
+    }
+    m_free_pages.push_back(blk.m_pages[w & 63]);
+    m_l1[w1] &= ~bit(w);
+    if (m_l1[w1] == 0) {
+      m_free_blocks.push_back(m_dir[w1]);
+      m_dir[w1] = no_index;
+      m_l2 &= ~bit(w1);
+    }
+  }
+  // centres the window on rank r, levels change sides between the window and
+  // the far index so that the far one holds exactly the keys off the window
+  void move_window(int64_t r)
+  {
+    if (m_l1.empty()) {
+      m_l1.assign(window_size >> 12, 0);
+      m_dir.assign(window_size >> 12, static_cast<uint32_t>(no_index));
+    }
+    std::vector<std::pair<uint32_t, price_level>> moved;
+    for (auto off = m_count != 0 ? best_offset() : window_size; off != window_size; off = prev_offset(off)) {
+      moved.emplace_back(key_of(off), std::move(m_pool[slot_at(off)]));
+    }
+    for (const auto& m : moved) {
+      remove(static_cast<uint32_t>(tick_of(m.first) - m_base));
+    }
+    m_base = r - window_size / 2;
+    std::vector<uint32_t> pulled;
+    m_far.for_each([&](uint32_t key, const price_level&) {
+      int64_t far_r;
+      if (tick_rank(key, far_r) && static_cast<uint64_t>(far_r - m_base) < window_size) {
+        pulled.push_back(key);
+      }
+      return true;
+    });
+    for (auto key : pulled) {
+      add(static_cast<uint32_t>(tick_of(key) - m_base)) = std::move(*m_far.find(key));
+      m_far.erase(key);
+    }
+    for (auto& m : moved) {
+      auto off = static_cast<uint64_t>(tick_of(m.first) - m_base);
+      if (off < window_size) {
+        add(static_cast<uint32_t>(off)) = std::move(m.second);
+      }
+      else {
+        m_far.get(m.first) = std::move(m.second);
+      }
+    }
+  }
+  // tick rank of a key known to be on the grid
+  static int64_t tick_of(uint32_t key)
+  {
+    int64_t r = 0;
+    tick_rank(key, r);
+    return r;
+  }
+
+  // a bit per non zero bottom word, 64 words per entry
+  std::vector<uint64_t> m_l1;
+  // a bit per non zero m_l1 word
+  uint64_t m_l2 = 0;
+  // the block of every non zero m_l1 word
+  std::vector<uint32_t> m_dir;
+  std::vector<tick_block> m_blocks;
+  std::vector<uint32_t> m_free_blocks;
+  // level slots of the 64 offsets of a bottom word
+  std::vector<std::array<uint32_t, 64>> m_pages;
+  std::vector<uint32_t> m_free_pages;
+  std::vector<price_level> m_pool;
+  std::vector<uint32_t> m_free;
+  size_t m_count = 0;
+  // tick rank of offset 0 of the window
+  int64_t m_base = 0;
+  price_level_index<Cmp> m_far;
+};
+
+// the price levels of one side in a std::map, best price first; every change
+// costs a tree walk wherever the price is, so books with uniformly spread
+// inserts and erases over thousands of levels do better here than in the
+// sorted array of price_level_index
+template <class Cmp>
+class price_level_map
+{
+public:
+  size_t size() const
+  {
+    return m_levels.size();
+  }
+  bool empty() const
+  {
+    return m_levels.empty();
+  }
+  void clear()
+  {
+    m_levels.clear();
+  }
+  const price_level* find(uint32_t key) const
+  {
+    auto iter = m_levels.find(Cmp::rank(key));
+    return iter != m_levels.end() ? &iter->second : nullptr;
+  }
+  price_level* find(uint32_t key)
+  {
+    return const_cast<price_level*>(static_cast<const price_level_map*>(this)->find(key));
+  }
+  // returns the level of key, an empty one is added if there is none
+  price_level& get(uint32_t key)
+  {
+    return m_levels[Cmp::rank(key)];
+  }
+  void erase(uint32_t key)
+  {
+    auto erased = m_levels.erase(Cmp::rank(key));
+    assert(erased == 1);
+    (void)erased;
+  }
+  uint32_t best_key() const
+  {
+    return Cmp::rank(m_levels.begin()->first);
+  }
+  price_level& best()
+  {
+    return m_levels.begin()->second;
+  }
+  const price_level& best() const
+  {
+    return m_levels.begin()->second;
+  }
+  // calls f(key, level) from the best price on while it returns true
+  template <class F>
+  void for_each(F f) const
+  {
+    for (const auto& kv : m_levels) {
+      if (!f(Cmp::rank(kv.first), kv.second)) {
+        return;
+      }
+    }
+  }
+private:
+  // ranks grow towards the best price
+  std::map<uint32_t, price_level, std::greater<uint32_t>> m_levels;
+};
+
+template <class Engines>
+class snapshot_history;
+template <class Engines>
+class delta_history;
+template <class Engines>
+class no_history;
+
+// the building blocks of an engine, fixed at compile time so that engines of
+// several configurations can run side by side without virtual calls on the hot
+// path; a policy derives from another to replace single members of it.
+// levels indexes the price levels of one book side and so decides how prices
+// are looked up, id_map and id_set index order ids, history keeps the states
+// answering historical queries
+struct default_engine_policy
+{
+  template <class Cmp>
+  using levels = price_level_index<Cmp>;
+  template <class V>
+  using id_map = flat_id_map<V>;
+  using id_set = flat_id_set;
+  template <class Engines>
+  using history = delta_history<Engines>;
+};
+
+// prices on the cent grid are found as ticks in a bitmap
+struct tick_engine_policy : default_engine_policy
+{
+  template <class Cmp>
+  using levels = price_tick_index<Cmp>;
+};
+
+// price levels in a std::map, for books spread over many levels
+struct map_engine_policy : default_engine_policy
+{
+  template <class Cmp>
+  using levels = price_level_map<Cmp>;
+};
+
+// order ids go to the standard library hash tables
+struct std_hash_engine_policy : default_engine_policy
+{
+  template <class V>
+  using id_map = std::unordered_map<uint64_t, V>;
+  using id_set = std::unordered_set<uint64_t>;
+};
+
+// Base without the history, for runs without historical queries which then print nothing
+template <class Base>
+struct no_history_policy : Base
+{
+  template <class Engines>
+  using history = no_history<Engines>;
+};
+
+// Base keeping a full copy of the engines per timestamp as history
+template <class Base>
+struct snapshot_history_policy : Base
+{
+  template <class Engines>
+  using history = snapshot_history<Engines>;
+};
+
+template <class Ord, class Cmp, class Policy = default_engine_policy>
+class limit_order_queue
+{
+public:
+  // orders of a level are matched in increasing seq
+  bool put_order(const Ord& o, uint64_t seq)
+  {
+    return put_order(o.get_data(), o.is_ioc(), seq);
+  }
+  bool put_order(const order_data& d, bool ioc, uint64_t seq)
+  {
+    return insert(d, price_to_key(d.get_price()), ioc, seq);
+  }
+  // pending stop orders are filed under their stop price
+  bool put_stop_order(const order_data& d, uint64_t seq)
+  {
+    return insert(d, price_to_key(d.get_stop_price()), false, seq);
+  }
+  bool cancel_order(uint64_t id)
+  {
+    auto elem = m_ids.find(id);
+    if (elem == m_ids.end()) {
+      return false;
+    }
+    const auto& c = m_cold[elem->second];
+    if (c.m_ioc) {
+      m_ioc.erase(id);
+    }
+    remove(elem->second);
+    m_ids.erase(elem);
+    return true;
+  }
+  // returns the number of ioc orders which were still resting
+  uint64_t drop_ioc()
+  {
+    uint64_t dropped = 0;
+    for (auto id : m_ioc) {
+      auto elem = m_ids.find(id);
+      if (elem != m_ids.end()) {
+        remove(elem->second);
+        m_ids.erase(elem);
+        ++dropped;
+      }
+    }
+    m_ioc.clear();
+    return dropped;
+  }
+  // cancels every order at once, their ids are appended to ids unless it is null;
+  // returns the number of cancelled orders
+  uint64_t cancel_all(std::vector<uint64_t>* ids)
+  {
+    if (ids != nullptr || m_track) {
+      for_each_order([&](const hot_order&, const cold_order& c) {
+        if (ids != nullptr) {
+          ids->push_back(c.m_id);
+        }
+        if (m_track) {
+          m_changed.push_back(c.m_id);
+        }
+        return true;
+      });
+    }
+    auto count = static_cast<uint64_t>(size());
+    m_levels.clear();
+    m_cold.clear();
+    m_free.clear();
+    m_ids.clear();
+    m_ioc.clear();
+    return count;
+  }
+  // cancels the orders of the levels priced from low to high, each level is
+  // released as a whole instead of leaving tombstones; the levels are walked
+  // from the touch on, so ranges near the touch are cheapest
+  uint64_t cancel_levels(float low, float high, std::vector<uint64_t>* ids)
+  {
+    auto r1 = Cmp::rank(price_to_key(low));
+    auto r2 = Cmp::rank(price_to_key(high));
+    auto worst = std::min(r1, r2);
+    auto best = std::max(r1, r2);
+    std::vector<uint32_t> keys;
+    m_levels.for_each([&](uint32_t key, const price_level&) {
+      auto r = Cmp::rank(key);
+      if (r < worst) {
+        return false;
+      }
+      if (r <= best) {
+        keys.push_back(key);
+      }
+      return true;
+    });
+    uint64_t count = 0;
+    for (auto key : keys) {
+      const auto& orders = m_levels.find(key)->m_orders;
+      for (const auto& h : orders) {
+        if (h.m_handle == dead_handle) {
+          continue;
+        }
+        const auto& c = m_cold[h.m_handle];
+        if (c.m_ioc) {
+          m_ioc.erase(c.m_id);
+        }
+        if (ids != nullptr) {
+          ids->push_back(c.m_id);
+        }
+        if (m_track) {
+          m_changed.push_back(c.m_id);
+        }
+        m_ids.erase(c.m_id);
+        m_free.push_back(h.m_handle);
+        ++count;
+      }
+      m_levels.erase(key);
+    }
+    return count;
+  }
+  // number of orders with a sequence of seq or later, found from the back of
+  // every level
+  uint64_t count_from(uint64_t seq) const
+  {
+    uint64_t count = 0;
+    m_levels.for_each([&](uint32_t, const price_level& lvl) {
+      hot_order h{ seq, 0, 0 };
+      auto iter = std::lower_bound(lvl.m_orders.begin() + lvl.m_head, lvl.m_orders.end(), h, hot_order_less());
+      for (; iter != lvl.m_orders.end(); ++iter) {
+        count += iter->m_handle != dead_handle ? 1 : 0;
+      }
+      return true;
+    });
+    return count;
+  }
+  // number of distinct prices in the queue
+  uint64_t get_level_count() const
+  {
+    return m_levels.size();
+  }
+  size_t size() const
+  {
+    return m_ids.size();
+  }
+  bool empty() const
+  {
+    return m_ids.empty();
+  }
+  void save(snapshot_writer& w) const
+  {
+    w.put(static_cast<uint64_t>(size()));
+    for_each_order([&](const hot_order& h, const cold_order& c) {
+      w.put(make_record(h, c));
+      return true;
+    });
+  }
+  // replaces the content with the orders of a saved queue, the records come in
+  // queue order so every order is appended to its level
+  void load(snapshot_reader& r)
+  {
+    m_levels.clear();
+    m_cold.clear();
+    m_free.clear();
+    m_ids.clear();
+    m_ioc.clear();
+    auto count = r.get<uint64_t>();
+    if (count > r.get_remaining() / sizeof(snapshot_order_record)) {
+      throw snapshot_error("snapshot is truncated");
+    }
+    m_ids.reserve(count);
+    m_cold.reserve(count);
+    for (uint64_t i = 0; i < count; ++i) {
+      restore_order(r.get<snapshot_order_record>());
+    }
+    m_changed.clear();
+  }
+  // puts back an order as saved, an order of the same id must not be in the queue
+  void restore_order(const snapshot_order_record& rec)
+  {
+    check_order_record(rec);
+    order_data d(rec.m_id, 0, std::string(), rec.m_price, rec.m_q,
+      static_cast<order_side>(rec.m_order_side), static_cast<order_type>(rec.m_order_type));
+    d.set_matched_q(rec.m_matched_q);
+    d.set_min_q(rec.m_min_q);
+    d.set_peak(rec.m_peak);
+    // the shown slice is never more than the peak, so it is taken as it is
+    if (insert(d, price_to_key(rec.m_key_price), rec.m_ioc != 0, rec.m_seq)) {
+      auto& c = m_cold[m_ids.find(rec.m_id)->second];
+      c.m_reserve = rec.m_reserve;
+      m_levels.find(c.m_key)->m_reserve += c.m_reserve;
+    }
+  }
+  // the saved form of a resting order
+  bool find_record(uint64_t id, snapshot_order_record& rec) const
+  {
+    auto elem = m_ids.find(id);
+    if (elem == m_ids.end()) {
+      return false;
+    }
+    rec = make_record(m_levels.find(m_cold[elem->second].m_key)->m_orders[find_hot(elem->second)], m_cold[elem->second]);
+    return true;
+  }
+  // from now on the ids of added, removed and modified orders are collected for
+  // take_changes, an id may show up more than once
+  void track_changes(bool track)
+  {
+    m_track = track;
+    m_changed.clear();
+  }
+  void take_changes(std::vector<uint64_t>& ids)
+  {
+    ids.insert(ids.end(), m_changed.begin(), m_changed.end());
+    m_changed.clear();
+  }
+  // makes room for count resting orders without rehashing the id index
+  void reserve(size_t count)
+  {
+    m_ids.reserve(count);
+    m_cold.reserve(count);
+  }
+  bool id_exists(uint64_t id) const
+  {
+    return m_ids.count(id) > 0;
+  }
+  // rebuilds the data of a resting order, without the symbol and time, the
+  // quantity of an iceberg includes its reserve; seq is set to the priority of
+  // the order
+  bool find_order(uint64_t id, order_data& out, uint64_t& seq) const
+  {
+    auto elem = m_ids.find(id);
+    if (elem == m_ids.end()) {
+      return false;
+    }
+    const auto& c = m_cold[elem->second];
+    const auto& h = m_levels.find(c.m_key)->m_orders[find_hot(elem->second)];
+    out = order_data(c.m_id, 0, std::string(), c.m_price, h.m_q + c.m_reserve,
+      static_cast<order_side>(c.m_order_side), static_cast<order_type>(c.m_order_type));
+    out.set_matched_q(c.m_matched_q);
+    out.set_min_q(c.m_min_q);
+    out.set_peak(c.m_peak);
+    seq = c.m_seq;
+    return true;
+  }
+  float get_best_price() const
+  {
+    assert(!empty());
+    const auto& lvl = m_levels.best();
+    return m_cold[lvl.m_orders[lvl.m_head].m_handle].m_price;
+  }
+  // the price the best level is filed under, differs from get_best_price for stop orders
+  float get_best_key_price() const
+  {
+    assert(!empty());
+    return key_to_price(m_levels.best_key());
+  }
+  hot_order& top_order()
+  {
+    assert(!empty());
+    auto& lvl = m_levels.best();
+    return lvl.m_orders[lvl.m_head];
+  }
+  // the order is taken as modified
+  cold_order& get_cold(const hot_order& h)
+  {
+    if (m_track) {
+      m_changed.push_back(m_cold[h.m_handle].m_id);
+    }
+    return m_cold[h.m_handle];
+  }
+  void pop_order()
+  {
+    assert(!empty());
+    auto& lvl = m_levels.best();
+    auto handle = lvl.m_orders[lvl.m_head].m_handle;
+    m_ids.erase(m_cold[handle].m_id);
+    remove(m_levels.best_key(), lvl, lvl.m_head);
+  }
+  // calls f(rec) with the saved form of every order in queue order
+  template <class F>
+  void for_each_record(F f) const
+  {
+    for_each_order([&](const hot_order& h, const cold_order& c) {
+      f(make_record(h, c));
+      return true;
+    });
+  }
+  // calls f(hot, cold) for the orders in queue order while it returns true
+  template <class F>
+  void for_each_order(F f) const
+  {
+    m_levels.for_each([&](uint32_t, const price_level& lvl) {
+      const auto& orders = lvl.m_orders;
+      for (size_t i = lvl.m_head; i < orders.size(); ++i) {
+        if (orders[i].m_handle != dead_handle && !f(orders[i], m_cold[orders[i].m_handle])) {
+          return false;
+        }
+      }
+      return true;
+    });
+  }
+  // calls f(price, q, count, reserve) for the levels in queue order while it
+  // returns true, q is the shown quantity and reserve the hidden one
+  template <class F>
+  void for_each_level(F f) const
+  {
+    m_levels.for_each([&](uint32_t key, const price_level& lvl) {
+      return f(key_to_price(key), lvl.m_q, static_cast<uint64_t>(lvl.m_live), lvl.m_reserve);
+    });
+  }
+  uint64_t get_total_q() const
+  {
+    uint64_t q = 0;
+    m_levels.for_each([&](uint32_t, const price_level& lvl) {
+      q += lvl.m_q;
+      return true;
+    });
+    return q;
+  }
+  // quantity of the orders without a pending minimum on the levels priced at price
+  // or better, iceberg reserves included, from the level totals; the count stops
+  // once it reaches enough
+  uint64_t get_firm_q(float price, uint64_t enough) const
+  {
+    auto worst = Cmp::rank(price_to_key(price));
+    uint64_t q = 0;
+    m_levels.for_each([&](uint32_t key, const price_level& lvl) {
+      if (Cmp::rank(key) < worst) {
+        return false;
+      }
+      q += lvl.m_q - lvl.m_conditional_q + lvl.m_reserve;
+      return q < enough;
+    });
+    return q;
+  }
+  // the minimum quantity of the top order, 0 if it has none or has traded already
+  uint64_t get_top_min_q() const
+  {
+    assert(!empty());
+    const auto& lvl = m_levels.best();
+    return m_cold[lvl.m_orders[lvl.m_head].m_handle].m_min_q;
+  }
+  // takes q off the top order, which keeps some quantity; a pending minimum is dropped
+  // first, once an order trades it has none
+  void reduce_top(uint64_t q)
+  {
+    assert(!empty());
+    clear_top_min_q();
+    auto& lvl = m_levels.best();
+    auto& h = lvl.m_orders[lvl.m_head];
+    assert(h.m_q > q);
+    h.m_q -= q;
+    lvl.m_q -= q;
+  }
+  // hidden quantity of the top order
+  uint64_t get_top_reserve() const
+  {
+    assert(!empty());
+    const auto& lvl = m_levels.best();
+    return m_cold[lvl.m_orders[lvl.m_head].m_handle].m_reserve;
+  }
+  // the shown slice of the top iceberg order has traded: the next slice from the
+  // reserve goes to the back of the level under seq, which is newer than any in
+  // the queue. The order keeps its handle and id entry, so this is a tombstone
+  // and an append instead of a cancel and a put
+  void replenish_top(uint64_t seq)
+  {
+    assert(get_top_reserve() != 0);
+    auto& lvl = m_levels.best();
+    auto& orders = lvl.m_orders;
+    auto handle = orders[lvl.m_head].m_handle;
+    auto& c = m_cold[handle];
+    assert(orders.back().m_seq < seq);
+    auto slice = std::min(c.m_peak, c.m_reserve);
+    c.m_reserve -= slice;
+    lvl.m_reserve -= slice;
+    c.m_seq = seq;
+    lvl.m_q = lvl.m_q - orders[lvl.m_head].m_q + slice;
+    orders[lvl.m_head].m_handle = dead_handle;
+    orders[lvl.m_head].m_q = 0;
+    orders.push_back(hot_order{ seq, slice, handle });
+    if (m_track) {
+      m_changed.push_back(c.m_id);
+    }
+    skip_dead(lvl);
+  }
+  void clear_top_min_q()
+  {
+    auto& lvl = m_levels.best();
+    const auto& h = lvl.m_orders[lvl.m_head];
+    auto& c = m_cold[h.m_handle];
+    if (c.m_min_q != 0) {
+      c.m_min_q = 0;
+      lvl.m_conditional_q -= h.m_q;
+      if (m_track) {
+        m_changed.push_back(c.m_id);
+      }
+    }
+  }
+private:
+  static const uint32_t dead_handle = UINT32_MAX;
+
+  static snapshot_order_record make_record(const hot_order& h, const cold_order& c)
+  {
+    snapshot_order_record rec{};
+    rec.m_id = c.m_id;
+    rec.m_q = h.m_q;
+    rec.m_matched_q = c.m_matched_q;
+    rec.m_seq = h.m_seq;
+    rec.m_min_q = c.m_min_q;
+    rec.m_peak = c.m_peak;
+    rec.m_reserve = c.m_reserve;
+    rec.m_price = c.m_price;
+    rec.m_key_price = key_to_price(c.m_key);
+    rec.m_order_side = c.m_order_side;
+    rec.m_order_type = c.m_order_type;
+    rec.m_ioc = c.m_ioc;
+    return rec;
+  }
+  bool insert(const order_data& d, uint32_t key, bool ioc, uint64_t seq)
+  {
+    auto res = m_ids.emplace(d.get_id(), 0);
+    if (!res.second) {
+      return false;
+    }
+    uint32_t handle;
+    if (!m_free.empty()) {
+      handle = m_free.back();
+      m_free.pop_back();
+    }
+    else {
+      handle = static_cast<uint32_t>(m_cold.size());
+      m_cold.emplace_back();
+    }
+    res.first->second = handle;
+    auto& c = m_cold[handle];
+    c.m_id = d.get_id();
+    c.m_matched_q = d.get_matched_q();
+    c.m_seq = seq;
+    c.m_min_q = d.get_min_q();
+    c.m_peak = d.get_peak();
+    c.m_key = key;
+    c.m_price = d.get_price();
+    c.m_order_side = static_cast<uint8_t>(to_underlying(d.get_order_side()));
+    c.m_order_type = static_cast<uint8_t>(to_underlying(d.get_order_type()));
+    c.m_ioc = ioc ? 1 : 0;
+
+    // an iceberg shows one peak, the rest waits in the reserve
+    auto shown = d.get_peak() != 0 ? std::min(d.get_q(), d.get_peak()) : d.get_q();
+    c.m_reserve = d.get_q() - shown;
+    hot_order h{ seq, shown, handle };
+    auto& lvl = m_levels.get(key);
+    auto& orders = lvl.m_orders;
+    if (orders.empty() || !hot_order_less()(h, orders.back())) {
+      orders.push_back(h);
+    }
+    else {
+      orders.insert(std::upper_bound(orders.begin() + lvl.m_head, orders.end(), h, hot_order_less()), h);
+    }
+    ++lvl.m_live;
+    lvl.m_q += h.m_q;
+    lvl.m_reserve += c.m_reserve;
+    if (c.m_min_q != 0) {
+      lvl.m_conditional_q += h.m_q;
+    }
+    if (ioc) {
+      m_ioc.insert(d.get_id());
+    }
+    if (m_track) {
+      m_changed.push_back(d.get_id());
+    }
+    return true;
+  }
+  // an amend which keeps its priority leaves a tombstone of the same seq
+  // in front of the order
+  size_t find_hot(uint32_t handle) const
+  {
+    const auto& c = m_cold[handle];
+    const auto& lvl = *m_levels.find(c.m_key);
+    hot_order h{ c.m_seq, 0, 0 };
+    auto iter = std::lower_bound(lvl.m_orders.begin() + lvl.m_head, lvl.m_orders.end(), h, hot_order_less());
+    while (iter->m_handle != handle) {
+      assert(iter->m_seq == c.m_seq);
+      ++iter;
+    }
+    return iter - lvl.m_orders.begin();
+  }
+  void remove(uint32_t handle)
+  {
+    auto idx = find_hot(handle);
+    auto key = m_cold[handle].m_key;
+    remove(key, *m_levels.find(key), idx);
+  }
+  // the id index is left to the caller
+  void remove(uint32_t key, price_level& lvl, size_t idx)
+  {
+    auto& orders = lvl.m_orders;
+    if (m_track) {
+      m_changed.push_back(m_cold[orders[idx].m_handle].m_id);
+    }
+    m_free.push_back(orders[idx].m_handle);
+    lvl.m_q -= orders[idx].m_q;
+    lvl.m_reserve -= m_cold[orders[idx].m_handle].m_reserve;
+    if (m_cold[orders[idx].m_handle].m_min_q != 0) {
+      lvl.m_conditional_q -= orders[idx].m_q;
+    }
+    orders[idx].m_handle = dead_handle;
+    orders[idx].m_q = 0;
+    if (--lvl.m_live == 0) {
+      m_levels.erase(key);
+      return;
+    }
+    skip_dead(lvl);
+  }
+  // moves the head to the first live order, and drops the tombstones once they
+  // outnumber the live orders
+  static void skip_dead(price_level& lvl)
+  {
+    auto& orders = lvl.m_orders;
+    while (orders[lvl.m_head].m_handle == dead_handle) {
+      ++lvl.m_head;
+    }
+    if (orders.size() - lvl.m_live > std::max<size_t>(lvl.m_live, 16)) {
+      orders.erase(std::remove_if(orders.begin(), orders.end(), [](const hot_order& h) {
+        return h.m_handle == dead_handle;
+      }), orders.end());
+      lvl.m_head = 0;
+    }
+  }
+
+  typename Policy::template levels<Cmp> m_levels;
+  std::vector<cold_order> m_cold;
+  std::vector<uint32_t> m_free;
+  typename Policy::template id_map<uint32_t> m_ids;
+  typename Policy::id_set m_ioc;
+  bool m_track = false;
+  std::vector<uint64_t> m_changed;
+};
+
+class limit_order_buy_queue: public limit_order_queue<limit_order_buy, limit_order_buy_less>
+{
+public:
+};
+
+class limit_order_sell_queue: public limit_order_queue<limit_order_sell, limit_order_sell_less>
+{
+public:
+};
+
+
+//template <class Ord>
+//class market_order_cont : public std::unordered_map<uint64_t, Ord>
+//{
+//public:
+//  bool id_exists(uint64_t id) const
+//  {
+//    auto cnt = this->count(id);
+//    if (cnt > 0) {
+//      return true;
+//    }
+//    return false;
+//  }
+//
+//  bool put_order(const Ord& o)
+//  {
+//    auto ret = this->insert(std::make_pair(o.get_id(), o));
+//    return ret.second;
+//  }
+//  bool cancel_order(uint64_t id)
+//  {
+//    auto iter = this->find(id);
+//    if (iter == this->end()) {
+//      return false;
+//    }
+//    this->erase(iter);
+//    return true;
+//  }
+//};
+
+using market_order_buy_cont = limit_order_queue<limit_order_buy, limit_order_buy_less>;
+using market_order_sell_cont = limit_order_queue<limit_order_sell, limit_order_sell_less>;
+
+// random level inserts, lookups and erases on an index checked against a std::map
+// ordered best first, the keys are spread around a centre which drifts now and then;
+// cents draws prices in cents with some neighbours off the cent grid, otherwise keys
+// are drawn directly
+template <class Index, class Better>
+void check_level_index(std::mt19937& gen, uint32_t spread, bool cents)
+{
+  Index index;
+  std::map<uint32_t, size_t, Better> model;
+  int64_t centre = cents ? 5000 : price_to_key(50.0f);
+  for (int i = 0; i < 20000; ++i) {
+    if (gen() % 1000 == 0) {
+      centre += static_cast<int64_t>(gen() % spread) - spread / 2;
+    }
+    auto v = centre - spread / 2 + gen() % spread;
+    auto key = static_cast<uint32_t>(v);
+    if (cents) {
+      key = price_to_key(static_cast<float>(v * 0.01)) + (gen() % 8 == 0 ? 1 : 0);
+    }
+    switch (gen() % 4) {
+    case 0:
+      index.get(key).m_live = key;
+      model[key] = key;
+      break;
+    case 1:
+      assert((index.find(key) != nullptr) == (model.count(key) != 0));
+      break;
+    case 2: {
+      auto iter = model.lower_bound(key);
+      if (iter != model.end()) {
+        index.erase(iter->first);
+        model.erase(iter);
+      }
+      break;
+    }
+    default:
+      if (!model.empty()) {
+        index.erase(model.begin()->first);
+        model.erase(model.begin());
+      }
+      break;
+    }
+    assert(index.size() == model.size());
+    if (!model.empty()) {
+      assert(index.best_key() == model.begin()->first);
+      assert(index.best().m_live == model.begin()->first);
+    }
+  }
+  auto iter = model.begin();
+  index.for_each([&](uint32_t key, const price_level& lvl) {
+    assert(iter != model.end() && iter->first == key && lvl.m_live == key);
+    ++iter;
+    return true;
+  });
+  assert(iter == model.end());
+  size_t visited = 0;
+  index.for_each([&](uint32_t, const price_level&) {
+    return ++visited < 5;
+  });
+  assert(visited == std::min<size_t>(5, model.size()));
+}
+
+// the level indexes against a std::map, prices packed near the touch and spread
+// far wider than the tick window, and every count_less variant against the scalar one
+void basic_level_index_tests()
+{
+  std::mt19937 gen(3);
+  check_level_index<price_level_index<limit_order_sell_less>, std::less<uint32_t>>(gen, 300, false);
+  check_level_index<price_level_index<limit_order_buy_less>, std::greater<uint32_t>>(gen, 1u << 24, false);
+  check_level_index<price_tick_index<limit_order_sell_less>, std::less<uint32_t>>(gen, 300, false);
+  check_level_index<price_tick_index<limit_order_sell_less>, std::less<uint32_t>>(gen, 300, true);
+  check_level_index<price_tick_index<limit_order_buy_less>, std::greater<uint32_t>>(gen, 300, true);
+  check_level_index<price_tick_index<limit_order_sell_less>, std::less<uint32_t>>(gen, 1u << 18, true);
+  check_level_index<price_tick_index<limit_order_buy_less>, std::greater<uint32_t>>(gen, 1u << 20, true);
+  check_level_index<price_level_map<limit_order_sell_less>, std::less<uint32_t>>(gen, 300, false);
+  check_level_index<price_level_map<limit_order_buy_less>, std::greater<uint32_t>>(gen, 1u << 24, false);
+
+  std::vector<int32_t> a(100);
+  for (auto& v : a) {
+    v = static_cast<int32_t>(gen());
+  }
+  for (size_t n = 0; n <= a.size(); ++n) {
+    auto v = static_cast<int32_t>(gen());
+    auto expected = count_less_scalar(a.data(), n, v);
+    assert(count_less(a.data(), n, v) == expected);
+#if defined(EOM_X86)
+    assert(count_less_sse2(a.data(), n, v) == expected);
+    if (cpu_has_avx2()) {
+      assert(count_less_avx2(a.data(), n, v) == expected);
+    }
+#endif
+  }
+}
+
+// random inserts, lookups and erases on the flat id tables checked against the
+// standard ones, with dense ids as well as ids sharing their low bits
+void basic_id_table_tests()
+{
+  std::mt19937_64 gen(5);
+  for (int pattern = 0; pattern < 3; ++pattern) {
+    flat_id_map<std::string> map;
+    flat_id_set set(100);
+    std::unordered_map<uint64_t, std::string> model;
+    auto next_id = [&]() -> uint64_t {
+      switch (pattern) {
+      case 0:
+        return gen() % 3000;
+      case 1:
+        return (gen() % 3000) << 40;
+      default:
+        return gen();
+      }
+    };
+    std::vector<uint64_t> seen;
+    for (int i = 0; i < 50000; ++i) {
+      auto id = gen() % 2 == 0 || seen.empty() ? next_id() : seen[gen() % seen.size()];
+      switch (gen() % 4) {
+      case 0: {
+        auto value = std::to_string(id);
+        auto res = map.emplace(id, value);
+        auto model_res = model.emplace(id, value);
+        assert(res.second == model_res.second);
+        assert(res.first->first == id && res.first->second == model[id]);
+        set.insert(id);
+        seen.push_back(id);
+        break;
+      }
+      case 1: {
+        auto iter = map.find(id);
+        auto expected = model.find(id);
+        assert((iter == map.end()) == (expected == model.end()));
+        assert(iter == map.end() || iter->second == expected->second);
+        assert(set.count(id) == model.count(id));
+        break;
+      }
+      default:
+        if (gen() % 2 == 0) {
+          auto iter = map.find(id);
+          if (iter != map.end()) {
+            map.erase(iter);
+          }
+        }
+        else {
+          map.erase(id);
+        }
+        auto erased = set.erase(id);
+        auto model_erased = model.erase(id);
+        assert(erased == model_erased);
+        break;
+      }
+      assert(map.size() == model.size() && set.size() == model.size());
+    }
+    size_t visited = 0;
+    for (const auto& elem : map) {
+      assert(model.at(elem.first) == elem.second);
+      ++visited;
+    }
+    for (auto id : set) {
+      assert(model.count(id) == 1);
+    }
+    assert(visited == model.size());
+    map.clear();
+    assert(map.empty() && map.find(seen.back()) == map.end() && map.begin() == map.end());
+    map[7] = "seven";
+    assert(map.size() == 1 && map[7] == "seven");
+  }
+}
+
+// ids of the orders of q in queue order
+template <class Q>
+std::vector<uint64_t> queue_ids(const Q& q)
+{
+  std::vector<uint64_t> ret;
+  q.for_each_order([&](const hot_order&, const cold_order& c) {
+    ret.push_back(c.m_id);
+    return true;
+  });
+  return ret;
+}
+
+void basic_buy_queue_tests()
+{
+  {
+    limit_order_buy_queue bq;
+    limit_order_buy b1({ 1, 1, "n", 1.0f, 1, order_side::buy, order_type::limit});
+    bq.put_order(b1, 1);
+
+    limit_order_buy b2({ 2, 1, "n", 1.0f, 1, order_side::buy, order_type::limit});
+    bq.put_order(b2, 2);
+
+    assert(bq.size() == 2);
+    assert(queue_ids(bq) == std::vector<uint64_t>({ 1, 2 }));
+  }
+  {
+    limit_order_buy_queue bq;
+    limit_order_buy b1({ 1, 2, "n", 1.0f, 1, order_side::buy, order_type::limit });
+    bq.put_order(b1, 2);
+
+    limit_order_buy b2({ 2, 1, "n", 1.0f, 1, order_side::buy, order_type::limit });
+    bq.put_order(b2, 1);
+
+    assert(bq.size() == 2);
+    assert(queue_ids(bq) == std::vector<uint64_t>({ 2, 1 }));
+  }
+
+  {
+    limit_order_buy_queue bq;
+    limit_order_buy b1({ 1, 1, "n", 2.0f, 1, order_side::buy, order_type::limit });
+    bq.put_order(b1, 1);
+
+    limit_order_buy b2({ 2, 1, "n", 1.0f, 1, order_side::buy, order_type::limit });
+    bq.put_order(b2, 2);
+
+    assert(bq.size() == 2);
+    assert(queue_ids(bq) == std::vector<uint64_t>({ 1, 2 }));
+  }
+}
+
+void basic_sell_queue_tests()
+{
+  {
+    limit_order_sell_queue bq;
+    limit_order_sell b1({ 1, 1, "n", 1.0f, 1, order_side::sell, order_type::limit });
+    bq.put_order(b1, 1);
+
+    limit_order_sell b2({ 2, 1, "n", 1.0f, 1, order_side::sell, order_type::limit });
+    bq.put_order(b2, 2);
+
+    assert(bq.size() == 2);
+    assert(queue_ids(bq) == std::vector<uint64_t>({ 1, 2 }));
+  }
+  {
+    limit_order_sell_queue bq;
+    limit_order_sell b1({ 1, 2, "n", 1.0f, 1, order_side::sell, order_type::limit });
+    bq.put_order(b1, 2);
+
+    limit_order_sell b2({ 2, 1, "n", 1.0f, 1, order_side::sell, order_type::limit });
+    bq.put_order(b2, 1);
+
+    assert(bq.size() == 2);
+    assert(queue_ids(bq) == std::vector<uint64_t>({ 2, 1 }));
+  }
+  {
+    limit_order_sell_queue bq;
+    limit_order_sell b1({ 1, 1, "n", 2.0f, 1, order_side::sell, order_type::limit });
+    bq.put_order(b1, 1);
+
+    limit_order_sell b2({ 2, 1, "n", 1.0f, 1, order_side::sell, order_type::limit });
+    bq.put_order(b2, 2);
+
+    assert(bq.size() == 2);
+    assert(queue_ids(bq) == std::vector<uint64_t>({ 2, 1 }));
+  }
+}
+
+void basic_queue_level_tests()
+{
+  limit_order_buy_queue bq;
+  bq.put_order(limit_order_buy({ 1, 1, "n", 2.0f, 1, order_side::buy, order_type::limit }), 1);
+  bq.put_order(limit_order_buy({ 2, 2, "n", 1.0f, 1, order_side::buy, order_type::limit }), 2);
+  bq.put_order(limit_order_buy({ 3, 3, "n", 2.0f, 1, order_side::buy, order_type::limit }), 3);
+  assert(bq.get_level_count() == 2);
+
+  bq.cancel_order(1);
+  assert(bq.get_level_count() == 2);
+  bq.pop_order();
+  assert(bq.get_level_count() == 1);
+  bq.cancel_order(2);
+  assert(bq.get_level_count() == 0);
+  assert(bq.empty());
+
+  // a lower seq goes before the orders of its level, cancels in the middle
+  // of a level leave tombstones which are compacted away
+  std::vector<uint64_t> expected;
+  for (uint64_t i = 10; i < 60; ++i) {
+    bq.put_order(limit_order_buy({ i, 1, "n", 1.0f, i, order_side::buy, order_type::limit }), i);
+  }
+  bq.put_order(limit_order_buy({ 5, 1, "n", 1.0f, 5, order_side::buy, order_type::limit }), 5);
+  expected.push_back(5);
+  for (uint64_t i = 10; i < 60; ++i) {
+    if (i % 3 != 0) {
+      bool cancelled = bq.cancel_order(i);
+      assert(cancelled);
+    }
+    else {
+      expected.push_back(i);
+    }
+  }
+  assert(queue_ids(bq) == expected);
+  assert(bq.get_level_count() == 1);
+  bq.pop_order();
+  assert(bq.top_order().m_q == 12);
+  order_data d;
+  uint64_t seq = 0;
+  bool found = bq.find_order(57, d, seq);
+  assert(found && d.get_q() == 57 && seq == 57);
+  found = bq.find_order(58, d, seq);
+  assert(!found);
+}
+
+std::string float_to_string(float val)
+{
+  std::ostringstream str;
+  str.precision(2);
+  str.setf(std::ios::fixed, std::ios::floatfield);
+  str << val;
+  return str.str();
+}
+
+struct matched_result_detail
+{
+  std::string m_symb;
+  struct matched_buy {
+    uint64_t m_order_id;
+    order_type m_order_type;
+    uint64_t m_q;
+    float m_price;
+
+    std::string to_string() const
+    {
+      std::string ret;
+
+      ret += std::to_string(m_order_id);
+      ret += ',';
+      ret += order_type_to_char(m_order_type);
+      ret += ',';
+      ret += std::to_string(m_q);
+      ret += ',';
+      ret += float_to_string(m_price);
+
+      return ret;
+    }
+  };
+  struct matched_sell {
+    float m_price;
+    uint64_t m_q;
+    order_type m_order_type;
+    uint64_t m_id;
+
+    std::string to_string() const
+    {
+      std::string ret;
+
+      ret += float_to_string(m_price);
+      ret += ',';
+      ret += std::to_string(m_q);
+      ret += ',';
+      ret += order_type_to_char(m_order_type);
+      ret += ',';
+      ret += std::to_string(m_id);
+      return ret;
+    }
+  };
+
+  matched_buy m_matched_buy;
+  matched_sell m_matched_sell;
+
+  std::string to_string() const
+  {
+    std::string ret;
+
+    ret += m_symb;
+    ret += '|';
+    ret += m_matched_buy.to_string();
+    ret += '|';
+    ret += m_matched_sell.to_string();
+
+    return ret;
+  }
+};
+
+struct order_engine_stats
+{
+  uint64_t m_buy_orders = 0;
+  uint64_t m_sell_orders = 0;
+  uint64_t m_buy_market_orders = 0;
+  uint64_t m_sell_market_orders = 0;
+  // stop orders waiting for their stop price
+  uint64_t m_buy_stop_orders = 0;
+  uint64_t m_sell_stop_orders = 0;
+  uint64_t m_buy_levels = 0;
+  uint64_t m_sell_levels = 0;
+  uint64_t m_ioc_expired = 0;
+  // market orders still resting after the first matching pass they took part
+  // in, each counted once
+  uint64_t m_market_unfilled = 0;
+  uint64_t m_stops_triggered = 0;
+  // fill or kill and minimum quantity orders which could not trade their minimum
+  uint64_t m_min_q_killed = 0;
+  // new iceberg slices shown from the reserve
+  uint64_t m_replenished = 0;
+  uint64_t m_fills = 0;
+  uint64_t m_volume = 0;
+
+  uint64_t get_resting_orders() const
+  {
+    return m_buy_orders + m_sell_orders + m_buy_market_orders + m_sell_market_orders
+      + m_buy_stop_orders + m_sell_stop_orders;
+  }
+  // rough estimate of the heap held by the books of one symbol
+  uint64_t get_memory_usage() const
+  {
+    // hot and cold records plus the id index slot, level headers and free slots are left out
+    const uint64_t order_bytes = sizeof(hot_order) + sizeof(cold_order)
+      + sizeof(std::pair<uint64_t, uint32_t>) + sizeof(uint8_t);
+    return get_resting_orders() * order_bytes;
+  }
+  std::string to_string() const
+  {
+    std::string ret;
+
+    ret += "buy_orders=" + std::to_string(m_buy_orders);
+    ret += ",sell_orders=" + std::to_string(m_sell_orders);
+    ret += ",buy_market=" + std::to_string(m_buy_market_orders);
+    ret += ",sell_market=" + std::to_string(m_sell_market_orders);
+    ret += ",buy_stops=" + std::to_string(m_buy_stop_orders);
+    ret += ",sell_stops=" + std::to_string(m_sell_stop_orders);
+    ret += ",buy_levels=" + std::to_string(m_buy_levels);
+    ret += ",sell_levels=" + std::to_string(m_sell_levels);
+    ret += ",ioc_expired=" + std::to_string(m_ioc_expired);
+    ret += ",market_unfilled=" + std::to_string(m_market_unfilled);
+    ret += ",stops_triggered=" + std::to_string(m_stops_triggered);
+    ret += ",min_q_killed=" + std::to_string(m_min_q_killed);
+    ret += ",replenished=" + std::to_string(m_replenished);
+    ret += ",fills=" + std::to_string(m_fills);
+    ret += ",volume=" + std::to_string(m_volume);
+
+    return ret;
+  }
+};
+
+struct depth_entry
+{
+  uint64_t m_id = 0;
+  uint64_t m_q = 0;
+  float m_price = 0.0f;
+  order_type m_order_type = order_type::limit;
+};
+
+struct depth_row
+{
+  bool m_has_buy = false;
+  bool m_has_sell = false;
+  depth_entry m_buy;
+  depth_entry m_sell;
+};
+
+struct level_entry
+{
+  float m_price = 0.0f;
+  uint64_t m_q = 0;
+  uint64_t m_count = 0;
+  bool m_market = false;
+};
+
+struct level_row
+{
+  bool m_has_buy = false;
+  bool m_has_sell = false;
+  level_entry m_buy;
+  level_entry m_sell;
+};
+
+enum class amend_result {
+  not_found
+  , failed
+  , ok
+  , executed
+};
+
+template <class Policy>
+class basic_order_engine
+{
+public:
+  explicit basic_order_engine(const std::string& symb = std::string())
+    :m_symbol(symb)
+  {
+    init_put_func();
+  }
+
+  bool put_order(const order_data& d, order_side os, order_type ot)
+  {
+    if (id_exists(d.get_id())) {
+      return false;
+    }
+
+    auto ret = (this->*m_put_func.at(to_underlying(os)).at(to_underlying(ot)))(d);
+    if (ret) {
+      ++m_next_seq;
+    }
+    return ret;
+  }
+
+  amend_result amend_order(const order_data& od)
+  {
+    // a pending stop order is cancelled and entered again instead, and a minimum
+    // quantity and an iceberg peak are set on entry only
+    if (m_stop_buy_queue.id_exists(od.get_id()) || m_stop_sell_queue.id_exists(od.get_id())
+      || od.get_min_q() != 0 || od.get_peak() != 0) {
+      return amend_result::failed;
+    }
+    {
+      auto res = try_amend_order_in_limit_queue(m_limit_buy_queue, od);
+      switch (res) {
+      case amend_result::failed:
+      case amend_result::ok:
+      case amend_result::executed:
+        return res;
+      case amend_result::not_found:
+        break;// continue
+      };
+    }
+    {
+      auto res = try_amend_order_in_limit_queue(m_limit_sell_queue, od);
+      switch (res) {
+      case amend_result::failed:
+      case amend_result::ok:
+      case amend_result::executed:
+        return res;
+      case amend_result::not_found:
+        break;// continue
+      };
+    }
+    {
+      auto res = try_amend_order_in_limit_queue(m_market_order_buy_cont, od);
+      switch (res) {
+      case amend_result::failed:
+      case amend_result::ok:
+      case amend_result::executed:
+        return res;
+      case amend_result::not_found:
+        break;// continue
+      };
+    }
+    {
+      auto res = try_amend_order_in_limit_queue(m_market_order_sell_cont, od);
+      switch (res) {
+      case amend_result::failed:
+      case amend_result::ok:
+      case amend_result::executed:
+        return res;
+      case amend_result::not_found:
+          break;
+      };
+    }
+    return amend_result::not_found;
+  }
+
+  bool cancel_order(uint64_t id)
+  {
+    if (m_limit_buy_queue.cancel_order(id)) {
+      return true;
+    }
+    if (m_limit_sell_queue.cancel_order(id)) {
+      return true;
+    }
+    if (m_market_order_buy_cont.cancel_order(id)) {
+      return true;
+    }
+    if (m_market_order_sell_cont.cancel_order(id)) {
+      return true;
+    }
+    if (m_stop_buy_queue.cancel_order(id)) {
+      return true;
+    }
+    if (m_stop_sell_queue.cancel_order(id)) {
+      return true;
+    }
+    return false;
+  }
+  // cancels all resting orders of one side, limit, market and pending stop ones; the
+  // ids of the cancelled orders are appended to ids unless it is null, returns their number
+  uint64_t cancel_side(order_side os, std::vector<uint64_t>* ids)
+  {
+    if (os == order_side::buy) {
+      return m_limit_buy_queue.cancel_all(ids) + m_market_order_buy_cont.cancel_all(ids) + m_stop_buy_queue.cancel_all(ids);
+    }
+    return m_limit_sell_queue.cancel_all(ids) + m_market_order_sell_cont.cancel_all(ids) + m_stop_sell_queue.cancel_all(ids);
+  }
+  // same as cancel_side for the limit orders of a side priced from low to high
+  uint64_t cancel_price_range(order_side os, float low, float high, std::vector<uint64_t>* ids)
+  {
+    if (os == order_side::buy) {
+      return m_limit_buy_queue.cancel_levels(low, high, ids);
+    }
+    return m_limit_sell_queue.cancel_levels(low, high, ids);
+  }
+
+  // trades of a pass may trigger stop orders, which then trade in another pass of
+  // the same run
+  std::vector<matched_result_detail> run_matching()
+  {
+    std::vector<matched_result_detail> ret;
+    do {
+      match_pass(ret);
+    } while (release_stops() != 0);
+    end_matching(ret);
+    return ret;
+  }
+  // uncrosses the book in a single price call auction: the clearing price is the
+  // level price executing the most, ties go to the smallest surplus, then to the
+  // highest price for a buy surplus and the lowest for a sell surplus, and else to
+  // the middle of the tied prices as there is no reference price. All fills are
+  // at that price, orders trade in price then time priority, market orders first
+  std::vector<matched_result_detail> run_auction()
+  {
+    std::vector<matched_result_detail> ret;
+    float price = 0.0f;
+    auto volume = find_clearing_price(price);
+    m_auction.clear();
+    while (volume > 0) {
+      auto& buy_queue = m_market_order_buy_cont.empty() ? m_limit_buy_queue : m_market_order_buy_cont;
+      auto& sell_queue = m_market_order_sell_cont.empty() ? m_limit_sell_queue : m_market_order_sell_cont;
+      assert(&buy_queue == &m_market_order_buy_cont || m_limit_buy_queue.get_best_price() >= price);
+      assert(&sell_queue == &m_market_order_sell_cont || m_limit_sell_queue.get_best_price() <= price);
+      // an order of no quantity on top blocks the book as in continuous matching
+      auto traded = trade_top(buy_queue, sell_queue, price, volume, ret);
+      if (traded == 0) {
+        break;
+      }
+      volume -= traded;
+    }
+    // triggered stop orders wait for the next auction
+    release_stops();
+    end_matching(ret);
+    return ret;
+  }
+  void save(snapshot_writer& w) const
+  {
+    w.put(m_next_seq);
+    w.put(m_ioc_expired);
+    w.put(m_market_unfilled);
+    w.put(m_unfilled_from);
+    w.put(m_fills);
+    w.put(m_volume);
+    w.put(m_stops_triggered);
+    w.put(m_min_q_killed);
+    w.put(m_replenished);
+    w.put(static_cast<uint8_t>(m_has_last_price));
+    w.put(m_last_price);
+    m_limit_buy_queue.save(w);
+    m_limit_sell_queue.save(w);
+    m_market_order_buy_cont.save(w);
+    m_market_order_sell_cont.save(w);
+    m_stop_buy_queue.save(w);
+    m_stop_sell_queue.save(w);
+  }
+  void load(snapshot_reader& r, const std::string& symb)
+  {
+    m_next_seq = r.get<uint64_t>();
+    m_ioc_expired = r.get<uint64_t>();
+    m_market_unfilled = r.get<uint64_t>();
+    m_unfilled_from = r.get<uint64_t>();
+    m_fills = r.get<uint64_t>();
+    m_volume = r.get<uint64_t>();
+    m_stops_triggered = r.get<uint64_t>();
+    m_min_q_killed = r.get<uint64_t>();
+    m_replenished = r.get<uint64_t>();
+    m_has_last_price = r.get<uint8_t>() != 0;
+    m_last_price = r.get<float>();
+    m_symbol = symb;
+    m_limit_buy_queue.load(r);
+    m_limit_sell_queue.load(r);
+    m_market_order_buy_cont.load(r);
+    m_market_order_sell_cont.load(r);
+    m_stop_buy_queue.load(r);
+    m_stop_sell_queue.load(r);
+  }
+  // sizes both sides of the book for that many resting limit orders
+  void reserve(size_t orders_per_side)
+  {
+    m_limit_buy_queue.reserve(orders_per_side);
+    m_limit_sell_queue.reserve(orders_per_side);
+  }
+  // collects the ids of changed orders for take_changes, see limit_order_queue
+  void track_changes(bool track)
+  {
+    m_limit_buy_queue.track_changes(track);
+    m_limit_sell_queue.track_changes(track);
+    m_market_order_buy_cont.track_changes(track);
+    m_market_order_sell_cont.track_changes(track);
+    m_stop_buy_queue.track_changes(track);
+    m_stop_sell_queue.track_changes(track);
+  }
+  void take_changes(std::vector<uint64_t>& ids)
+  {
+    m_limit_buy_queue.take_changes(ids);
+    m_limit_sell_queue.take_changes(ids);
+    m_market_order_buy_cont.take_changes(ids);
+    m_market_order_sell_cont.take_changes(ids);
+    m_stop_buy_queue.take_changes(ids);
+    m_stop_sell_queue.take_changes(ids);
+  }
+  // calls f(rec) with the saved form of every resting order, queue by queue
+  template <class F>
+  void for_each_record(F f) const
+  {
+    m_limit_buy_queue.for_each_record(f);
+    m_limit_sell_queue.for_each_record(f);
+    m_market_order_buy_cont.for_each_record(f);
+    m_market_order_sell_cont.for_each_record(f);
+    m_stop_buy_queue.for_each_record(f);
+    m_stop_sell_queue.for_each_record(f);
+  }
+  // the saved form of a resting order, false if it is not in the book
+  bool find_record(uint64_t id, snapshot_order_record& rec) const
+  {
+    return m_limit_buy_queue.find_record(id, rec) || m_limit_sell_queue.find_record(id, rec)
+      || m_market_order_buy_cont.find_record(id, rec) || m_market_order_sell_cont.find_record(id, rec)
+      || m_stop_buy_queue.find_record(id, rec) || m_stop_sell_queue.find_record(id, rec);
+  }
+  // puts back a saved order, replacing the one of the same id if there is one
+  void restore_order(const snapshot_order_record& rec)
+  {
+    check_order_record(rec);
+    cancel_order(rec.m_id);
+    bool market = rec.m_order_type == to_underlying(order_type::market);
+    bool stop = is_stop_type(static_cast<order_type>(rec.m_order_type));
+    if (rec.m_order_side == to_underlying(order_side::buy)) {
+      if (stop) {
+        m_stop_buy_queue.restore_order(rec);
+      }
+      else {
+        (market ? m_market_order_buy_cont : m_limit_buy_queue).restore_order(rec);
+      }
+    }
+    else {
+      if (stop) {
+        m_stop_sell_queue.restore_order(rec);
+      }
+      else {
+        (market ? m_market_order_sell_cont : m_limit_sell_queue).restore_order(rec);
+      }
+    }
+  }
+  order_engine_stats get_stats() const
+  {
+    order_engine_stats st;
+    st.m_buy_orders = m_limit_buy_queue.size();
+    st.m_sell_orders = m_limit_sell_queue.size();
+    st.m_buy_market_orders = m_market_order_buy_cont.size();
+    st.m_sell_market_orders = m_market_order_sell_cont.size();
+    st.m_buy_stop_orders = m_stop_buy_queue.size();
+    st.m_sell_stop_orders = m_stop_sell_queue.size();
+    st.m_buy_levels = m_limit_buy_queue.get_level_count();
+    st.m_sell_levels = m_limit_sell_queue.get_level_count();
+    st.m_ioc_expired = m_ioc_expired;
+    st.m_market_unfilled = m_market_unfilled;
+    st.m_stops_triggered = m_stops_triggered;
+    st.m_min_q_killed = m_min_q_killed;
+    st.m_replenished = m_replenished;
+    st.m_fills = m_fills;
+    st.m_volume = m_volume;
+    return st;
+  }
+  // fills up to depth rows of the book, market orders first on each side,
+  // returns the number of rows written
+  size_t get_depth(depth_row* rows, size_t depth) const
+  {
+    auto buy_count = fill_depth_side(m_market_order_buy_cont, m_limit_buy_queue, rows, depth, &depth_row::m_buy);
+    auto sell_count = fill_depth_side(m_market_order_sell_cont, m_limit_sell_queue, rows, depth, &depth_row::m_sell);
+    auto count = std::max(buy_count, sell_count);
+    for (size_t i = 0; i < count; ++i) {
+      rows[i].m_has_buy = i < buy_count;
+      rows[i].m_has_sell = i < sell_count;
+    }
+    return count;
+  }
+  // same as get_depth, but orders of the same price are aggregated into one level,
+  // resting market orders make up a level of their own
+  size_t get_levels(level_row* rows, size_t depth) const
+  {
+    auto buy_count = fill_level_side(m_market_order_buy_cont, m_limit_buy_queue, rows, depth, &level_row::m_buy);
+    auto sell_count = fill_level_side(m_market_order_sell_cont, m_limit_sell_queue, rows, depth, &level_row::m_sell);
+    auto count = std::max(buy_count, sell_count);
+    for (size_t i = 0; i < count; ++i) {
+      rows[i].m_has_buy = i < buy_count;
+      rows[i].m_has_sell = i < sell_count;
+    }
+    return count;
+  }
+private:
+  // one pass of continuous matching, the fills are appended to ret
+  void match_pass(std::vector<matched_result_detail>& ret)
+  {
+    // first check market orders, they take the price of the best opposite order
+    while (!m_market_order_buy_cont.empty() && !m_limit_sell_queue.empty()) {
+      if (kill_short_top(m_limit_sell_queue, m_market_order_sell_cont, m_market_order_buy_cont, m_limit_buy_queue)) {
+        continue;
+      }
+      auto& buy_order = m_market_order_buy_cont.top_order();
+      m_market_order_buy_cont.get_cold(buy_order).m_price = m_limit_sell_queue.get_best_price();
+      if (!match_top(m_market_order_buy_cont, m_limit_sell_queue, ret)) {
+        break;
+      }
+    }
+    while (!m_market_order_sell_cont.empty() && !m_limit_buy_queue.empty()) {
+      if (kill_short_top(m_limit_buy_queue, m_market_order_buy_cont, m_market_order_sell_cont, m_limit_sell_queue)) {
+        continue;
+      }
+      auto& sell_order = m_market_order_sell_cont.top_order();
+      m_market_order_sell_cont.get_cold(sell_order).m_price = m_limit_buy_queue.get_best_price();
+      if (!match_top(m_limit_buy_queue, m_market_order_sell_cont, ret)) {
+        break;
+      }
+    }
+    // now match limit orders
+    while (!m_limit_buy_queue.empty() && !m_limit_sell_queue.empty()) {
+      if (m_limit_buy_queue.get_best_price() < m_limit_sell_queue.get_best_price()) {
+        break;
+      }
+      if (kill_short_top(m_limit_buy_queue, m_market_order_buy_cont, m_market_order_sell_cont, m_limit_sell_queue)
+        || kill_short_top(m_limit_sell_queue, m_market_order_sell_cont, m_market_order_buy_cont, m_limit_buy_queue)) {
+        continue;
+      }
+      if (!match_top(m_limit_buy_queue, m_limit_sell_queue, ret)) {
+        break;
+      }
+    }
+  }
+  // the top limit order of queue with a minimum quantity it has not traded yet,
+  // fill or kill orders included, trades only if the other side can fill that
+  // minimum right away. This is decided from the level totals before anything
+  // trades: the opposite market orders, and the opposite limit orders at its
+  // price or better less what the market orders of its own side take from them
+  // first. Orders of the other side with a pending minimum do not count, they
+  // may be killed themselves. An order which falls short leaves the book without
+  // touching a resting order; returns whether the top of queue was killed
+  template <class Q, class SM, class OM, class OL>
+  bool kill_short_top(Q& queue, const SM& same_market, const OM& opposite_market, const OL& opposite_limit)
+  {
+    auto need = queue.get_top_min_q();
+    if (need == 0) {
+      return false;
+    }
+    auto avail = opposite_market.get_total_q();
+    if (avail < need) {
+      auto ahead = same_market.empty() ? 0 : same_market.get_total_q();
+      auto limit_q = opposite_limit.empty() ? 0 : opposite_limit.get_firm_q(queue.get_best_price(), need - avail + ahead);
+      avail += limit_q > ahead ? limit_q - ahead : 0;
+    }
+    if (avail >= need) {
+      queue.clear_top_min_q();
+      return false;
+    }
+    queue.pop_order();
+    ++m_min_q_killed;
+    return true;
+  }
+  // trades the top orders of both queues at the price of the sell order, fully
+  // matched ones leave their queue; returns false when one of them has nothing left to trade
+  template <class B, class S>
+  bool match_top(B& buy_queue, S& sell_queue, std::vector<matched_result_detail>& ret)
+  {
+    auto price = sell_queue.get_cold(sell_queue.top_order()).m_price;
+    return trade_top(buy_queue, sell_queue, price, UINT64_MAX, ret) > 0;
+  }
+  // trades up to max_q of the top orders of both queues at price, returns the quantity traded
+  template <class B, class S>
+  uint64_t trade_top(B& buy_queue, S& sell_queue, float price, uint64_t max_q, std::vector<matched_result_detail>& ret)
+  {
+    auto& buy_order = buy_queue.top_order();
+    auto& sell_order = sell_queue.top_order();
+    auto matched_count = std::min(std::min(buy_order.m_q, sell_order.m_q), max_q);
+    if (matched_count == 0) {
+      return 0;
+    }
+    auto& buy_cold = buy_queue.get_cold(buy_order);
+    auto& sell_cold = sell_queue.get_cold(sell_order);
+    ret.push_back(fill_details(sell_cold, buy_cold, matched_count, price));
+    m_last_price = price;
+    m_has_last_price = true;
+    bool buy_filled = buy_order.m_q == matched_count;
+    bool sell_filled = sell_order.m_q == matched_count;
+    settle_top(buy_queue, buy_cold, buy_filled, matched_count);
+    settle_top(sell_queue, sell_cold, sell_filled, matched_count);
+    return matched_count;
+  }
+  // takes a trade of matched_count off the top order of queue: the rest of an
+  // order stays on top, a filled iceberg slice is replaced from the reserve at the
+  // back of its level and any other filled order leaves
+  template <class Q>
+  void settle_top(Q& queue, cold_order& cold, bool filled, uint64_t matched_count)
+  {
+    if (!filled) {
+      cold.m_matched_q += matched_count;
+      queue.reduce_top(matched_count);
+    }
+    else if (cold.m_reserve != 0) {
+      cold.m_matched_q += matched_count;
+      queue.replenish_top(m_next_seq++);
+      ++m_replenished;
+    }
+    else {
+      queue.pop_order();
+    }
+  }
+  // ioc orders do not outlive a matching run, market orders do
+  void end_matching(const std::vector<matched_result_detail>& ret)
+  {
+    m_ioc_expired += m_limit_buy_queue.drop_ioc();
+    m_ioc_expired += m_limit_sell_queue.drop_ioc();
+    // market orders match oldest first, the ones counted before are older than
+    // m_unfilled_from; an amend which raises the quantity makes a new order
+    m_market_unfilled += m_market_order_buy_cont.count_from(m_unfilled_from)
+      + m_market_order_sell_cont.count_from(m_unfilled_from);
+    m_unfilled_from = m_next_seq;
+    m_fills += ret.size();
+    for (const auto& det : ret) {
+      m_volume += det.m_matched_buy.m_q;
+    }
+  }
+  // the cumulative quantities of both sides over the level prices of the book in
+  // ascending order, built in one pass over the levels of each side; returns the
+  // volume executable at the clearing price, 0 if the book does not cross
+  uint64_t find_clearing_price(float& price)
+  {
+    uint64_t market_buy = 0;
+    uint64_t market_sell = 0;
+    m_market_order_buy_cont.for_each_level([&](float, uint64_t q, uint64_t, uint64_t) {
+      market_buy += q;
+      return true;
+    });
+    m_market_order_sell_cont.for_each_level([&](float, uint64_t q, uint64_t, uint64_t) {
+      market_sell += q;
+      return true;
+    });
+    // buy levels come best first, so the highest price first, the sell ones lowest first
+    auto& buy_levels = m_auction.m_buy_levels;
+    auto& sell_levels = m_auction.m_sell_levels;
+    // the reserves of icebergs trade in the auction as their slices are shown
+    m_limit_buy_queue.for_each_level([&](float p, uint64_t q, uint64_t, uint64_t reserve) {
+      buy_levels.emplace_back(p, q + reserve);
+      return true;
+    });
+    m_limit_sell_queue.for_each_level([&](float p, uint64_t q, uint64_t, uint64_t reserve) {
+      sell_levels.emplace_back(p, q + reserve);
+      return true;
+    });
+    auto& prices = m_auction.m_prices;
+    auto& bids = m_auction.m_bids;
+    auto& asks = m_auction.m_asks;
+    auto buy_iter = buy_levels.rbegin();
+    auto sell_iter = sell_levels.begin();
+    while (buy_iter != buy_levels.rend() || sell_iter != sell_levels.end()) {
+      bool take_buy = sell_iter == sell_levels.end() || (buy_iter != buy_levels.rend() && buy_iter->first <= sell_iter->first);
+      bool take_sell = buy_iter == buy_levels.rend() || (sell_iter != sell_levels.end() && sell_iter->first <= buy_iter->first);
+      prices.push_back(take_buy ? buy_iter->first : sell_iter->first);
+      bids.push_back(take_buy ? (buy_iter++)->second : 0);
+      asks.push_back(take_sell ? (sell_iter++)->second : 0);
+    }
+    auto n = prices.size();
+    if (n == 0) {
+      return 0;
+    }
+    // bids[i] becomes all the buy quantity at prices[i] or better, asks[i] the sell one
+    uint64_t sum = market_buy;
+    for (size_t i = n; i-- > 0;) {
+      sum += bids[i];
+      bids[i] = sum;
+    }
+    sum = market_sell;
+    for (size_t i = 0; i < n; ++i) {
+      sum += asks[i];
+      asks[i] = sum;
+    }
+    // branch free passes over the arrays, which the compiler can vectorize
+    auto& volumes = m_auction.m_volumes;
+    auto& surpluses = m_auction.m_surpluses;
+    volumes.resize(n);
+    surpluses.resize(n);
+    uint64_t best_volume = 0;
+    for (size_t i = 0; i < n; ++i) {
+      volumes[i] = std::min(bids[i], asks[i]);
+      surpluses[i] = std::max(bids[i], asks[i]) - volumes[i];
+      best_volume = std::max(best_volume, volumes[i]);
+    }
+    if (best_volume == 0) {
+      return 0;
+    }
+    uint64_t best_surplus = UINT64_MAX;
+    for (size_t i = 0; i < n; ++i) {
+      best_surplus = std::min(best_surplus, volumes[i] == best_volume ? surpluses[i] : UINT64_MAX);
+    }
+    size_t first = n;
+    size_t last = 0;
+    bool buy_pressure = false;
+    bool sell_pressure = false;
+    for (size_t i = 0; i < n; ++i) {
+      if (volumes[i] == best_volume && surpluses[i] == best_surplus) {
+        first = std::min(first, i);
+        last = i;
+        buy_pressure |= bids[i] > asks[i];
+        sell_pressure |= asks[i] > bids[i];
+      }
+    }
+    if (buy_pressure && !sell_pressure) {
+      price = prices[last];
+    }
+    else if (sell_pressure && !buy_pressure) {
+      price = prices[first];
+    }
+    else {
+      price = prices[first + (last - first) / 2];
+    }
+    return best_volume;
+  }
+  matched_result_detail fill_details(const cold_order& sell_order, const cold_order& buy_order, uint64_t matched_count, float price) const
+  {
+    matched_result_detail det;
+
+    det.m_symb = m_symbol;
+
+    det.m_matched_buy.m_order_id = buy_order.m_id;
+    det.m_matched_buy.m_order_type = static_cast<order_type>(buy_order.m_order_type);
+    det.m_matched_buy.m_price = price;
+    det.m_matched_buy.m_q = matched_count;
+
+    det.m_matched_sell.m_id = sell_order.m_id;
+    det.m_matched_sell.m_order_type = static_cast<order_type>(sell_order.m_order_type);
+    det.m_matched_sell.m_price = price;
+    det.m_matched_sell.m_q = matched_count;
+
+    return det;
+  }
+
+  template <class M, class L>
+  static size_t fill_depth_side(const M& market, const L& limit, depth_row* rows, size_t depth, depth_entry depth_row::* side)
+  {
+    size_t count = 0;
+    auto put = [&](const hot_order& h, const cold_order& c) {
+      if (count == depth) {
+        return false;
+      }
+      depth_entry& e = rows[count].*side;
+      e.m_id = c.m_id;
+      e.m_order_type = static_cast<order_type>(c.m_order_type);
+      e.m_q = h.m_q;
+      e.m_price = c.m_price;
+      ++count;
+      return true;
+    };
+    market.for_each_order(put);
+    limit.for_each_order(put);
+    return count;
+  }
+  template <class M, class L>
+  static size_t fill_level_side(const M& market, const L& limit, level_row* rows, size_t depth, level_entry level_row::* side)
+  {
+    size_t count = 0;
+    if (!market.empty() && depth > 0) {
+      level_entry& e = rows[count].*side;
+      e.m_market = true;
+      e.m_price = 0.0f;
+      e.m_q = 0;
+      e.m_count = market.size();
+      market.for_each_level([&](float, uint64_t q, uint64_t, uint64_t) {
+        e.m_q += q;
+        return true;
+      });
+      ++count;
+    }
+    limit.for_each_level([&](float price, uint64_t q, uint64_t orders, uint64_t) {
+      if (count == depth) {
+        return false;
+      }
+      level_entry& e = rows[count].*side;
+      e.m_market = false;
+      e.m_price = price;
+      e.m_q = q;
+      e.m_count = orders;
+      ++count;
+      return true;
+    });
+    return count;
+  }
+
+  // an amend which raises the quantity or moves the price gets a new sequence
+  // and so goes behind its level, a smaller quantity keeps the priority except
+  // for icebergs
+  template <class Q>
+  amend_result try_amend_order_in_limit_queue(Q& q, const order_data& new_order_data)
+  {
+    order_data cur_data;
+    uint64_t seq = 0;
+    if (!q.find_order(new_order_data.get_id(), cur_data, seq)) {
+      return amend_result::not_found;
+    }
+    auto amend_typ = check_amend_type(cur_data, new_order_data);
+
+    switch (amend_typ) {
+    case amend_type::invalid:
+      return amend_result::failed;
+    case amend_type::q:
+    {
+      if (new_order_data.get_q() <= cur_data.get_matched_q()) {
+        q.cancel_order(cur_data.get_id());
+        return amend_result::executed;
+      }
+      auto old_q = cur_data.get_q();
+      cur_data.set_q(new_order_data.get_q() - cur_data.get_matched_q());
+      // an iceberg is sliced again, which may show more than before
+      if (cur_data.get_q() > old_q || cur_data.get_peak() != 0) {
+        seq = m_next_seq++;
+      }
+      break;
+    }
+    case amend_type::price:
+      cur_data.set_price(new_order_data.get_price());
+      seq = m_next_seq++;
+      break;
+    case amend_type::price_and_q:
+      if (new_order_data.get_q() <= cur_data.get_matched_q()) {
+        q.cancel_order(cur_data.get_id());
+        return amend_result::executed;
+      }
+      cur_data.set_q(new_order_data.get_q() - cur_data.get_matched_q());
+      cur_data.set_price(new_order_data.get_price());
+      seq = m_next_seq++;
+      break;
+    };
+    // a minimum not reached yet stays, it can not be more than what is left
+    cur_data.set_min_q(std::min(cur_data.get_min_q(), cur_data.get_q()));
+    // remove the order
+    q.cancel_order(cur_data.get_id());
+    // put it again, an amended ioc order rests until cancelled
+    q.put_order(cur_data, false, seq);
+    return amend_result::ok;
+  }
+
+  enum class amend_type {
+      invalid
+    , q
+    , price
+    , price_and_q
+  };
+  amend_type check_amend_type(const order_data& old_data, const order_data& new_data) const
+  {
+    if (new_data.get_order_type() == order_type::market) {
+      if (new_data.get_price() != 0.0) {
+        return amend_type::invalid;
+      }
+    }
+    if (old_data.get_id() != new_data.get_id()) {
+      return amend_type::invalid;
+    }
+    if (old_data.get_order_side() != new_data.get_order_side()) {
+      return amend_type::invalid;
+    }
+    if (old_data.get_order_type() != new_data.get_order_type()) {
+      return amend_type::invalid;
+    }
+    if (old_data.get_price() != new_data.get_price()) {
+      if (old_data.get_q() != new_data.get_q()) {
+        return amend_type::price_and_q;
+      }
+      return amend_type::price;
+    }
+    if (old_data.get_q() != new_data.get_q()) {
+      return amend_type::q;
+    }
+    return amend_type::invalid;
+  }
+  bool id_exists(uint64_t id) const
+  {
+    // check all queues for the id
+    if (m_limit_buy_queue.id_exists(id)) {
+      return true;
+    }
+    if (m_limit_sell_queue.id_exists(id)) {
+      return true;
+    }
+
+    if (m_market_order_buy_cont.id_exists(id)) {
+      return true;
+    }
+    if (m_market_order_sell_cont.id_exists(id)) {
+      return true;
+    }
+    if (m_stop_buy_queue.id_exists(id) || m_stop_sell_queue.id_exists(id)) {
+      return true;
+    }
+    return false;
+  }
+  
+  bool put_order_sell_market(const order_data& d)
+  {
+    auto ret = m_market_order_sell_cont.put_order(d, false, m_next_seq);
+    return ret;
+  }
+  bool put_order_sell_limit(const order_data& d)
+  {
+    auto ret = m_limit_sell_queue.put_order(d, false, m_next_seq);
+    return ret;
+  }
+  bool put_order_sell_limit_ioc(const order_data& d)
+  {
+    auto ret = m_limit_sell_queue.put_order(d, true, m_next_seq);
+    return ret;
+  }
+  bool put_order_buy_market(const order_data& d)
+  {
+    auto ret = m_market_order_buy_cont.put_order(d, false, m_next_seq);
+    return ret;
+  }
+  bool put_order_buy_limit(const order_data& d)
+  {
+    auto ret = m_limit_buy_queue.put_order(d, false, m_next_seq);
+    return ret;
+  }
+  bool put_order_buy_limit_ioc(const order_data& d)
+  {
+    auto ret = m_limit_buy_queue.put_order(d, true, m_next_seq);
+    return ret;
+  }
+  bool put_order_sell_limit_fok(const order_data& d)
+  {
+    return put_fok_order(m_limit_sell_queue, d);
+  }
+  bool put_order_buy_limit_fok(const order_data& d)
+  {
+    return put_fok_order(m_limit_buy_queue, d);
+  }
+  // rests as an ioc order whose minimum is all of it
+  template <class Q>
+  bool put_fok_order(Q& queue, order_data d)
+  {
+    d.set_min_q(d.get_q());
+    return queue.put_order(d, true, m_next_seq);
+  }
+  bool put_order_sell_stop(const order_data& d)
+  {
+    return put_stop_order(m_stop_sell_queue, m_market_order_sell_cont, d);
+  }
+  bool put_order_sell_stop_limit(const order_data& d)
+  {
+    return put_stop_order(m_stop_sell_queue, m_limit_sell_queue, d);
+  }
+  bool put_order_buy_stop(const order_data& d)
+  {
+    return put_stop_order(m_stop_buy_queue, m_market_order_buy_cont, d);
+  }
+  bool put_order_buy_stop_limit(const order_data& d)
+  {
+    return put_stop_order(m_stop_buy_queue, m_limit_buy_queue, d);
+  }
+  static bool is_stop_type(order_type ot)
+  {
+    return ot == order_type::stop || ot == order_type::stop_limit;
+  }
+  // a stop order whose stop price the last trade has reached already enters the book at once
+  template <class S, class Q>
+  bool put_stop_order(S& stops, Q& queue, const order_data& d)
+  {
+    if (!is_triggered(d.get_order_side(), d.get_stop_price())) {
+      return stops.put_stop_order(d, m_next_seq);
+    }
+    ++m_stops_triggered;
+    return queue.put_order(triggered_order(d.get_id(), d.get_price(), d.get_q(), d.get_order_side(), d.get_order_type()), false, m_next_seq);
+  }
+  bool is_triggered(order_side os, float stop_price) const
+  {
+    if (!m_has_last_price) {
+      return false;
+    }
+    return os == order_side::buy ? m_last_price >= stop_price : m_last_price <= stop_price;
+  }
+  // the order a stop order turns into once triggered
+  static order_data triggered_order(uint64_t id, float price, uint64_t q, order_side os, order_type ot)
+  {
+    return order_data(id, 0, std::string(), price, q, os, ot == order_type::stop ? order_type::market : order_type::limit);
+  }
+  // moves the stop orders which the last trade price has reached from the trigger
+  // index into the book, a range from the front of each side's index: buy stops
+  // lowest stop price first, then sell stops highest first, in time priority
+  // within a stop price. Each gets a new sequence, so it goes behind the orders
+  // already resting. Returns the number of released orders
+  uint64_t release_stops()
+  {
+    uint64_t released = 0;
+    while (!m_stop_buy_queue.empty() && is_triggered(order_side::buy, m_stop_buy_queue.get_best_key_price())) {
+      release_top(m_stop_buy_queue, m_market_order_buy_cont, m_limit_buy_queue);
+      ++released;
+    }
+    while (!m_stop_sell_queue.empty() && is_triggered(order_side::sell, m_stop_sell_queue.get_best_key_price())) {
+      release_top(m_stop_sell_queue, m_market_order_sell_cont, m_limit_sell_queue);
+      ++released;
+    }
+    m_stops_triggered += released;
+    return released;
+  }
+  template <class S, class M, class L>
+  void release_top(S& stops, M& market, L& limit)
+  {
+    const auto& h = stops.top_order();
+    const auto& c = stops.get_cold(h);
+    auto ot = static_cast<order_type>(c.m_order_type);
+    auto d = triggered_order(c.m_id, c.m_price, h.m_q, static_cast<order_side>(c.m_order_side), ot);
+    stops.pop_order();
+    if (ot == order_type::stop) {
+      market.put_order(d, false, m_next_seq++);
+    }
+    else {
+      limit.put_order(d, false, m_next_seq++);
+    }
+  }
+  void init_put_func()
+  {
+    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::limit)) = &basic_order_engine::put_order_buy_limit;
+    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::market)) = &basic_order_engine::put_order_buy_market;
+    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::limit_ioc)) = &basic_order_engine::put_order_buy_limit_ioc;
+    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::stop)) = &basic_order_engine::put_order_buy_stop;
+    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::stop_limit)) = &basic_order_engine::put_order_buy_stop_limit;
+    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::limit_fok)) = &basic_order_engine::put_order_buy_limit_fok;
+
+    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::limit)) = &basic_order_engine::put_order_sell_limit;
+    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::market)) = &basic_order_engine::put_order_sell_market;
+    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::limit_ioc)) = &basic_order_engine::put_order_sell_limit_ioc;
+    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::stop)) = &basic_order_engine::put_order_sell_stop;
+    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::stop_limit)) = &basic_order_engine::put_order_sell_stop_limit;
+    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::limit_fok)) = &basic_order_engine::put_order_sell_limit_fok;
+  }
+  using buy_queue = limit_order_queue<limit_order_buy, limit_order_buy_less, Policy>;
+  using sell_queue = limit_order_queue<limit_order_sell, limit_order_sell_less, Policy>;
+  // the trigger index of a side: pending stop orders filed under their stop price,
+  // ordered so that the next one to trigger is the best, the lowest stop price for
+  // buy stops and the highest for sell stops
+  using buy_stop_queue = limit_order_queue<limit_order_buy, limit_order_sell_less, Policy>;
+  using sell_stop_queue = limit_order_queue<limit_order_sell, limit_order_buy_less, Policy>;
+
+  std::string m_symbol;
+  buy_queue m_limit_buy_queue;
+  sell_queue m_limit_sell_queue;
+
+  buy_queue m_market_order_buy_cont;
+  sell_queue m_market_order_sell_cont;
+
+  buy_stop_queue m_stop_buy_queue;
+  sell_stop_queue m_stop_sell_queue;
+
+  // member function pointers rather than lambdas capturing this, so that copies
+  // of an engine (history snapshots, batch inserts) put orders into themselves
+  using put_func = bool (basic_order_engine::*)(const order_data&);
+  std::array<std::array<put_func, 6>, 2> m_put_func;
+
+  // scratch arrays of the clearing price search; they are emptied after every
+  // search, so copies of the engine leave them out but it keeps their capacity
+  struct auction_arrays
+  {
+    void clear()
+    {
+      m_buy_levels.clear();
+      m_sell_levels.clear();
+      m_prices.clear();
+      m_bids.clear();
+      m_asks.clear();
+      m_volumes.clear();
+      m_surpluses.clear();
+    }
+    std::vector<std::pair<float, uint64_t>> m_buy_levels;
+    std::vector<std::pair<float, uint64_t>> m_sell_levels;
+    std::vector<float> m_prices;
+    std::vector<uint64_t> m_bids;
+    std::vector<uint64_t> m_asks;
+    std::vector<uint64_t> m_volumes;
+    std::vector<uint64_t> m_surpluses;
+  };
+  auction_arrays m_auction;
+
+  // priority of the next accepted order, or of an amend which loses its place
+  uint64_t m_next_seq = 0;
+  uint64_t m_ioc_expired = 0;
+  uint64_t m_market_unfilled = 0;
+  // the first sequence not counted in m_market_unfilled yet
+  uint64_t m_unfilled_from = 0;
+  uint64_t m_fills = 0;
+  uint64_t m_volume = 0;
+  uint64_t m_stops_triggered = 0;
+  uint64_t m_min_q_killed = 0;
+  uint64_t m_replenished = 0;
+  // price of the last trade of the book, which stop orders trigger on
+  bool m_has_last_price = false;
+  float m_last_price = 0.0f;
+};
+
+using order_engine = basic_order_engine<default_engine_policy>;
+
+void write_depth_row(const std::string& symb, const depth_row& row, std::ostream& out)
+{
+  char buf[128];
+  out.write(symb.data(), symb.size());
+  out.put('|');
+  if (row.m_has_buy) {
+    const auto& e = row.m_buy;
+    auto len = std::snprintf(buf, sizeof(buf), "%" PRIu64 ",%c,%" PRIu64 ",%.2f",
+      e.m_id, order_type_to_char(e.m_order_type), e.m_q, e.m_price);
+    out.write(buf, len);
+  }
+  out.put('|');
+  if (row.m_has_sell) {
+    const auto& e = row.m_sell;
+    auto len = std::snprintf(buf, sizeof(buf), "%.2f,%" PRIu64 ",%c,%" PRIu64,
+      e.m_price, e.m_q, order_type_to_char(e.m_order_type), e.m_id);
+    out.write(buf, len);
+  }
+  out.put('\n');
+}
+
+// level rows are printed as count,quantity,price|price,quantity,count
+// with M in place of the price for the market order level
+void write_level_row(const std::string& symb, const level_row& row, std::ostream& out)
+{
+  char buf[128];
+  out.write(symb.data(), symb.size());
+  out.put('|');
+  if (row.m_has_buy) {
+    const auto& e = row.m_buy;
+    auto len = e.m_market
+      ? std::snprintf(buf, sizeof(buf), "%" PRIu64 ",%" PRIu64 ",M", e.m_count, e.m_q)
+      : std::snprintf(buf, sizeof(buf), "%" PRIu64 ",%" PRIu64 ",%.2f", e.m_count, e.m_q, e.m_price);
+    out.write(buf, len);
+  }
+  out.put('|');
+  if (row.m_has_sell) {
+    const auto& e = row.m_sell;
+    auto len = e.m_market
+      ? std::snprintf(buf, sizeof(buf), "M,%" PRIu64 ",%" PRIu64, e.m_q, e.m_count)
+      : std::snprintf(buf, sizeof(buf), "%.2f,%" PRIu64 ",%" PRIu64, e.m_price, e.m_q, e.m_count);
+    out.write(buf, len);
+  }
+  out.put('\n');
+}
+
+// row buffers for order_engine::get_depth/get_levels, allocated once for the configured depth
+class depth_buffer
+{
+public:
+  explicit depth_buffer(size_t depth = 5)
+    :m_depth_rows(depth)
+    ,m_level_rows(depth)
+  {
+
+  }
+  size_t get_depth() const
+  {
+    return m_depth_rows.size();
+  }
+  template <class Engine>
+  size_t read_depth(const Engine& eng)
+  {
+    return eng.get_depth(m_depth_rows.data(), m_depth_rows.size());
+  }
+  template <class Engine>
+  size_t read_levels(const Engine& eng)
+  {
+    return eng.get_levels(m_level_rows.data(), m_level_rows.size());
+  }
+  const depth_row& get_depth_row(size_t i) const
+  {
+    return m_depth_rows[i];
+  }
+  const level_row& get_level_row(size_t i) const
+  {
+    return m_level_rows[i];
+  }
+private:
+  std::vector<depth_row> m_depth_rows;
+  std::vector<level_row> m_level_rows;
+};
+
+// single writer, many readers sequence lock; the payload is kept in atomic words
+// so that a reader racing with the writer never performs a data race, it retries instead
+template <class T>
+class seqlock
+{
+  static_assert(std::is_trivially_copyable<T>::value, "seqlock payload must be trivially copyable");
+public:
+  seqlock()
+  {
+    for (auto& w : m_words) {
+      w.store(0, std::memory_order_relaxed);
+    }
+  }
+  seqlock(const seqlock&) = delete;
+  seqlock& operator=(const seqlock&) = delete;
+
+  void store(const T& val)
+  {
+    std::array<uint64_t, word_count> words{};
+    std::memcpy(words.data(), &val, sizeof(T));
+
+    auto seq = m_seq.load(std::memory_order_relaxed);
+    m_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < word_count; ++i) {
+      m_words[i].store(words[i], std::memory_order_relaxed);
+    }
+    m_seq.store(seq + 2, std::memory_order_release);
+  }
+  T load() const
+  {
+    std::array<uint64_t, word_count> words;
+    for (;;) {
+      auto seq1 = m_seq.load(std::memory_order_acquire);
+      if (seq1 & 1) {
+        std::this_thread::yield();
+        continue;
+      }
+      for (size_t i = 0; i < word_count; ++i) {
+        words[i] = m_words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      auto seq2 = m_seq.load(std::memory_order_relaxed);
+      if (seq1 == seq2) {
+        break;
+      }
+    }
+    T ret;
+    std::memcpy(static_cast<void*>(&ret), words.data(), sizeof(T));
+    return ret;
+  }
+  // number of completed stores
+  uint64_t get_version() const
+  {
+    return m_seq.load(std::memory_order_acquire) / 2;
+  }
+private:
+  static constexpr size_t word_count = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  std::atomic<uint64_t> m_seq{ 0 };
+  std::array<std::atomic<uint64_t>, word_count> m_words;
+};
+
+// top of book of one symbol as published to market data readers
+struct depth_snapshot
+{
+  static constexpr size_t max_depth = 5;
+
+  uint64_t m_version;
+  uint64_t m_checksum;
+  uint32_t m_rows;
+  depth_row m_depth[max_depth];
+
+  uint64_t compute_checksum() const
+  {
+    uint64_t sum = m_version * 31 + m_rows;
+    for (uint32_t i = 0; i < m_rows && i < max_depth; ++i) {
+      const auto& r = m_depth[i];
+      sum = sum * 131 + (r.m_has_buy ? r.m_buy.m_id * 7 + r.m_buy.m_q : 1);
+      sum = sum * 131 + (r.m_has_sell ? r.m_sell.m_id * 7 + r.m_sell.m_q : 3);
+    }
+    return sum;
+  }
+};
+
+// publishes per symbol depth snapshots from the matching thread; readers
+// on any thread get a consistent copy without taking a lock or stalling the writer.
+// This is an api for embedding programs: the Q and L commands of every run mode
+// are answered on the matching thread from the books themselves, since their
+// rows belong at the position of the command in the output, and only the
+// --md-stress benchmark reads the snapshots
+class market_data_publisher
+{
+public:
+  explicit market_data_publisher(size_t max_symbols = 1024)
+    :m_slots(new slot[max_symbols])
+    ,m_capacity(max_symbols)
+  {
+
+  }
+  // writer side, returns false if there is no free slot for a new symbol
+  template <class Engine>
+  bool publish(const std::string& symb, const Engine& eng)
+  {
+    auto iter = m_writer_index.find(symb);
+    size_t idx = 0;
+    if (iter == m_writer_index.end()) {
+      idx = m_count.load(std::memory_order_relaxed);
+      if (idx == m_capacity) {
+        return false;
+      }
+      m_slots[idx].m_symbol = symb;
+      m_writer_index.insert(std::make_pair(symb, idx));
+      m_count.store(idx + 1, std::memory_order_release);
+    }
+    else {
+      idx = iter->second;
+    }
+    auto& sl = m_slots[idx];
+    depth_snapshot snap{};
+    snap.m_version = sl.m_snapshot.get_version() + 1;
+    snap.m_rows = static_cast<uint32_t>(eng.get_depth(snap.m_depth, depth_snapshot::max_depth));
+    snap.m_checksum = snap.compute_checksum();
+    sl.m_snapshot.store(snap);
+    return true;
+  }
+  // reader side, slot indices are stable once a symbol was published
+  size_t get_symbol_count() const
+  {
+    return m_count.load(std::memory_order_acquire);
+  }
+  const std::string& get_symbol(size_t idx) const
+  {
+    assert(idx < get_symbol_count());
+    return m_slots[idx].m_symbol;
+  }
+  bool find_symbol(const std::string& symb, size_t& idx) const
+  {
+    auto count = get_symbol_count();
+    for (size_t i = 0; i < count; ++i) {
+      if (m_slots[i].m_symbol == symb) {
+        idx = i;
+        return true;
+      }
+    }
+    return false;
+  }
+  depth_snapshot read(size_t idx) const
+  {
+    assert(idx < get_symbol_count());
+    return m_slots[idx].m_snapshot.load();
+  }
+private:
+  struct slot
+  {
+    std::string m_symbol;
+    seqlock<depth_snapshot> m_snapshot;
+  };
+  std::unique_ptr<slot[]> m_slots;
+  size_t m_capacity;
+  std::atomic<size_t> m_count{ 0 };
+  // only touched by the writer
+  std::unordered_map<std::string, size_t> m_writer_index;
+};
+
+void basic_depth_tests()
+{
+  order_engine eng;
+  eng.put_order({ 1, 1, "a", 2.0f, 10, order_side::buy, order_type::limit }, order_side::buy, order_type::limit);
+  eng.put_order({ 2, 2, "a", 2.0f, 5, order_side::buy, order_type::limit }, order_side::buy, order_type::limit);
+  eng.put_order({ 3, 3, "a", 1.0f, 7, order_side::buy, order_type::limit }, order_side::buy, order_type::limit);
+  eng.put_order({ 4, 4, "a", 3.0f, 1, order_side::sell, order_type::limit }, order_side::sell, order_type::limit);
+
+  std::array<depth_row, 2> rows;
+  assert(eng.get_depth(rows.data(), rows.size()) == 2);
+  assert(rows[0].m_has_buy && rows[0].m_has_sell);
+  assert(rows[0].m_buy.m_id == 1 && rows[0].m_sell.m_id == 4);
+  assert(rows[1].m_has_buy && !rows[1].m_has_sell);
+  assert(rows[1].m_buy.m_id == 2);
+
+  std::array<level_row, 5> levels;
+  assert(eng.get_levels(levels.data(), levels.size()) == 2);
+  assert(levels[0].m_buy.m_q == 15 && levels[0].m_buy.m_count == 2);
+  assert(levels[1].m_buy.m_q == 7 && levels[1].m_buy.m_count == 1);
+  assert(levels[0].m_sell.m_q == 1 && !levels[1].m_has_sell);
+
+  // a smaller quantity keeps the priority of the order, a larger one does not
+  auto amended = eng.amend_order({ 1, 5, "a", 2.0f, 4, order_side::buy, order_type::limit });
+  assert(amended == amend_result::ok);
+  assert(eng.get_depth(rows.data(), rows.size()) == 2 && rows[0].m_buy.m_id == 1);
+  amended = eng.amend_order({ 1, 6, "a", 2.0f, 8, order_side::buy, order_type::limit });
+  assert(amended == amend_result::ok);
+  assert(eng.get_depth(rows.data(), rows.size()) == 2 && rows[0].m_buy.m_id == 2);
+}
+
+void basic_auction_tests()
+{
+  auto put = [](order_engine& eng, uint64_t id, order_side side, order_type type, float price, uint64_t q) {
+    bool rested = eng.put_order({ id, 1, "a", price, q, side, type }, side, type);
+    assert(rested);
+  };
+  auto total = [](const std::vector<matched_result_detail>& fills) {
+    uint64_t q = 0;
+    for (const auto& f : fills) {
+      q += f.m_matched_buy.m_q;
+    }
+    return q;
+  };
+  {
+    // 9.90 executes 300, more than any other price
+    order_engine eng;
+    put(eng, 1, order_side::buy, order_type::limit, 10.0f, 100);
+    put(eng, 2, order_side::buy, order_type::limit, 9.9f, 200);
+    put(eng, 3, order_side::buy, order_type::limit, 9.8f, 100);
+    put(eng, 4, order_side::sell, order_type::limit, 9.7f, 150);
+    put(eng, 5, order_side::sell, order_type::limit, 9.8f, 100);
+    put(eng, 6, order_side::sell, order_type::limit, 9.9f, 100);
+    put(eng, 7, order_side::sell, order_type::limit, 10.1f, 50);
+    auto fills = eng.run_auction();
+    assert(fills.size() == 4 && total(fills) == 300);
+    for (const auto& f : fills) {
+      assert(f.m_matched_buy.m_price == 9.9f && f.m_matched_sell.m_price == 9.9f);
+    }
+    // the best priced orders trade first
+    assert(fills[0].m_matched_buy.m_order_id == 1 && fills[0].m_matched_sell.m_id == 4);
+    assert(fills[3].m_matched_buy.m_order_id == 2 && fills[3].m_matched_sell.m_id == 6 && fills[3].m_matched_sell.m_q == 50);
+    std::array<level_row, 5> levels;
+    assert(eng.get_levels(levels.data(), levels.size()) == 2);
+    assert(levels[0].m_buy.m_price == 9.8f && levels[0].m_buy.m_q == 100);
+    assert(levels[0].m_sell.m_price == 9.9f && levels[0].m_sell.m_q == 50);
+    assert(eng.run_auction().empty());
+  }
+  {
+    // the same volume at both prices, the buy surplus takes the higher one
+    order_engine eng;
+    put(eng, 1, order_side::buy, order_type::limit, 10.0f, 150);
+    put(eng, 2, order_side::sell, order_type::limit, 9.0f, 100);
+    auto fills = eng.run_auction();
+    assert(fills.size() == 1 && total(fills) == 100 && fills[0].m_matched_buy.m_price == 10.0f);
+  }
+  {
+    // a sell surplus takes the lower one, market orders trade first
+    order_engine eng;
+    put(eng, 1, order_side::buy, order_type::limit, 10.0f, 50);
+    put(eng, 2, order_side::buy, order_type::market, 0.0f, 50);
+    put(eng, 3, order_side::sell, order_type::limit, 9.0f, 150);
+    auto fills = eng.run_auction();
+    assert(fills.size() == 2 && total(fills) == 100 && fills[0].m_matched_buy.m_price == 9.0f);
+    assert(fills[0].m_matched_buy.m_order_id == 2);
+  }
+  {
+    // no surplus at either tied price, the lower middle of them
+    order_engine eng;
+    put(eng, 1, order_side::buy, order_type::limit, 10.0f, 100);
+    put(eng, 2, order_side::buy, order_type::limit_ioc, 8.0f, 10);
+    put(eng, 3, order_side::sell, order_type::limit, 9.0f, 100);
+    put(eng, 4, order_side::sell, order_type::limit, 11.0f, 10);
+    auto fills = eng.run_auction();
+    assert(fills.size() == 1 && total(fills) == 100 && fills[0].m_matched_buy.m_price == 9.0f);
+    // the ioc order does not rest after the auction
+    assert(eng.get_stats().m_buy_orders == 0 && eng.get_stats().m_ioc_expired == 1);
+  }
+  {
+    order_engine eng;
+    put(eng, 1, order_side::buy, order_type::limit, 9.0f, 100);
+    put(eng, 2, order_side::sell, order_type::limit, 10.0f, 100);
+    assert(eng.run_auction().empty());
+  }
+  {
+    // a sell of no quantity ahead of the crossing one ends the auction
+    order_engine eng;
+    put(eng, 1, order_side::sell, order_type::limit, 10.0f, 0);
+    put(eng, 2, order_side::sell, order_type::limit, 10.0f, 10);
+    put(eng, 3, order_side::buy, order_type::limit, 10.0f, 10);
+    assert(eng.run_auction().empty());
+    assert(eng.get_stats().m_sell_orders == 2 && eng.get_stats().m_buy_orders == 1);
+  }
+}
+
+enum class reject_reason {
+    invalid_order
+  , amend_not_found
+  , amend_invalid
+  , cancel_not_found
+  , mass_cancel_invalid
+};
+
+class parse_error
+{
+public:
+  virtual std::string get_msg() const = 0;
+  virtual int get_code() const = 0;
+  virtual reject_reason get_reason() const = 0;
+  virtual uint64_t get_order_id() const = 0;
+};
+
+class dummy_parse_error : public parse_error
+{
+public:
+  std::string get_msg() const override
+  {
+    assert(false);
+    return std::string("");
+  }
+  int get_code() const override
+  {
+    assert(false);
+    return 0;
+  }
+  reject_reason get_reason() const override
+  {
+    assert(false);
+    return reject_reason::invalid_order;
+  }
+  uint64_t get_order_id() const override
+  {
+    assert(false);
+    return 0;
+  }
+};
+
+class new_parse_error : public parse_error
+{
+public:
+  new_parse_error(uint64_t order_id)
+    :m_order_id(order_id)
+  {
+
+  }
+  std::string get_msg() const override
+  {
+    std::string msg;
+    msg += std::to_string(m_order_id);
+    msg += " - Reject - 303 - Invalid order details";
+    return msg;
+  }
+  int get_code() const override
+  {
+    return 303;
+  }
+  reject_reason get_reason() const override
+  {
+    return reject_reason::invalid_order;
+  }
+  uint64_t get_order_id() const override
+  {
+    return m_order_id;
+  }
+private:
+  uint64_t m_order_id;
+};
+
+class amend_not_found_error : public parse_error
+{
+public:
+  amend_not_found_error(uint64_t order_id)
+    :m_order_id(order_id)
+  {
+
+  }
+  std::string get_msg() const override
+  {
+    std::string msg;
+    msg += std::to_string(m_order_id);
+    msg += " - AmendReject - 404 - Order does not exist";
+    return msg;
+  }
+  int get_code() const override
+  {
+    return 404;
+  }
+  reject_reason get_reason() const override
+  {
+    return reject_reason::amend_not_found;
+  }
+  uint64_t get_order_id() const override
+  {
+    return m_order_id;
+  }
+private:
+  uint64_t m_order_id;
+};
+
+class amend_parse_error : public parse_error
+{
+public:
+  amend_parse_error(uint64_t order_id)
+    :m_order_id(order_id)
+  {
+
+  }
+  std::string get_msg() const override
+  {
+    std::string msg;
+    msg += std::to_string(m_order_id);
+    msg += " - AmendReject - 101 - Invalid amendment details";
+    return msg;
+  }
+  int get_code() const override
+  {
+    return 101;
+  }
+  reject_reason get_reason() const override
+  {
+    return reject_reason::amend_invalid;
+  }
+  uint64_t get_order_id() const override
+  {
+    return m_order_id;
+  }
+private:
+  uint64_t m_order_id;
+};
+
+class cancel_not_found_error : public parse_error
+{
+public:
+  cancel_not_found_error(uint64_t order_id)
+    :m_order_id(order_id)
+  {
+
+  }
+  std::string get_msg() const override
+  {
+    std::string msg;
+    msg += std::to_string(m_order_id);
+    msg += " - CancelReject - 404 - Order does not exist";
+    return msg;
+  }
+  int get_code() const override
+  {
+    return 404;
+  }
+  reject_reason get_reason() const override
+  {
+    return reject_reason::cancel_not_found;
+  }
+  uint64_t get_order_id() const override
+  {
+    return m_order_id;
+  }
+private:
+  uint64_t m_order_id;
+};
+
+// a mass cancel names no order, the reject carries no id
+class mass_cancel_parse_error : public parse_error
+{
+public:
+  std::string get_msg() const override
+  {
+    return std::string("MassCancelReject - 303 - Invalid mass cancel details");
+  }
+  int get_code() const override
+  {
+    return 303;
+  }
+  reject_reason get_reason() const override
+  {
+    return reject_reason::mass_cancel_invalid;
+  }
+  uint64_t get_order_id() const override
+  {
+    return 0;
+  }
+};
+
+class query_data
+{
+public:
+  query_data()
+  {
+
+  }
+  query_data(const std::string& symb)
+    :m_symbol(symb)
+  {
+
+  }
+  query_data(uint32_t time)
+    :m_timestamp(time)
+  {
+
+  }
+  query_data(const std::string& symb, uint32_t time)
+    :m_symbol(symb)
+    , m_timestamp(time)
+  {
+
+  }
+  std::string get_symb() const
+  {
+    return m_symbol;
+  }
+  uint32_t get_timestamp() const
+  {
+    return m_timestamp;
+  }
+private:
+  std::string m_symbol;
+  uint32_t    m_timestamp = 0;
+};
+
+struct cancel_command
+{
+  uint64_t m_id;
+  uint32_t m_timestamp;
+};
+
+// cancels the orders of a symbol, of one side of it or, with a range, the limit
+// orders of one side priced from m_low to m_high
+struct mass_cancel_command
+{
+  std::string m_symb;
+  uint32_t m_timestamp = 0;
+  bool m_all_sides = true;
+  order_side m_side = order_side::buy;
+  bool m_range = false;
+  float m_low = 0.0f;
+  float m_high = 0.0f;
+};
+
+struct match_command
+{
+  match_command(uint32_t t)
+    :m_time(t)
+  {
+
+  }
+  match_command() {
+
+  }
+  match_command(const std::string& s, uint32_t tim)
+    :m_symb(s)
+    ,m_time(tim)
+  {
+
+  }
+  std::string m_symb;
+  uint32_t m_time = 0;
+};
+
+struct stats_command
+{
+  std::string m_symb;
+};
+
+enum class command_type {
+    none
+  , new_order
+  , amend_order
+  , cancel_order
+  , match
+  , query
+  , levels
+  , stats
+  , rejected
+  , mass_cancel
+};
+
+// one parsed input line
+struct command
+{
+  command_type m_type = command_type::none;
+  order_data m_order;
+  cancel_command m_cancel{};
+  mass_cancel_command m_mass_cancel;
+  match_command m_match;
+  query_data m_query;
+  stats_command m_stats;
+  // set when the line was rejected while parsing
+  reject_reason m_reason = reject_reason::invalid_order;
+  int m_reject_code = 0;
+  uint64_t m_reject_id = 0;
+};
+
+// time of a command which the history records and the expiry clock follows, 0 for
+// the others
+uint32_t command_time(const command& cmd)
+{
+  switch (cmd.m_type) {
+  case command_type::new_order:
+  case command_type::amend_order:
+    return cmd.m_order.get_time();
+  case command_type::cancel_order:
+    return cmd.m_cancel.m_timestamp;
+  case command_type::mass_cancel:
+    return cmd.m_mass_cancel.m_timestamp;
+  case command_type::match:
+    return cmd.m_match.m_time;
+  default:
+    return 0;
+  }
+}
+
+enum class output_kind {
+    accept
+  , amend_accept
+  , cancel_accept
+  , mass_cancel_accept
+  , expired
+  , reject
+  , fill
+  , depth
+  , level
+  , text
+  , deferred
+};
+
+// outcome of one command passed to order_engines::execute_batch; commands the batch
+// does not execute (queries, stats) are left as output_kind::text
+struct command_result
+{
+  output_kind m_kind = output_kind::text;
+  // the number of cancelled orders for a mass cancel
+  uint64_t m_id = 0;
+  reject_reason m_reason = reject_reason::invalid_order;
+  // range of the fills of a match command in the fills vector
+  size_t m_fill_begin = 0;
+  size_t m_fill_count = 0;
+  // range of the orders which expired before the command in the expired vector
+  size_t m_expired_begin = 0;
+  size_t m_expired_count = 0;
+};
+
+const uint32_t snapshot_magic = 0x534d4f45; // "EOMS"
+const uint32_t snapshot_version = 7;
+
+// read only view of a whole file, memory mapped where available
+class mapped_file
+{
+public:
+  explicit mapped_file(const std::string& path)
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw snapshot_error("cannot open " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw snapshot_error("cannot stat " + path);
+    }
+    m_size = static_cast<size_t>(st.st_size);
+    if (m_size > 0) {
+      void* addr = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        ::close(fd);
+        throw snapshot_error("cannot map " + path);
+      }
+      ::madvise(addr, m_size, MADV_SEQUENTIAL);
+      m_map = addr;
+      m_data = static_cast<const char*>(addr);
+    }
+    ::close(fd);
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      throw snapshot_error("cannot open " + path);
+    }
+    m_buf.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    m_data = m_buf.data();
+    m_size = m_buf.size();
+#endif
+  }
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  ~mapped_file()
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    if (m_map != nullptr) {
+      ::munmap(m_map, m_size);
+    }
+#endif
+  }
+  const char* get_data() const
+  {
+    return m_data;
+  }
+  size_t get_size() const
+  {
+    return m_size;
+  }
+private:
+  const char* m_data = nullptr;
+  size_t m_size = 0;
+#if defined(__unix__) || defined(__APPLE__)
+  void* m_map = nullptr;
+#else
+  std::vector<char> m_buf;
+#endif
+};
+
+struct order_engines_stats
+{
+  uint64_t m_symbols = 0;
+  uint64_t m_known_ids = 0;
+  uint64_t m_rejects_303 = 0;
+  uint64_t m_rejects_404 = 0;
+  uint64_t m_rejects_101 = 0;
+  order_engine_stats m_total;
+
+  // rough estimate of the heap held by all books and the id directory
+  uint64_t get_memory_usage() const
+  {
+    // id index slot with a symbol string, assuming short string optimization
+    const uint64_t id_bytes = sizeof(std::pair<uint64_t, std::string>) + sizeof(uint8_t);
+    return m_total.get_memory_usage() + m_known_ids * id_bytes;
+  }
+  std::string to_string() const
+  {
+    std::string ret;
+
+    ret += "symbols=" + std::to_string(m_symbols);
+    ret += ",known_ids=" + std::to_string(m_known_ids);
+    ret += ",rejects_303=" + std::to_string(m_rejects_303);
+    ret += ",rejects_404=" + std::to_string(m_rejects_404);
+    ret += ",rejects_101=" + std::to_string(m_rejects_101);
+    ret += ',';
+    ret += m_total.to_string();
+    ret += ",memory=" + std::to_string(get_memory_usage());
+
+    return ret;
+  }
+};
+
+// hierarchical timing wheel of (time, id) entries: four levels of 256 slots,
+// an entry is filed on the level of the highest byte in which its time differs
+// from the wheel time, in the slot of that byte. Once the wheel time reaches a
+// slot its entries move down to the level of their next differing byte, so an
+// entry moves three times at most, and an occupancy bitmap per level lets the
+// wheel jump over empty slots however far the time advances
+class timing_wheel
+{
+public:
+  using entry = std::pair<uint32_t, uint64_t>;
+
+  uint32_t get_time() const
+  {
+    return m_time;
+  }
+  size_t size() const
+  {
+    return m_size;
+  }
+  void clear(uint32_t time)
+  {
+    for (auto& slot : m_slots) {
+      slot.clear();
+    }
+    for (auto& bits : m_bits) {
+      bits.fill(0);
+    }
+    m_size = 0;
+    m_time = time;
+  }
+  // time has to be later than the wheel time
+  void insert(uint32_t time, uint64_t id)
+  {
+    assert(time > m_time);
+    if (m_slots.empty()) {
+      m_slots.resize(levels * (slot_mask + 1));
+    }
+    auto level = highest_bit(time ^ m_time) / slot_bits;
+    auto slot = time >> (level * slot_bits) & slot_mask;
+    m_slots[level * (slot_mask + 1) + slot].emplace_back(time, id);
+    m_bits[level][slot >> 6] |= uint64_t(1) << (slot & 63);
+    ++m_size;
+  }
+  // the earliest time at which entries expire or move down, UINT32_MAX if there are none
+  uint32_t next_due() const
+  {
+    uint64_t due = UINT32_MAX;
+    for (unsigned level = 0; level < levels && m_size != 0; ++level) {
+      auto shift = level * slot_bits;
+      auto slot = next_slot(level, m_time >> shift & slot_mask);
+      if (slot <= slot_mask) {
+        // the bytes above the level are the ones of the wheel time, the ones below are 0
+        auto above = static_cast<uint64_t>(m_time) >> (shift + slot_bits) << (shift + slot_bits);
+        due = std::min<uint64_t>(due, above | static_cast<uint64_t>(slot) << shift);
+      }
+    }
+    return static_cast<uint32_t>(due);
+  }
+  // moves the wheel time on to time and appends the entries due by then,
+  // ordered by their time and id
+  void advance(uint32_t time, std::vector<entry>& due)
+  {
+    auto first = due.size();
+    while (time > m_time) {
+      auto next = next_due();
+      if (next > time) {
+        m_time = time;
+        break;
+      }
+      m_time = next;
+      // upper levels first, their entries may land in a lower slot due now
+      for (unsigned level = levels; level-- > 0;) {
+        auto slot = m_time >> (level * slot_bits) & slot_mask;
+        auto& word = m_bits[level][slot >> 6];
+        if ((word & uint64_t(1) << (slot & 63)) == 0) {
+          continue;
+        }
+        word &= ~(uint64_t(1) << (slot & 63));
+        m_moving.swap(m_slots[level * (slot_mask + 1) + slot]);
+        m_size -= m_moving.size();
+        for (const auto& e : m_moving) {
+          if (e.first == m_time) {
+            due.push_back(e);
+          }
+          else {
+            insert(e.first, e.second);
+          }
+        }
+        m_moving.clear();
+      }
+    }
+    std::sort(due.begin() + first, due.end());
+  }
+private:
+  static const unsigned levels = 4;
+  static const unsigned slot_bits = 8;
+  static const uint32_t slot_mask = 255;
+
+  // the first occupied slot of level after slot, above slot_mask if there is none
+  uint32_t next_slot(unsigned level, uint32_t slot) const
+  {
+    const auto& bits = m_bits[level];
+    ++slot;
+    for (auto w = slot >> 6; w < bits.size(); ++w) {
+      auto word = bits[w];
+      if (w == slot >> 6) {
+        word &= ~uint64_t(0) << (slot & 63);
+      }
+      if (word != 0) {
+        return (w << 6) + lowest_bit(word);
+      }
+    }
+    return slot_mask + 1;
+  }
+
+  // the slots of all levels, allocated with the first entry so that copies of
+  // engines without good till time orders stay small
+  std::vector<std::vector<entry>> m_slots;
+  std::array<std::array<uint64_t, (slot_mask + 1) / 64>, levels> m_bits{};
+  std::vector<entry> m_moving;
+  size_t m_size = 0;
+  uint32_t m_time = 0;
+};
+
+template <class Policy>
+class basic_order_engines //: public 
+{
+public:
+  using engine_type = basic_order_engine<Policy>;
+
+  void add_order_from_order_data(const order_data& od)
+  {
+    if (od.get_time() < m_current_time || !is_valid_expiry(od)) {
+      throw new_parse_error(od.get_id());
+    }
+    m_current_time = od.get_time();
+    auto eng_iter = m_engines.find(od.get_symbol());
+    if (eng_iter == m_engines.end()) {
+      eng_iter = add_engine(od.get_symbol());
+    }
+    auto& eng = eng_iter->second;
+    auto res = eng.put_order(od, od.get_order_side(), od.get_order_type());
+    if (res == false) {
+      throw new_parse_error(od.get_id());
+    }
+    publish(eng_iter->first, eng);
+
+    m_symbols[od.get_id()] = od.get_symbol();
+    set_expiry(od.get_id(), od.get_expire_time());
+  }
+  void amend_order_from_order_data(const order_data& od)
+  {
+    if (od.get_time() < m_current_time || !is_valid_expiry(od)) {
+      throw amend_parse_error(od.get_id());
+    }
+    m_current_time = od.get_time();
+
+    auto symbol_iter = m_symbols.find(od.get_id());
+    if (symbol_iter == m_symbols.end()) {
+      throw amend_not_found_error(od.get_id());
+    }
+    if (symbol_iter->second != od.get_symbol()) {
+      throw amend_parse_error(od.get_id());
+    }
+    auto engine_iter = m_engines.find(od.get_symbol());
+    assert(engine_iter != m_engines.end());
+    amend_result amend_res = engine_iter->second.amend_order(od);
+    if (amend_res == amend_result::not_found) {
+      throw amend_not_found_error(od.get_id());
+    }
+    else if (amend_res == amend_result::failed) {
+      throw amend_parse_error(od.get_id());
+    }
+    publish(engine_iter->first, engine_iter->second);
+    // an amend without an expiry keeps the one of the order
+    if (od.get_expire_time() != 0) {
+      set_expiry(od.get_id(), od.get_expire_time());
+    }
+  }
+  void cancel_order(uint64_t id)
+  {
+    auto symb_iter = m_symbols.find(id);
+    if (symb_iter == m_symbols.end()) {
+      throw cancel_not_found_error(id);
+    }
+    auto eng_iter = m_engines.find(symb_iter->second);
+    assert(eng_iter != m_engines.end());
+    auto res = eng_iter->second.cancel_order(id);
+    if (!res) {
+      throw cancel_not_found_error(id);
+    }
+    publish(eng_iter->first, eng_iter->second);
+    m_expiries.erase(id);
+  }
+  // moves the expiry clock on to time, the good till time orders which expire by
+  // then leave their books and their ids are appended to ids, ordered by expiry
+  // time and id. Every command with a timestamp moves the clock before it executes,
+  // cancels and matches too although they do not check their timestamps
+  void expire_orders(uint32_t time, std::vector<uint64_t>& ids)
+  {
+    if (time <= m_expiry_wheel.get_time()) {
+      return;
+    }
+    m_due.clear();
+    m_expiry_wheel.advance(time, m_due);
+    for (const auto& e : m_due) {
+      // entries of orders which left the book otherwise or got another expiry are stale
+      auto iter = m_expiries.find(e.second);
+      if (iter == m_expiries.end() || iter->second != e.first) {
+        continue;
+      }
+      m_expiries.erase(iter);
+      auto symb_iter = m_symbols.find(e.second);
+      assert(symb_iter != m_symbols.end());
+      auto eng_iter = m_engines.find(symb_iter->second);
+      assert(eng_iter != m_engines.end());
+      if (eng_iter->second.cancel_order(e.second)) {
+        ids.push_back(e.second);
+        publish(eng_iter->first, eng_iter->second);
+      }
+    }
+  }
+  // the earliest time at which expire_orders may have work to do
+  uint32_t next_expiry_due() const
+  {
+    return m_expiry_wheel.next_due();
+  }
+  // cancels the orders selected by mc in bulk, the ids of the cancelled orders are
+  // appended to ids unless it is null; returns their number, 0 for an unknown
+  // symbol. As after single cancels the ids stay in the id directory
+  uint64_t mass_cancel(const mass_cancel_command& mc, std::vector<uint64_t>* ids)
+  {
+    auto eng_iter = m_engines.find(mc.m_symb);
+    if (eng_iter == m_engines.end()) {
+      return 0;
+    }
+    auto count = mass_cancel(eng_iter->second, mc, ids);
+    publish(eng_iter->first, eng_iter->second);
+    return count;
+  }
+  // executes cmds[0..count) with the same outcome as passing them one by one to the
+  // calls above, one result per command is written to results and the fills of match
+  // commands are appended to fills. Between barriers (a match of all symbols, or an
+  // id introduced by a new order earlier in the same stretch) commands are grouped by
+  // symbol, so each engine is looked up and published once per group. Mass cancels
+  // report the number of cancelled orders only. Orders which expire before a
+  // command are appended to expired and end the stretch as another barrier
+  void execute_batch(const command* cmds, size_t count, command_result* results, std::vector<matched_result_detail>& fills,
+    std::vector<uint64_t>& expired)
+  {
+    std::vector<batch_group> groups;
+    std::unordered_map<std::string, size_t> group_index;
+    typename Policy::id_set new_ids;
+
+    size_t i = 0;
+    while (i < count) {
+      groups.clear();
+      group_index.clear();
+      new_ids.clear();
+      // earliest expiry of the orders of the stretch, they reach the wheel with their group
+      uint32_t stretch_due = UINT32_MAX;
+      auto add_to_group = [&](const std::string& symb, size_t idx) {
+        auto ins = group_index.insert(std::make_pair(symb, groups.size()));
+        if (ins.second) {
+          groups.emplace_back();
+          groups.back().m_symb = &ins.first->first;
+        }
+        groups[ins.first->second].m_cmds.push_back(idx);
+      };
+      for (; i < count; ++i) {
+        const auto& cmd = cmds[i];
+        auto& res = results[i];
+        bool all_symbols = cmd.m_type == command_type::match && cmd.m_match.m_symb.empty();
+        if (all_symbols && !groups.empty()) {
+          break;
+        }
+        uint64_t id = 0;
+        bool has_id = false;
+        if (cmd.m_type == command_type::new_order || cmd.m_type == command_type::amend_order) {
+          id = cmd.m_order.get_id();
+          has_id = true;
+        }
+        else if (cmd.m_type == command_type::cancel_order) {
+          id = cmd.m_cancel.m_id;
+          has_id = true;
+        }
+        if (has_id && new_ids.count(id) != 0) {
+          break;
+        }
+        auto time = command_time(cmd);
+        if (time > 0 && !groups.empty() && std::min(stretch_due, next_expiry_due()) <= time) {
+          break;
+        }
+        res = command_result();
+        res.m_id = id;
+        res.m_expired_begin = expired.size();
+        if (time > 0) {
+          expire_orders(time, expired);
+        }
+        res.m_expired_count = expired.size() - res.m_expired_begin;
+        if (all_symbols) {
+          res.m_kind = output_kind::fill;
+          res.m_fill_begin = fills.size();
+          auto cur = match_all();
+          fills.insert(fills.end(), cur.begin(), cur.end());
+          res.m_fill_count = fills.size() - res.m_fill_begin;
+          ++i;
+          break;
+        }
+        switch (cmd.m_type) {
+        case command_type::rejected:
+          res.m_id = cmd.m_reject_id;
+          set_batch_reject(res, cmd.m_reason, cmd.m_reject_code);
+          break;
+        case command_type::new_order:
+          if (cmd.m_order.get_time() < m_current_time || !is_valid_expiry(cmd.m_order)) {
+            set_batch_reject(res, reject_reason::invalid_order, 303);
+            break;
+          }
+          m_current_time = cmd.m_order.get_time();
+          new_ids.insert(id);
+          add_to_group(cmd.m_order.get_symbol(), i);
+          if (cmd.m_order.get_expire_time() != 0) {
+            stretch_due = std::min(stretch_due, cmd.m_order.get_expire_time());
+          }
+          break;
+        case command_type::amend_order:
+        {
+          if (cmd.m_order.get_time() < m_current_time || !is_valid_expiry(cmd.m_order)) {
+            set_batch_reject(res, reject_reason::amend_invalid, 101);
+            break;
+          }
+          m_current_time = cmd.m_order.get_time();
+          if (cmd.m_order.get_expire_time() != 0) {
+            stretch_due = std::min(stretch_due, cmd.m_order.get_expire_time());
+          }
+          auto symbol_iter = m_symbols.find(id);
+          if (symbol_iter == m_symbols.end()) {
+            set_batch_reject(res, reject_reason::amend_not_found, 404);
+          }
+          else if (symbol_iter->second != cmd.m_order.get_symbol()) {
+            set_batch_reject(res, reject_reason::amend_invalid, 101);
+          }
+          else {
+            add_to_group(symbol_iter->second, i);
+          }
+          break;
+        }
+        case command_type::cancel_order:
+        {
+          auto symbol_iter = m_symbols.find(id);
+          if (symbol_iter == m_symbols.end()) {
+            set_batch_reject(res, reject_reason::cancel_not_found, 404);
+          }
+          else {
+            add_to_group(symbol_iter->second, i);
+          }
+          break;
+        }
+        case command_type::match:
+          res.m_kind = output_kind::fill;
+          add_to_group(cmd.m_match.m_symb, i);
+          break;
+        case command_type::mass_cancel:
+        {
+          // nothing to cancel unless the book exists or is created earlier in this stretch
+          const auto& symb = cmd.m_mass_cancel.m_symb;
+          res.m_kind = output_kind::mass_cancel_accept;
+          if (m_engines.count(symb) != 0 || group_index.count(symb) != 0) {
+            add_to_group(symb, i);
+          }
+          break;
+        }
+        default:
+          break;
+        }
+      }
+      for (const auto& group : groups) {
+        execute_batch_group(group, cmds, results, fills);
+      }
+    }
+  }
+  std::vector<matched_result_detail> match_one(const std::string& symb)
+  {
+    auto iter = m_engines.find(symb);
+    if (iter == m_engines.end()) {
+      // nothing rests for a symbol without a book
+      return std::vector<matched_result_detail>();
+    }
+    auto ret = run_matching(iter->second);
+    publish(iter->first, iter->second);
+    return ret;
+  }
+  std::vector<matched_result_detail> match_all()
+  {
+    std::vector<matched_result_detail> ret;
+    for (auto& eng : m_engines) {
+      auto cur = run_matching(eng.second);
+      ret.insert(ret.end(), cur.begin(), cur.end());
+      publish(eng.first, eng.second);
+    }
+    return ret;
+  }
+  // writes the whole state as a versioned binary snapshot; sequence is the
+  // number of input commands the state reflects, returned again by load_snapshot
+  void save_snapshot(snapshot_writer& w, uint64_t sequence) const
+  {
+    auto st = get_stats();
+    w.reserve(w.get_data().size() + 1024 + st.m_symbols * 64
+      + st.m_total.get_resting_orders() * sizeof(snapshot_order_record)
+      + st.m_known_ids * (sizeof(uint64_t) + sizeof(uint32_t)));
+    w.put(snapshot_magic);
+    w.put(snapshot_version);
+    w.put(sequence);
+    w.put(m_current_time);
+    w.put(m_rejects_303);
+    w.put(m_rejects_404);
+    w.put(m_rejects_101);
+    w.put(static_cast<uint32_t>(m_engines.size()));
+    std::unordered_map<std::string, uint32_t> symbol_index;
+    for (const auto& eng : m_engines) {
+      symbol_index.insert(std::make_pair(eng.first, static_cast<uint32_t>(symbol_index.size())));
+      w.put_string(eng.first);
+      eng.second.save(w);
+    }
+    w.put(static_cast<uint64_t>(m_symbols.size()));
+    for (const auto& elem : m_symbols) {
+      w.put(elem.first);
+      w.put(symbol_index.at(elem.second));
+    }
+    w.put(m_expiry_wheel.get_time());
+    w.put(static_cast<uint64_t>(m_expiries.size()));
+    for (const auto& elem : m_expiries) {
+      w.put(elem.first);
+      w.put(elem.second);
+    }
+  }
+  uint64_t load_snapshot(snapshot_reader& r)
+  {
+    if (r.get<uint32_t>() != snapshot_magic) {
+      throw snapshot_error("not an order engines snapshot");
+    }
+    if (r.get<uint32_t>() != snapshot_version) {
+      throw snapshot_error("unsupported snapshot version");
+    }
+    auto sequence = r.get<uint64_t>();
+    m_current_time = r.get<uint32_t>();
+    m_rejects_303 = r.get<uint64_t>();
+    m_rejects_404 = r.get<uint64_t>();
+    m_rejects_101 = r.get<uint64_t>();
+    m_engines.clear();
+    m_changed.clear();
+    std::vector<typename std::map<std::string, engine_type>::iterator> engines(r.get<uint32_t>());
+    for (auto& iter : engines) {
+      auto symb = r.get_string();
+      iter = m_engines.emplace_hint(m_engines.end(), symb, engine_type());
+      iter->second.reserve(m_expected_book_orders);
+      iter->second.load(r, iter->first);
+      iter->second.track_changes(m_track_changes);
+    }
+    m_symbols.clear();
+    auto id_count = r.get<uint64_t>();
+    m_symbols.reserve(std::max<uint64_t>(id_count, m_expected_orders));
+    for (uint64_t i = 0; i < id_count; ++i) {
+      auto id = r.get<uint64_t>();
+      auto idx = r.get<uint32_t>();
+      if (idx >= engines.size()) {
+        throw snapshot_error("snapshot symbol index out of range");
+      }
+      m_symbols.insert(std::make_pair(id, engines[idx]->first));
+    }
+    m_expiries.clear();
+    m_expiry_wheel.clear(r.get<uint32_t>());
+    auto expiry_count = r.get<uint64_t>();
+    for (uint64_t i = 0; i < expiry_count; ++i) {
+      auto id = r.get<uint64_t>();
+      auto tim = r.get<uint32_t>();
+      if (tim <= m_expiry_wheel.get_time()) {
+        throw snapshot_error("snapshot expiry is not after its clock");
+      }
+      set_expiry(id, tim);
+    }
+    if (m_publisher != nullptr) {
+      set_publisher(m_publisher);
+    }
+    return sequence;
+  }
+  void save_snapshot(const std::string& path, uint64_t sequence) const
+  {
+    snapshot_writer w;
+    save_snapshot(w, sequence);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(w.get_data().data(), w.get_data().size());
+    if (!out) {
+      throw snapshot_error("cannot write snapshot " + path);
+    }
+  }
+  uint64_t load_snapshot(const std::string& path)
+  {
+    mapped_file file(path);
+    snapshot_reader r(file.get_data(), file.get_size());
+    return load_snapshot(r);
+  }
+  // every book change is published to p from then on, nullptr stops publishing
+  // sizes the order id index for that many known ids and each book created from
+  // now on for book_orders resting orders per side, 0 lets the tables grow
+  void reserve(uint64_t orders, uint64_t book_orders)
+  {
+    m_expected_orders = orders;
+    m_expected_book_orders = book_orders;
+    m_symbols.reserve(orders);
+  }
+  // from now on the books keep track of their changed orders, see take_changes
+  void track_changes(bool track)
+  {
+    m_track_changes = track;
+    m_changed.clear();
+    for (auto& eng : m_engines) {
+      eng.second.track_changes(track);
+    }
+  }
+  // calls f(symbol, engine, ids) for every book changed since the previous call,
+  // ids are the sorted ids of its added, removed or modified orders
+  template <class F>
+  void take_changes(F f)
+  {
+    std::sort(m_changed.begin(), m_changed.end());
+    m_changed.erase(std::unique(m_changed.begin(), m_changed.end()), m_changed.end());
+    for (auto symb : m_changed) {
+      auto& eng = m_engines.find(*symb)->second;
+      m_changed_ids.clear();
+      eng.take_changes(m_changed_ids);
+      std::sort(m_changed_ids.begin(), m_changed_ids.end());
+      m_changed_ids.erase(std::unique(m_changed_ids.begin(), m_changed_ids.end()), m_changed_ids.end());
+      if (!m_changed_ids.empty()) {
+        f(*symb, static_cast<const engine_type&>(eng), static_cast<const std::vector<uint64_t>&>(m_changed_ids));
+      }
+    }
+    m_changed.clear();
+  }
+  // a copy of the books of symbols, of all books if it is empty; the id directory
+  // is left out, the copy only answers queries
+  basic_order_engines copy_books(const std::vector<std::string>& symbols) const
+  {
+    basic_order_engines ret;
+    if (symbols.empty()) {
+      ret.m_engines = m_engines;
+    }
+    for (const auto& symb : symbols) {
+      auto iter = m_engines.find(symb);
+      if (iter != m_engines.end()) {
+        ret.m_engines.insert(*iter);
+      }
+    }
+    return ret;
+  }
+  // the book of symb, created empty if there is none; used to rebuild past states
+  engine_type& restore_engine(const std::string& symb)
+  {
+    auto iter = m_engines.find(symb);
+    if (iter == m_engines.end()) {
+      iter = add_engine(symb);
+    }
+    return iter->second;
+  }
+  // match commands uncross the books in a call auction instead of matching them continuously
+  void set_auction(bool auction)
+  {
+    m_auction = auction;
+  }
+  void set_publisher(market_data_publisher* p)
+  {
+    m_publisher = p;
+    if (m_publisher != nullptr) {
+      for (const auto& eng : m_engines) {
+        publish(eng.first, eng.second);
+      }
+    }
+  }
+  void record_reject(int code)
+  {
+    switch (code) {
+    case 303:
+      ++m_rejects_303;
+      break;
+    case 404:
+      ++m_rejects_404;
+      break;
+    case 101:
+      ++m_rejects_101;
+      break;
+    }
+  }
+  // number of order ids in the id directory
+  uint64_t get_known_ids() const
+  {
+    return m_symbols.size();
+  }
+  order_engines_stats get_stats() const
+  {
+    order_engines_stats st;
+    st.m_symbols = m_engines.size();
+    st.m_known_ids = m_symbols.size();
+    st.m_rejects_303 = m_rejects_303;
+    st.m_rejects_404 = m_rejects_404;
+    st.m_rejects_101 = m_rejects_101;
+    for (const auto& eng : m_engines) {
+      auto cur = eng.second.get_stats();
+      st.m_total.m_buy_orders += cur.m_buy_orders;
+      st.m_total.m_sell_orders += cur.m_sell_orders;
+      st.m_total.m_buy_market_orders += cur.m_buy_market_orders;
+      st.m_total.m_sell_market_orders += cur.m_sell_market_orders;
+      st.m_total.m_buy_stop_orders += cur.m_buy_stop_orders;
+      st.m_total.m_sell_stop_orders += cur.m_sell_stop_orders;
+      st.m_total.m_buy_levels += cur.m_buy_levels;
+      st.m_total.m_sell_levels += cur.m_sell_levels;
+      st.m_total.m_ioc_expired += cur.m_ioc_expired;
+      st.m_total.m_market_unfilled += cur.m_market_unfilled;
+      st.m_total.m_stops_triggered += cur.m_stops_triggered;
+      st.m_total.m_min_q_killed += cur.m_min_q_killed;
+      st.m_total.m_replenished += cur.m_replenished;
+      st.m_total.m_fills += cur.m_fills;
+      st.m_total.m_volume += cur.m_volume;
+    }
+    return st;
+  }
+  void dump_stats(const std::string& symb, std::ostream& out) const
+  {
+    if (symb.empty()) {
+      for (const auto& eng : m_engines) {
+        out << eng.first << "|stats|" << eng.second.get_stats().to_string() << '\n';
+      }
+      out << "*|stats|" << get_stats().to_string() << '\n';
+    }
+    else {
+      auto iter = m_engines.find(symb);
+      if (iter != m_engines.end()) {
+        out << iter->first << "|stats|" << iter->second.get_stats().to_string() << '\n';
+      }
+    }
+  }
+  // calls f(symbol, engine) for the engine named by the query or for all of them,
+  // a symbol without a book gives nothing
+  template <class F>
+  void for_each_queried(const query_data& q, F f) const
+  {
+    auto symb = q.get_symb();
+    if (symb.empty()) {
+      for (auto& eng : m_engines) {
+        f(eng.first, eng.second);
+      }
+    }
+    else {
+      auto iter = m_engines.find(symb);
+      if (iter != m_engines.end()) {
+        f(iter->first, iter->second);
+      }
+    }
+  }
+private:
+  struct batch_group
+  {
+    const std::string* m_symb = nullptr;
+    std::vector<size_t> m_cmds;
+  };
+  void set_batch_reject(command_result& res, reject_reason reason, int code)
+  {
+    res.m_kind = output_kind::reject;
+    res.m_reason = reason;
+    record_reject(code);
+  }
+  typename std::map<std::string, engine_type>::iterator add_engine(const std::string& symb)
+  {
+    auto iter = m_engines.insert(std::make_pair(symb, engine_type(symb))).first;
+    iter->second.reserve(m_expected_book_orders);
+    iter->second.track_changes(m_track_changes);
+    return iter;
+  }
+  void execute_batch_group(const batch_group& group, const command* cmds, command_result* results, std::vector<matched_result_detail>& fills)
+  {
+    auto eng_iter = m_engines.find(*group.m_symb);
+    if (eng_iter == m_engines.end()) {
+      eng_iter = add_engine(*group.m_symb);
+    }
+    auto& eng = eng_iter->second;
+    for (auto idx : group.m_cmds) {
+      const auto& cmd = cmds[idx];
+      auto& res = results[idx];
+      switch (cmd.m_type) {
+      case command_type::new_order:
+        if (eng.put_order(cmd.m_order, cmd.m_order.get_order_side(), cmd.m_order.get_order_type())) {
+          m_symbols[cmd.m_order.get_id()] = eng_iter->first;
+          set_expiry(cmd.m_order.get_id(), cmd.m_order.get_expire_time());
+          res.m_kind = output_kind::accept;
+        }
+        else {
+          set_batch_reject(res, reject_reason::invalid_order, 303);
+        }
+        break;
+      case command_type::amend_order:
+        switch (eng.amend_order(cmd.m_order)) {
+        case amend_result::not_found:
+          set_batch_reject(res, reject_reason::amend_not_found, 404);
+          break;
+        case amend_result::failed:
+          set_batch_reject(res, reject_reason::amend_invalid, 101);
+          break;
+        case amend_result::ok:
+        case amend_result::executed:
+          res.m_kind = output_kind::amend_accept;
+          if (cmd.m_order.get_expire_time() != 0) {
+            set_expiry(cmd.m_order.get_id(), cmd.m_order.get_expire_time());
+          }
+          break;
+        }
+        break;
+      case command_type::cancel_order:
+        if (eng.cancel_order(cmd.m_cancel.m_id)) {
+          res.m_kind = output_kind::cancel_accept;
+          m_expiries.erase(cmd.m_cancel.m_id);
+        }
+        else {
+          set_batch_reject(res, reject_reason::cancel_not_found, 404);
+        }
+        break;
+      case command_type::match:
+      {
+        res.m_fill_begin = fills.size();
+        auto cur = run_matching(eng);
+        fills.insert(fills.end(), cur.begin(), cur.end());
+        res.m_fill_count = fills.size() - res.m_fill_begin;
+        break;
+      }
+      case command_type::mass_cancel:
+        res.m_id = mass_cancel(eng, cmd.m_mass_cancel, nullptr);
+        break;
+      default:
+        assert(false);
+        break;
+      }
+    }
+    publish(eng_iter->first, eng);
+  }
+  std::vector<matched_result_detail> run_matching(engine_type& eng)
+  {
+    return m_auction ? eng.run_auction() : eng.run_matching();
+  }
+  static uint64_t mass_cancel(engine_type& eng, const mass_cancel_command& mc, std::vector<uint64_t>* ids)
+  {
+    if (mc.m_range) {
+      return eng.cancel_price_range(mc.m_side, mc.m_low, mc.m_high, ids);
+    }
+    if (!mc.m_all_sides) {
+      return eng.cancel_side(mc.m_side, ids);
+    }
+    return eng.cancel_side(order_side::buy, ids) + eng.cancel_side(order_side::sell, ids);
+  }
+  // an expiry has to come after the order and after the expiry clock
+  bool is_valid_expiry(const order_data& od) const
+  {
+    return od.get_expire_time() == 0 || od.get_expire_time() > std::max(od.get_time(), m_expiry_wheel.get_time());
+  }
+  // 0 clears the expiry of id
+  void set_expiry(uint64_t id, uint32_t tim)
+  {
+    if (tim == 0) {
+      m_expiries.erase(id);
+      return;
+    }
+    m_expiries[id] = tim;
+    m_expiry_wheel.insert(tim, id);
+  }
+  // every change of a book goes through here, symb is the key of the book
+  void publish(const std::string& symb, const engine_type& eng)
+  {
+    if (m_track_changes) {
+      m_changed.push_back(&symb);
+    }
+    if (m_publisher != nullptr) {
+      m_publisher->publish(symb, eng);
+    }
+  }
+
+  uint32_t m_current_time = 0;
+  std::map<std::string, engine_type> m_engines;
+  typename Policy::template id_map<std::string> m_symbols;
+  uint64_t m_expected_orders = 0;
+  uint64_t m_expected_book_orders = 0;
+  bool m_auction = false;
+
+  uint64_t m_rejects_303 = 0;
+  uint64_t m_rejects_404 = 0;
+  uint64_t m_rejects_101 = 0;
+
+  market_data_publisher* m_publisher = nullptr;
+
+  // expiry of every good till time order which may still rest, the wheel holds
+  // an entry per expiry ever set and the ones which do not match m_expiries
+  // any more are dropped when they come due
+  typename Policy::template id_map<uint32_t> m_expiries;
+  timing_wheel m_expiry_wheel;
+  std::vector<timing_wheel::entry> m_due;
+
+  bool m_track_changes = false;
+  // symbols of the books published since the last take_changes
+  std::vector<const std::string*> m_changed;
+  std::vector<uint64_t> m_changed_ids;
+};
+
+using order_engines = basic_order_engines<default_engine_policy>;
+
+// replays a generated order stream into engines publishing to a market data
+// publisher while reader threads keep reading snapshots and verify them
+void market_data_stress_test(size_t reader_count, uint64_t command_count)
+{
+  const std::array<const char*, 8> symbols = { { "AA", "BB", "CC", "DD", "EE", "FF", "GG", "HH" } };
+
+  market_data_publisher publisher;
+  order_engines engines;
+  engines.set_publisher(&publisher);
+
+  std::atomic<bool> done{ false };
+  std::vector<uint64_t> reads(reader_count);
+  std::vector<uint64_t> errors(reader_count);
+  std::vector<std::thread> readers;
+  for (size_t r = 0; r < reader_count; ++r) {
+    readers.emplace_back([&, r]() {
+      std::vector<uint64_t> last_version;
+      while (!done.load(std::memory_order_acquire)) {
+        auto count = publisher.get_symbol_count();
+        last_version.resize(count, 0);
+        for (size_t i = 0; i < count; ++i) {
+          auto snap = publisher.read(i);
+          if (snap.m_checksum != snap.compute_checksum() || snap.m_version < last_version[i]) {
+            ++errors[r];
+          }
+          last_version[i] = snap.m_version;
+          ++reads[r];
+        }
+      }
+    });
+  }
+
+  std::mt19937_64 gen(42);
+  auto start = std::chrono::steady_clock::now();
+  uint64_t next_id = 1;
+  for (uint64_t i = 0; i < command_count; ++i) {
+    const char* symb = symbols[gen() % symbols.size()];
+    auto kind = gen() % 20;
+    try {
+      if (kind == 0) {
+        engines.match_one(symb);
+      }
+      else if (kind < 5 && next_id > 1) {
+        engines.cancel_order(1 + gen() % (next_id - 1));
+      }
+      else {
+        auto side = gen() % 2 ? order_side::buy : order_side::sell;
+        float price = 100.0f + static_cast<float>(gen() % 200) / 100.0f;
+        engines.add_order_from_order_data({ next_id++, 1, symb, price, 1 + gen() % 1000, side, order_type::limit });
+      }
+    }
+    catch (const parse_error&) {
+    }
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  done.store(true, std::memory_order_release);
+  for (auto& t : readers) {
+    t.join();
+  }
+
+  uint64_t total_reads = 0;
+  uint64_t total_errors = 0;
+  for (size_t r = 0; r < reader_count; ++r) {
+    total_reads += reads[r];
+    total_errors += errors[r];
+  }
+  std::cout << "md-stress|commands=" << command_count << ",readers=" << reader_count
+    << ",writer_cmd_per_sec=" << static_cast<uint64_t>(command_count / elapsed)
+    << ",reads=" << total_reads << ",errors=" << total_errors << '\n';
+  assert(total_errors == 0);
+}
+
+// gives a level index the map interface used by level_index_benchmark
+template <class Index>
+struct level_book : Index
+{
+  price_level& operator[](uint32_t key)
+  {
+    return this->get(key);
+  }
+};
+
+// times level lookups, inserts and erases on a book of the given depth with
+// prices in cents spread over a wide range, on a std::map and on both level
+// indexes; uniform picks levels anywhere in the book, touch the ten best ones
+// and dense anywhere in a book of levels within 600.00 of each other
+void level_index_benchmark(size_t levels, uint64_t op_count)
+{
+  const std::array<const char*, 3> pick_names = { { "uniform", "touch", "dense" } };
+  const int64_t dense_band = 60000;
+  std::mt19937 gen(7);
+  int picks = 0;
+  auto random_cents = [&]() {
+    return static_cast<int64_t>(picks == 2 ? 1000000 + gen() % dense_band : 1000 + gen() % 10000000);
+  };
+  auto cents_key = [](int64_t cents) {
+    return price_to_key(static_cast<float>(cents * 0.01));
+  };
+  struct op
+  {
+    int m_kind;
+    uint32_t m_key;
+  };
+  for (picks = 0; picks < 3; ++picks) {
+    bool touch = picks == 1;
+    if (picks == 2 && levels > static_cast<size_t>(dense_band / 2)) {
+      break;
+    }
+    // the op stream is generated up front against a sorted model of the book
+    std::set<int64_t> model;
+    while (model.size() < levels) {
+      model.insert(random_cents());
+    }
+    std::vector<uint32_t> initial;
+    for (auto cents : model) {
+      initial.push_back(cents_key(cents));
+    }
+    std::vector<op> ops;
+    ops.reserve(op_count);
+    for (uint64_t i = 0; i < op_count; ++i) {
+      auto kind = static_cast<int>(gen() % 4);
+      int64_t cents;
+      if (kind == 2 || model.empty()) {
+        cents = touch && !model.empty() ? *model.rbegin() + 1 + gen() % 16 : random_cents();
+        kind = 2;
+        model.insert(cents);
+      }
+      else {
+        auto iter = touch ? std::prev(model.end(), 1 + gen() % std::min<size_t>(10, model.size())) : model.lower_bound(random_cents());
+        if (iter == model.end()) {
+          iter = model.begin();
+        }
+        cents = *iter;
+        if (kind == 3) {
+          model.erase(iter);
+        }
+      }
+      ops.push_back({ kind, cents_key(cents) });
+    }
+
+    uint64_t sink = 0;
+    auto run = [&](auto& book) {
+      for (auto key : initial) {
+        book[key];
+      }
+      auto start = std::chrono::steady_clock::now();
+      for (const auto& o : ops) {
+        if (o.m_kind == 3) {
+          book.erase(o.m_key);
+        }
+        else {
+          sink += book[o.m_key].m_live;
+        }
+      }
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    std::map<uint32_t, price_level, std::greater<uint32_t>> map_book;
+    level_book<price_level_index<limit_order_buy_less>> index_book;
+    level_book<price_tick_index<limit_order_buy_less>> tick_book;
+    auto map_elapsed = run(map_book);
+    auto index_elapsed = run(index_book);
+    auto tick_elapsed = run(tick_book);
+    assert(map_book.size() == index_book.size() && map_book.size() == tick_book.size());
+    std::cout << "level-bench|levels=" << levels << ",ops=" << op_count << ",picks=" << pick_names[picks]
+      << ",map_ns=" << static_cast<uint64_t>(map_elapsed * 1e9 / op_count)
+      << ",index_ns=" << static_cast<uint64_t>(index_elapsed * 1e9 / op_count)
+      << ",tick_ns=" << static_cast<uint64_t>(tick_elapsed * 1e9 / op_count)
+      << ",sink=" << sink << '\n';
+  }
+}
+
+// times inserts, hits, misses and erases of count random order ids on a
+// std::unordered_map and on flat_id_map, both sized for count up front
+void id_table_benchmark(size_t count)
+{
+  std::mt19937_64 gen(11);
+  std::vector<uint64_t> ids(count);
+  for (auto& id : ids) {
+    id = gen() >> 1;
+  }
+  std::vector<uint64_t> shuffled(ids);
+  std::shuffle(shuffled.begin(), shuffled.end(), gen);
+  uint64_t sink = 0;
+  auto run = [&](auto& table) {
+    std::array<double, 4> elapsed;
+    auto start = std::chrono::steady_clock::now();
+    auto lap = [&](size_t idx) {
+      auto now = std::chrono::steady_clock::now();
+      elapsed[idx] = std::chrono::duration<double>(now - start).count() * 1e9 / count;
+      start = now;
+    };
+    for (size_t i = 0; i < count; ++i) {
+      table.emplace(ids[i], static_cast<uint32_t>(i));
+    }
+    lap(0);
+    for (auto id : shuffled) {
+      sink += table.find(id)->second;
+    }
+    lap(1);
+    for (auto id : shuffled) {
+      sink += table.count(id | (uint64_t(1) << 63));
+    }
+    lap(2);
+    for (auto id : shuffled) {
+      table.erase(id);
+    }
+    lap(3);
+    assert(table.empty());
+    return elapsed;
+  };
+  std::unordered_map<uint64_t, uint32_t> std_table;
+  std_table.reserve(count);
+  flat_id_map<uint32_t> flat_table(count);
+  auto std_ns = run(std_table);
+  auto flat_ns = run(flat_table);
+  const std::array<const char*, 4> names = { { "insert", "find", "miss", "erase" } };
+  std::cout << "hash-bench|count=" << count;
+  for (size_t i = 0; i < names.size(); ++i) {
+    std::cout << ",std_" << names[i] << "_ns=" << static_cast<uint64_t>(std_ns[i])
+      << ",flat_" << names[i] << "_ns=" << static_cast<uint64_t>(flat_ns[i]);
+  }
+  std::cout << ",sink=" << sink << '\n';
+}
+
+
+std::vector<std::string> split_string(const std::string& line)
+{
+  std::vector<std::string> tokens;
+  std::string token;
+  std::istringstream tokenStream(line);
+  while (std::getline(tokenStream, token, ','))
+  {
+    tokens.push_back(token);
+  }
+  return tokens;
+}
+
+order_type string_to_order_type(const std::string& s)
+{
+  if (s.length() != 1) {
+    throw dummy_parse_error();
+  }
+  switch (s[0]) {
+  case 'M' :
+    return order_type::market;
+  case 'L':
+    return order_type::limit;
+  case 'I':
+    return order_type::limit_ioc;
+  case 'S':
+    return order_type::stop;
+  case 'T':
+    return order_type::stop_limit;
+  case 'F':
+    return order_type::limit_fok;
+  }
+  throw dummy_parse_error();
+}
+
+order_side string_to_order_side(const std::string& s)
+{
+  if (s.length() != 1) {
+    throw dummy_parse_error();
+  }
+
+  switch (s[0]) {
+  case 'S':
+    return order_side::sell;
+  case 'B':
+    return order_side::buy;
+  }
+
+  throw dummy_parse_error();
+}
+
+// N,<id>,<timestamp>,<symbol>,<type>,<side>,<price>,<quantity>[,<expire timestamp>[,<stop price>[,<minimum quantity>[,<peak>]]]]
+// the optional fields may be left empty before the ones after them; stop (S)
+// and stop limit (T) orders have to have a stop price and the others must not,
+// a minimum quantity from 1 to the quantity is for limit (L) and ioc (I) orders
+// only, and a peak from 1 to the quantity makes a limit order without a minimum
+// an iceberg
+order_data parse_new_order_string(const std::string& line)
+{
+  auto tok = split_string(line);
+  uint64_t order_id = tok.size() > 1 ? std::stoull(tok[1]) : 0;
+  if (tok.size() < 8 || tok.size() > 12) {
+    throw new_parse_error(order_id);
+  }
+  try {
+    uint32_t time_stamp = std::stoul(tok[2]);
+    std::string symb = tok[3];
+    order_type ord_type = string_to_order_type(tok[4]);
+    order_side ord_side = string_to_order_side(tok[5]);
+    float price = std::stof(tok[6]);
+    uint64_t q = std::stoull(tok[7]);
+
+    order_data od(order_id, time_stamp, symb, price, q, ord_side, ord_type);
+    if (tok.size() >= 9 && !tok[8].empty()) {
+      auto expire = std::stoul(tok[8]);
+      if (expire == 0 || expire > UINT32_MAX) {
+        throw new_parse_error(order_id);
+      }
+      od.set_expire_time(static_cast<uint32_t>(expire));
+    }
+    bool stop = ord_type == order_type::stop || ord_type == order_type::stop_limit;
+    if (stop != (tok.size() >= 10 && !tok[9].empty())) {
+      throw new_parse_error(order_id);
+    }
+    if (stop) {
+      auto stop_price = std::stof(tok[9]);
+      if (!(stop_price > 0.0f) || !std::isfinite(stop_price)) {
+        throw new_parse_error(order_id);
+      }
+      od.set_stop_price(stop_price);
+    }
+    if (tok.size() >= 11 && !tok[10].empty()) {
+      auto min_q = std::stoull(tok[10]);
+      if ((ord_type != order_type::limit && ord_type != order_type::limit_ioc) || min_q == 0 || min_q > q) {
+        throw new_parse_error(order_id);
+      }
+      od.set_min_q(min_q);
+    }
+    if (tok.size() == 12) {
+      auto peak = std::stoull(tok[11]);
+      if (ord_type != order_type::limit || od.get_min_q() != 0 || peak == 0 || peak > q) {
+        throw new_parse_error(order_id);
+      }
+      od.set_peak(peak);
+    }
+    return od;
+  }
+  catch (const dummy_parse_error&) {
+    throw new_parse_error(order_id);
+  }
+  catch (const std::exception&) {
+    throw new_parse_error(order_id);
+  }
+}
+
+order_data parse_amend_order_string(const std::string& line)
+{
+  return parse_new_order_string(line);
+}
+
+cancel_command parse_cancel_string(const std::string& line)
+{
+  auto tok = split_string(line);
+  auto id = tok.size() > 1 ? std::stoull(tok[1]) : 0;
+  if (tok.size() != 3) {
+    throw new_parse_error(id);
+  }
+  auto tim = std::stoul(tok[2]);
+  return {id, tim};
+}
+
+// C,<timestamp>,<symbol>[,<side>[,<low price>,<high price>]]
+mass_cancel_command parse_mass_cancel_string(const std::string& line)
+{
+  auto tok = split_string(line);
+  mass_cancel_command mc;
+  try {
+    if ((tok.size() != 3 && tok.size() != 4 && tok.size() != 6) || tok[2].empty()) {
+      throw dummy_parse_error();
+    }
+    mc.m_timestamp = std::stoul(tok[1]);
+    mc.m_symb = tok[2];
+    if (tok.size() > 3) {
+      mc.m_all_sides = false;
+      mc.m_side = string_to_order_side(tok[3]);
+    }
+    if (tok.size() > 4) {
+      mc.m_range = true;
+      mc.m_low = std::stof(tok[4]);
+      mc.m_high = std::stof(tok[5]);
+      if (!(mc.m_low <= mc.m_high)) {
+        throw dummy_parse_error();
+      }
+    }
+  }
+  catch (const dummy_parse_error&) {
+    throw mass_cancel_parse_error();
+  }
+  catch (const std::exception&) {
+    throw mass_cancel_parse_error();
+  }
+  return mc;
+}
+
+match_command parse_match_string(const std::string& line)
+{
+  auto tok = split_string(line);
+  if (tok.size() == 2) {
+    return match_command{ std::stoul(tok[1]) };
+  }
+  else if (tok.size() == 3) {
+    return match_command(tok[2], std::stoul(tok[1]));
+  }
+  throw new_parse_error(0);
+}
+
+query_data parse_query_string(const std::string& s)
+{
+  auto tok = split_string(s);
+  if (tok.size() == 1) {
+    return query_data{};
+  }
+  if (tok.size() == 2) {
+    try {
+      uint32_t time = std::stoul(tok[1]);
+      return query_data{time};
+    }
+    catch (...) {
+      // if cannot convert to number, then it is symbol name
+      return query_data{ tok[1] };
+    }
+  }
+  if (tok.size() == 3) {
+    try {
+      uint32_t time = std::stoul(tok[1]);
+      std::string symb = tok[2];
+      return query_data(symb, time);
+    }
+    catch (...) {
+      // if not able to convert to number, try other way around
+    }
+    try {
+      uint32_t time = std::stoul(tok[2]);
+      std::string symb = tok[1];
+      return query_data(symb, time);
+    }
+    catch (...) {
+      // neither field is a time
+    }
+    throw new_parse_error(0);
+  }
+  return query_data{};
+}
+
+stats_command parse_stats_string(const std::string& line)
+{
+  auto tok = split_string(line);
+  if (tok.size() == 2) {
+    return stats_command{ tok[1] };
+  }
+  return stats_command{};
+}
+
+// a line which is not a command of the input is rejected as invalid order
+// details, with the id of the order when one could be read
+command parse_command(const std::string& line)
+{
+  command cmd;
+  if (line.empty()) {
+    return cmd;
+  }
+  try {
+    switch (line[0]) {
+    case 'N':
+      cmd.m_order = parse_new_order_string(line);
+      cmd.m_type = command_type::new_order;
+      break;
+    case 'A':
+      cmd.m_order = parse_amend_order_string(line);
+      cmd.m_type = command_type::amend_order;
+      break;
+    case 'X':
+      cmd.m_cancel = parse_cancel_string(line);
+      cmd.m_type = command_type::cancel_order;
+      break;
+    case 'C':
+      cmd.m_mass_cancel = parse_mass_cancel_string(line);
+      cmd.m_type = command_type::mass_cancel;
+      break;
+    case 'M':
+      cmd.m_match = parse_match_string(line);
+      cmd.m_type = command_type::match;
+      break;
+    case 'Q':
+      cmd.m_query = parse_query_string(line);
+      cmd.m_type = command_type::query;
+      break;
+    case 'L':
+      cmd.m_query = parse_query_string(line);
+      cmd.m_type = command_type::levels;
+      break;
+    case 'S':
+      cmd.m_stats = parse_stats_string(line);
+      cmd.m_type = command_type::stats;
+      break;
+    }
+  }
+  catch (const parse_error& err) {
+    cmd.m_type = command_type::rejected;
+    cmd.m_reason = err.get_reason();
+    cmd.m_reject_code = err.get_code();
+    cmd.m_reject_id = err.get_order_id();
+  }
+  catch (const std::exception&) {
+    // a number field which does not convert
+    cmd = command();
+    cmd.m_type = command_type::rejected;
+    cmd.m_reason = reject_reason::invalid_order;
+    cmd.m_reject_code = 303;
+  }
+  return cmd;
+}
+
+// one line of output, produced by the engine and formatted separately
+struct deferred_output;
+
+struct output_record
+{
+  output_kind m_kind = output_kind::text;
+  // the number of cancelled orders for a mass cancel
+  uint64_t m_id = 0;
+  reject_reason m_reason = reject_reason::invalid_order;
+  std::string m_symb;
+  matched_result_detail m_fill;
+  depth_row m_depth;
+  level_row m_level;
+  std::string m_text;
+  // the records of a query answered on another thread, they take the place of a deferred one
+  std::shared_ptr<deferred_output> m_deferred;
+};
+
+// filled by the thread which answers the query, the records may be read once m_done is set
+struct deferred_output
+{
+  std::vector<output_record> m_records;
+  std::atomic<bool> m_done{ false };
+
+  bool is_done() const
+  {
+    return m_done.load(std::memory_order_acquire);
+  }
+  const std::vector<output_record>& wait() const
+  {
+    while (!is_done()) {
+      std::this_thread::yield();
+    }
+    return m_records;
+  }
+};
+
+std::string get_reject_msg(reject_reason reason, uint64_t id)
+{
+  switch (reason) {
+  case reject_reason::invalid_order:
+    return new_parse_error(id).get_msg();
+  case reject_reason::amend_not_found:
+    return amend_not_found_error(id).get_msg();
+  case reject_reason::amend_invalid:
+    return amend_parse_error(id).get_msg();
+  case reject_reason::cancel_not_found:
+    return cancel_not_found_error(id).get_msg();
+  case reject_reason::mass_cancel_invalid:
+    return mass_cancel_parse_error().get_msg();
+  }
+  assert(false);
+  return std::string();
+}
+
+void write_record(const output_record& rec, std::ostream& out)
+{
+  switch (rec.m_kind) {
+  case output_kind::accept:
+    out << rec.m_id << " - Accept\n";
+    break;
+  case output_kind::amend_accept:
+    out << rec.m_id << " - AmendAccept\n";
+    break;
+  case output_kind::cancel_accept:
+    out << rec.m_id << " - CancelAccept\n";
+    break;
+  case output_kind::mass_cancel_accept:
+    out << rec.m_symb << " - MassCancelAccept - " << rec.m_id << '\n';
+    break;
+  case output_kind::expired:
+    out << rec.m_id << " - Expired\n";
+    break;
+  case output_kind::reject:
+    out << get_reject_msg(rec.m_reason, rec.m_id) << '\n';
+    break;
+  case output_kind::fill:
+    out << rec.m_fill.to_string() << '\n';
+    break;
+  case output_kind::depth:
+    write_depth_row(rec.m_symb, rec.m_depth, out);
+    break;
+  case output_kind::level:
+    write_level_row(rec.m_symb, rec.m_level, out);
+    break;
+  case output_kind::text:
+    out << rec.m_text;
+    break;
+  case output_kind::deferred:
+    for (const auto& r : rec.m_deferred->wait()) {
+      write_record(r, out);
+    }
+    break;
+  }
+}
+
+// output sinks take the records of executed commands through put(rec)
+struct stream_sink
+{
+  explicit stream_sink(std::ostream& out)
+    :m_out(out)
+  {
+
+  }
+  void put(const output_record& rec)
+  {
+    write_record(rec, m_out);
+  }
+  std::ostream& m_out;
+};
+
+// folds the records into a checksum instead of formatting them, so that runs
+// can be compared without the cost of the output
+struct checksum_sink
+{
+  void put(const output_record& rec)
+  {
+    uint64_t v = static_cast<uint64_t>(rec.m_kind) ^ rec.m_id << 8;
+    switch (rec.m_kind) {
+    case output_kind::fill:
+      v ^= rec.m_fill.m_matched_buy.m_order_id * 31 + rec.m_fill.m_matched_sell.m_id * 17 + rec.m_fill.m_matched_buy.m_q;
+      break;
+    case output_kind::depth:
+      v ^= rec.m_depth.m_buy.m_id * 31 + rec.m_depth.m_sell.m_id * 17 + rec.m_depth.m_buy.m_q + rec.m_depth.m_sell.m_q;
+      break;
+    default:
+      break;
+    }
+    m_sum = (m_sum ^ v) * 0x100000001b3ull;
+    ++m_count;
+  }
+  uint64_t m_sum = 0xcbf29ce484222325ull;
+  uint64_t m_count = 0;
+};
+
+// passes records on to Sink in their order without waiting for deferred ones:
+// the records from the first deferred one on are held until it is done
+template <class Sink>
+class deferred_sink
+{
+public:
+  explicit deferred_sink(Sink& sink)
+    :m_sink(sink)
+  {
+
+  }
+  void put(const output_record& rec)
+  {
+    if (m_held.empty() && rec.m_kind != output_kind::deferred) {
+      m_sink.put(rec);
+      return;
+    }
+    m_held.push_back(rec);
+    flush(false);
+  }
+  // passes on the held records, with wait until all are
+  void flush(bool wait)
+  {
+    while (!m_held.empty()) {
+      auto& rec = m_held.front();
+      if (rec.m_kind == output_kind::deferred) {
+        if (!wait && !rec.m_deferred->is_done()) {
+          return;
+        }
+        for (const auto& r : rec.m_deferred->wait()) {
+          m_sink.put(r);
+        }
+      }
+      else {
+        m_sink.put(rec);
+      }
+      m_held.pop_front();
+    }
+  }
+private:
+  Sink& m_sink;
+  std::deque<output_record> m_held;
+};
+
+// the state after the last command of every timestamp, each a full copy of the engines
+template <class Engines>
+class snapshot_history
+{
+public:
+  // the engines report the books they change from now on, so the memory estimate
+  // of a copy follows the changed books only
+  void attach(Engines& engines)
+  {
+    engines.track_changes(true);
+  }
+  void clear()
+  {
+    m_snapshots.clear();
+    m_memory = 0;
+    m_book_orders.clear();
+    m_orders = 0;
+    m_counted = false;
+  }
+  void record(uint32_t time, Engines& engines)
+  {
+    if (!m_counted) {
+      // books restored before the first record were not reported as changed
+      m_counted = true;
+      engines.take_changes([](const std::string&, const typename Engines::engine_type&, const std::vector<uint64_t>&) {
+      });
+      engines.for_each_queried(query_data(), [&](const std::string& symb, const typename Engines::engine_type& eng) {
+        count_book(symb, eng);
+      });
+    }
+    else {
+      engines.take_changes([&](const std::string& symb, const typename Engines::engine_type& eng, const std::vector<uint64_t>&) {
+        count_book(symb, eng);
+      });
+    }
+    // only the resting orders and the known ids go into the estimate
+    order_engines_stats st;
+    st.m_known_ids = engines.get_known_ids();
+    st.m_total.m_buy_orders = m_orders;
+    auto iter = m_snapshots.find(time);
+    if (iter != m_snapshots.end()) {
+      m_memory -= iter->second.second;
+      iter->second.first = engines;
+      iter->second.second = st.get_memory_usage();
+    }
+    else {
+      m_snapshots.emplace(time, std::make_pair(engines, st.get_memory_usage()));
+    }
+    m_memory += st.get_memory_usage();
+  }
+  // returns the latest state recorded at or before time, nullptr if there is none
+  const Engines* find(uint32_t time) const
+  {
+    auto iter = m_snapshots.upper_bound(time);
+    if (iter == m_snapshots.begin()) {
+      return nullptr;
+    }
+    --iter;
+    return &iter->second.first;
+  }
+  // a copy is replaced when its time is recorded again, no view is handed out
+  struct view
+  {
+  };
+  struct cursor
+  {
+    const Engines* seek(const view&)
+    {
+      return nullptr;
+    }
+  };
+  bool get_view(uint32_t, view&) const
+  {
+    return false;
+  }
+  size_t size() const
+  {
+    return m_snapshots.size();
+  }
+  // estimated heap held by the snapshots
+  uint64_t get_memory_usage() const
+  {
+    return m_memory;
+  }
+private:
+  template <class E>
+  void count_book(const std::string& symb, const E& eng)
+  {
+    auto& orders = m_book_orders[symb];
+    m_orders -= orders;
+    orders = eng.get_stats().get_resting_orders();
+    m_orders += orders;
+  }
+
+  // every copy with its estimated heap
+  std::map<uint32_t, std::pair<Engines, uint64_t>> m_snapshots;
+  uint64_t m_memory = 0;
+  // resting orders of every book as of the last record
+  std::unordered_map<std::string, uint64_t> m_book_orders;
+  uint64_t m_orders = 0;
+  bool m_counted = false;
+};
+
+// append only file of byte ranges which are read back through a mapping of
+// the file, the mapping is renewed when a range beyond it is asked for and the
+// old one lives on while it is shared; the file belongs to the object and is
+// removed with it
+class spill_file
+{
+public:
+  explicit spill_file(const std::string& path)
+    :m_path(path)
+  {
+    m_file = std::fopen(path.c_str(), "wb");
+    if (m_file == nullptr) {
+      throw snapshot_error("cannot open spill file " + path);
+    }
+  }
+  spill_file(const spill_file&) = delete;
+  spill_file& operator=(const spill_file&) = delete;
+  ~spill_file()
+  {
+    m_map.reset();
+    std::fclose(m_file);
+    std::remove(m_path.c_str());
+  }
+  // returns the offset of the appended range
+  uint64_t append(const char* data, size_t size)
+  {
+    if (std::fwrite(data, 1, size, m_file) != size || std::fflush(m_file) != 0) {
+      throw snapshot_error("cannot write spill file " + m_path);
+    }
+    auto offset = m_size;
+    m_size += size;
+    return offset;
+  }
+  // a mapping which holds the range
+  std::shared_ptr<const mapped_file> get_map(uint64_t offset, size_t size)
+  {
+    if (!m_map || offset + size > m_map->get_size()) {
+      m_map.reset();
+      m_map = std::make_shared<const mapped_file>(m_path);
+    }
+    return m_map;
+  }
+  uint64_t size() const
+  {
+    return m_size;
+  }
+private:
+  std::string m_path;
+  std::FILE* m_file = nullptr;
+  uint64_t m_size = 0;
+  std::shared_ptr<const mapped_file> m_map;
+};
+
+// the state after the last command of every timestamp as binary deltas of the
+// books: each timestamp stores the orders added, removed or modified since the
+// previous one, varint encoded after the key frame of its chunk which holds all
+// resting orders. A chunk is closed once its deltas hold the key interval of
+// order events and at least as many as its key frame has orders, so key frames
+// take about half of the memory at most. A past state is decoded forward from
+// the key frame of its chunk; the last decoded state is kept, a later time in
+// the same chunk only decodes the deltas in between. Times going backwards
+// (cancels and matches do not check theirs) are recorded at the latest time.
+// With a spill file the closed chunks beyond a memory budget go to the file,
+// oldest first, and are read through its mapping; only their times stay in
+// memory as the index of the file. Closed chunks do not change any more, a
+// view of one can be decoded on other threads while the history records on
+template <class Engines>
+class delta_history
+{
+public:
+  // a closed chunk with the number of its deltas which make a state, and the
+  // symbol table of the history
+  struct view
+  {
+    uint64_t m_generation = 0;
+    size_t m_chunk = 0;
+    size_t m_records = 0;
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    // keeps the chunk in memory or its mapping alive
+    std::shared_ptr<const void> m_owner;
+    std::shared_ptr<const std::vector<std::string>> m_symbols;
+  };
+  // decodes the states of views; the last one is kept, a later state of the
+  // same chunk only decodes the deltas in between
+  class cursor
+  {
+  public:
+    const Engines* seek(const view& v)
+    {
+      if (v.m_generation != m_generation || v.m_chunk != m_chunk || v.m_records < m_records) {
+        m_state = Engines();
+        snapshot_reader r(v.m_data, v.m_size);
+        apply(r, m_state, *v.m_symbols);
+        m_generation = v.m_generation;
+        m_chunk = v.m_chunk;
+        m_records = 0;
+        m_offset = v.m_size - r.get_remaining();
+      }
+      snapshot_reader r(v.m_data + m_offset, v.m_size - m_offset);
+      for (; m_records < v.m_records; ++m_records) {
+        apply(r, m_state, *v.m_symbols);
+      }
+      m_offset = v.m_size - r.get_remaining();
+      return &m_state;
+    }
+  private:
+    Engines m_state;
+    uint64_t m_generation = 0;
+    size_t m_chunk = SIZE_MAX;
+    size_t m_records = 0;
+    size_t m_offset = 0;
+  };
+
+  // the engines report the orders they change from now on
+  void attach(Engines& engines)
+  {
+    engines.track_changes(true);
+  }
+  void clear()
+  {
+    m_chunks.clear();
+    m_spilled = 0;
+    m_ram_bytes = 0;
+    if (m_spill) {
+      auto path = m_spill_path;
+      m_spill.reset();
+      m_spill.reset(new spill_file(path));
+    }
+    m_symbols.clear();
+    m_symbol_index.clear();
+    m_shared_symbols.reset();
+    m_size = 0;
+    m_last_time = 0;
+    m_cursor = cursor();
+    ++m_generation;
+  }
+  // order events in the deltas of a chunk before a new key frame is written
+  void set_key_interval(uint64_t events)
+  {
+    m_key_interval = std::max<uint64_t>(events, 1);
+  }
+  // closed chunks beyond budget bytes are written to path from now on
+  void set_spill(const std::string& path, uint64_t budget)
+  {
+    m_spill.reset();
+    m_spill.reset(new spill_file(path));
+    m_spill_path = path;
+    m_ram_budget = budget;
+    spill();
+  }
+  void record(uint32_t time, Engines& engines)
+  {
+    if (m_chunks.empty() || time > m_last_time) {
+      ++m_size;
+      m_last_time = time;
+    }
+    if (m_chunks.empty() || is_full(m_chunks.back())) {
+      if (!m_chunks.empty()) {
+        m_chunks.back().m_data->shrink_to_fit();
+        m_chunks.back().m_times.shrink_to_fit();
+        m_ram_bytes += m_chunks.back().m_data->get_data().capacity();
+        spill();
+      }
+      m_chunks.emplace_back();
+      m_chunks.back().m_data = std::make_shared<snapshot_writer>();
+      write_key_frame(m_chunks.back(), engines);
+      m_chunks.back().m_time = m_last_time;
+      return;
+    }
+    auto& c = m_chunks.back();
+    auto& w = *c.m_data;
+    engines.take_changes([&](const std::string& symb, const typename Engines::engine_type& eng, const std::vector<uint64_t>& ids) {
+      w.put_varint(get_symbol_index(symb) + 1);
+      w.put_varint(ids.size());
+      uint64_t prev_id = 0;
+      snapshot_order_record rec;
+      for (auto id : ids) {
+        put_event(w, prev_id, id, eng.find_record(id, rec) ? &rec : nullptr);
+      }
+      c.m_events += ids.size();
+    });
+    w.put_varint(0);
+    c.m_times.push_back(m_last_time);
+  }
+  // returns the latest state recorded at or before time, nullptr if there is none;
+  // the state stays valid until the next call
+  const Engines* find(uint32_t time) const
+  {
+    view v;
+    if (!make_view(time, v)) {
+      return nullptr;
+    }
+    return m_cursor.seek(v);
+  }
+  // the view of the latest state at or before time when it is in a closed
+  // chunk, false if the state is in the open one or there is none
+  bool get_view(uint32_t time, view& v) const
+  {
+    return make_view(time, v) && v.m_chunk + 1 < m_chunks.size();
+  }
+  // number of timestamps recorded
+  size_t size() const
+  {
+    return m_size;
+  }
+  // bytes of the chunks in the spill file
+  uint64_t get_spilled_bytes() const
+  {
+    return m_spill ? m_spill->size() : 0;
+  }
+  // heap held by the chunks and the symbol table, without the decoded state
+  uint64_t get_memory_usage() const
+  {
+    uint64_t bytes = m_chunks.capacity() * sizeof(chunk);
+    for (const auto& c : m_chunks) {
+      bytes += (c.m_data ? c.m_data->get_data().capacity() : 0) + c.m_times.capacity() * sizeof(uint32_t);
+    }
+    for (const auto& symb : m_symbols) {
+      bytes += sizeof(symb) + symb.capacity() + sizeof(std::pair<std::string, uint32_t>);
+    }
+    return bytes;
+  }
+  // order events in all deltas, the key frames left out
+  uint64_t get_delta_events() const
+  {
+    uint64_t events = 0;
+    for (const auto& c : m_chunks) {
+      events += c.m_events;
+    }
+    return events;
+  }
+private:
+  // order event tags, an order in the book is followed by its fields
+  static const uint8_t tag_order = 1;
+  static const uint8_t tag_buy = 2;
+  static const uint8_t tag_ioc = 4;
+  static const uint8_t tag_own_price = 8;
+  static const unsigned tag_type_shift = 4;
+  static const uint8_t tag_type_mask = 7;
+  // the order has a minimum quantity it has not traded yet or is an iceberg,
+  // the minimum, the peak and the reserve follow
+  static const uint8_t tag_extra = 128;
+
+  struct chunk
+  {
+    // time of the key frame
+    uint32_t m_time = 0;
+    uint64_t m_key_orders = 0;
+    // order events in the deltas
+    uint64_t m_events = 0;
+    // time of each delta, they follow the key frame in m_data
+    std::vector<uint32_t> m_times;
+    // shared with the views of the chunk
+    std::shared_ptr<snapshot_writer> m_data;
+    // where m_data went once the chunk is spilled
+    uint64_t m_file_offset = 0;
+    size_t m_file_size = 0;
+  };
+
+  bool is_full(const chunk& c) const
+  {
+    return c.m_events >= m_key_interval && c.m_events >= c.m_key_orders;
+  }
+  // writes the oldest closed chunks to the spill file while they take more than the budget
+  void spill()
+  {
+    while (m_spill && m_ram_bytes > m_ram_budget && m_spilled + 1 < m_chunks.size()) {
+      auto& c = m_chunks[m_spilled];
+      const auto& data = c.m_data->get_data();
+      m_ram_bytes -= data.capacity();
+      c.m_file_size = data.size();
+      c.m_file_offset = m_spill->append(data.data(), data.size());
+      c.m_data.reset();
+      ++m_spilled;
+    }
+  }
+  bool make_view(uint32_t time, view& v) const
+  {
+    auto iter = std::upper_bound(m_chunks.begin(), m_chunks.end(), time, [](uint32_t t, const chunk& c) {
+      return t < c.m_time;
+    });
+    if (iter == m_chunks.begin()) {
+      return false;
+    }
+    --iter;
+    v.m_generation = m_generation;
+    v.m_chunk = iter - m_chunks.begin();
+    v.m_records = std::upper_bound(iter->m_times.begin(), iter->m_times.end(), time) - iter->m_times.begin();
+    if (v.m_chunk < m_spilled) {
+      auto map = m_spill->get_map(iter->m_file_offset, iter->m_file_size);
+      v.m_data = map->get_data() + iter->m_file_offset;
+      v.m_size = iter->m_file_size;
+      v.m_owner = std::move(map);
+    }
+    else {
+      v.m_data = iter->m_data->get_data().data();
+      v.m_size = iter->m_data->get_data().size();
+      v.m_owner = iter->m_data;
+    }
+    // the table is copied again once symbols were added since the last view
+    if (!m_shared_symbols || m_shared_symbols->size() != m_symbols.size()) {
+      m_shared_symbols = std::make_shared<const std::vector<std::string>>(m_symbols);
+    }
+    v.m_symbols = m_shared_symbols;
+    return true;
+  }
+  uint32_t get_symbol_index(const std::string& symb)
+  {
+    auto ins = m_symbol_index.insert(std::make_pair(symb, static_cast<uint32_t>(m_symbols.size())));
+    if (ins.second) {
+      m_symbols.push_back(symb);
+    }
+    return ins.first->second;
+  }
+  // the pending changes are covered by the key frame and dropped
+  void write_key_frame(chunk& c, Engines& engines)
+  {
+    engines.take_changes([](const std::string&, const typename Engines::engine_type&, const std::vector<uint64_t>&) {
+    });
+    auto& w = *c.m_data;
+    engines.for_each_queried(query_data(), [&](const std::string& symb, const typename Engines::engine_type& eng) {
+      auto count = eng.get_stats().get_resting_orders();
+      if (count == 0) {
+        return;
+      }
+      w.put_varint(get_symbol_index(symb) + 1);
+      w.put_varint(count);
+      uint64_t prev_id = 0;
+      eng.for_each_record([&](const snapshot_order_record& rec) {
+        put_event(w, prev_id, rec.m_id, &rec);
+      });
+      c.m_key_orders += count;
+    });
+    w.put_varint(0);
+  }
+  // the order of id as it is now, a removal if rec is null; ids are written as
+  // zigzag differences to the previous one of the book
+  static void put_event(snapshot_writer& w, uint64_t& prev_id, uint64_t id, const snapshot_order_record* rec)
+  {
+    auto diff = static_cast<int64_t>(id - prev_id);
+    prev_id = id;
+    if (rec == nullptr) {
+      w.put(static_cast<uint8_t>(0));
+      w.put_varint(static_cast<uint64_t>(diff) << 1 ^ static_cast<uint64_t>(diff >> 63));
+      return;
+    }
+    bool own_price = rec->m_price != rec->m_key_price;
+    bool extra = rec->m_min_q != 0 || rec->m_peak != 0;
+    uint8_t tag = tag_order
+      | (rec->m_order_side == to_underlying(order_side::buy) ? tag_buy : 0)
+      | (rec->m_ioc != 0 ? tag_ioc : 0)
+      | (own_price ? tag_own_price : 0)
+      | (extra ? tag_extra : 0)
+      | static_cast<uint8_t>(rec->m_order_type << tag_type_shift);
+    w.put(tag);
+    w.put_varint(static_cast<uint64_t>(diff) << 1 ^ static_cast<uint64_t>(diff >> 63));
+    w.put_varint(rec->m_seq);
+    w.put_varint(rec->m_q);
+    w.put_varint(rec->m_matched_q);
+    w.put(rec->m_key_price);
+    if (own_price) {
+      w.put(rec->m_price);
+    }
+    if (extra) {
+      w.put_varint(rec->m_min_q);
+      w.put_varint(rec->m_peak);
+      w.put_varint(rec->m_reserve);
+    }
+  }
+  // applies one key frame or delta to state
+  static void apply(snapshot_reader& r, Engines& state, const std::vector<std::string>& symbols)
+  {
+    for (;;) {
+      auto symbol = r.get_varint();
+      if (symbol == 0) {
+        return;
+      }
+      auto& eng = state.restore_engine(symbols.at(symbol - 1));
+      auto count = r.get_varint();
+      uint64_t id = 0;
+      for (uint64_t i = 0; i < count; ++i) {
+        auto tag = r.get<uint8_t>();
+        auto zigzag = r.get_varint();
+        id += (zigzag >> 1) ^ (0 - (zigzag & 1));
+        if ((tag & tag_order) == 0) {
+          eng.cancel_order(id);
+          continue;
+        }
+        snapshot_order_record rec{};
+        rec.m_id = id;
+        rec.m_seq = r.get_varint();
+        rec.m_q = r.get_varint();
+        rec.m_matched_q = r.get_varint();
+        rec.m_key_price = r.get<float>();
+        rec.m_price = (tag & tag_own_price) != 0 ? r.get<float>() : rec.m_key_price;
+        rec.m_order_side = static_cast<uint8_t>(to_underlying((tag & tag_buy) != 0 ? order_side::buy : order_side::sell));
+        if ((tag & tag_extra) != 0) {
+          rec.m_min_q = r.get_varint();
+          rec.m_peak = r.get_varint();
+          rec.m_reserve = r.get_varint();
+        }
+        rec.m_order_type = static_cast<uint8_t>(tag >> tag_type_shift & tag_type_mask);
+        rec.m_ioc = (tag & tag_ioc) != 0 ? 1 : 0;
+        eng.restore_order(rec);
+      }
+    }
+  }
+
+  std::vector<chunk> m_chunks;
+  // the chunks before this one are in the spill file
+  size_t m_spilled = 0;
+  // data of the closed chunks in memory
+  uint64_t m_ram_bytes = 0;
+  uint64_t m_ram_budget = 0;
+  std::unique_ptr<spill_file> m_spill;
+  std::string m_spill_path;
+  std::vector<std::string> m_symbols;
+  std::unordered_map<std::string, uint32_t> m_symbol_index;
+  mutable std::shared_ptr<const std::vector<std::string>> m_shared_symbols;
+  uint64_t m_key_interval = 1024;
+  size_t m_size = 0;
+  uint32_t m_last_time = 0;
+  // tells the chunks of views from before a clear from the later ones
+  uint64_t m_generation = 0;
+  mutable cursor m_cursor;
+};
+
+template <class Engines>
+class no_history
+{
+public:
+  void attach(Engines&)
+  {
+  }
+  void clear()
+  {
+  }
+  void record(uint32_t, const Engines&)
+  {
+  }
+  const Engines* find(uint32_t) const
+  {
+    return nullptr;
+  }
+  struct view
+  {
+  };
+  struct cursor
+  {
+    const Engines* seek(const view&)
+    {
+      return nullptr;
+    }
+  };
+  bool get_view(uint32_t, view&) const
+  {
+    return false;
+  }
+  size_t size() const
+  {
+    return 0;
+  }
+  uint64_t get_memory_usage() const
+  {
+    return 0;
+  }
+};
+
+// appends the depth or level rows of the books q names in state
+template <class Engines>
+void append_query_records(const Engines& state, const query_data& q, bool levels, depth_buffer& buf, std::vector<output_record>& out)
+{
+  state.for_each_queried(q, [&](const std::string& symb, const typename Engines::engine_type& eng) {
+    auto count = levels ? buf.read_levels(eng) : buf.read_depth(eng);
+    for (size_t i = 0; i < count; ++i) {
+      out.emplace_back();
+      auto& rec = out.back();
+      rec.m_symb = symb;
+      if (levels) {
+        rec.m_kind = output_kind::level;
+        rec.m_level = buf.get_level_row(i);
+      }
+      else {
+        rec.m_kind = output_kind::depth;
+        rec.m_depth = buf.get_depth_row(i);
+      }
+    }
+  });
+}
+
+template <class History>
+class query_pool;
+
+// executes parsed commands against the engines and keeps the history used by
+// historical queries; results are appended as output records
+template <class Policy>
+class basic_command_processor
+{
+public:
+  using engines_type = basic_order_engines<Policy>;
+  using history_type = typename Policy::template history<engines_type>;
+
+  explicit basic_command_processor(size_t depth = 5)
+    :m_depth_buffer(depth)
+  {
+    m_history.attach(m_engines);
+  }
+  void execute(const command& cmd, std::vector<output_record>& out)
+  {
+    ++m_sequence;
+    uint32_t time_stamp = 0;
+    // good till time orders expire before the command at their time executes
+    auto clock = command_time(cmd);
+    if (clock > 0) {
+      m_expired.clear();
+      m_engines.expire_orders(clock, m_expired);
+      for (auto id : m_expired) {
+        add_ack(output_kind::expired, id, out);
+      }
+      // the books changed at clock even if the command is rejected
+      if (!m_expired.empty()) {
+        time_stamp = clock;
+      }
+    }
+    try {
+      switch (cmd.m_type) {
+      case command_type::none:
+        break;
+      case command_type::rejected:
+        m_engines.record_reject(cmd.m_reject_code);
+        add_reject(cmd.m_reason, cmd.m_reject_id, out);
+        break;
+      case command_type::new_order:
+        m_engines.add_order_from_order_data(cmd.m_order);
+        add_ack(output_kind::accept, cmd.m_order.get_id(), out);
+        time_stamp = cmd.m_order.get_time();
+        break;
+      case command_type::amend_order:
+        m_engines.amend_order_from_order_data(cmd.m_order);
+        add_ack(output_kind::amend_accept, cmd.m_order.get_id(), out);
+        time_stamp = cmd.m_order.get_time();
+        break;
+      case command_type::cancel_order:
+        m_engines.cancel_order(cmd.m_cancel.m_id);
+        add_ack(output_kind::cancel_accept, cmd.m_cancel.m_id, out);
+        time_stamp = cmd.m_cancel.m_timestamp;
+        break;
+      case command_type::mass_cancel:
+      {
+        std::vector<uint64_t> ids;
+        auto count = m_engines.mass_cancel(cmd.m_mass_cancel, m_report_cancelled ? &ids : nullptr);
+        out.emplace_back();
+        out.back().m_kind = output_kind::mass_cancel_accept;
+        out.back().m_symb = cmd.m_mass_cancel.m_symb;
+        out.back().m_id = count;
+        for (auto id : ids) {
+          add_ack(output_kind::cancel_accept, id, out);
+        }
+        time_stamp = cmd.m_mass_cancel.m_timestamp;
+        break;
+      }
+      case command_type::match:
+      {
+        std::vector<matched_result_detail> result;
+        if (!cmd.m_match.m_symb.empty()) {
+          result = m_engines.match_one(cmd.m_match.m_symb);
+        }
+        else {
+          result = m_engines.match_all();
+        }
+        for (auto& res : result) {
+          out.emplace_back();
+          out.back().m_kind = output_kind::fill;
+          out.back().m_fill = std::move(res);
+        }
+        time_stamp = cmd.m_match.m_time;
+        break;
+      }
+      case command_type::query:
+      case command_type::levels:
+        add_query(cmd.m_query, cmd.m_type == command_type::levels, out);
+        break;
+      case command_type::stats:
+      {
+        std::ostringstream str;
+        dump_stats(cmd.m_stats.m_symb, str);
+        out.emplace_back();
+        out.back().m_text = str.str();
+        break;
+      }
+      }
+    }
+    catch (const parse_error& err) {
+      m_engines.record_reject(err.get_code());
+      add_reject(err.get_reason(), err.get_order_id(), out);
+    }
+    if (time_stamp > 0 && m_planned) {
+      m_first_time = std::min(m_first_time, time_stamp);
+    }
+    else if (time_stamp > 0) {
+      m_history.record(time_stamp, m_engines);
+    }
+  }
+  // from now on the history is not recorded, only the states announced here are
+  // kept: expect_history(time, symbols) announces the state of time for the books
+  // of symbols, all of them if it is empty, and capture_history(time) keeps the
+  // current books as that state. Until then queries for the time see the current
+  // books, which is what the history would give them. release_history(time)
+  // drops the state once no query is left for it
+  void expect_history(uint32_t time, const std::vector<std::string>& symbols)
+  {
+    if (!m_planned) {
+      m_planned = true;
+      m_engines.track_changes(false);
+    }
+    m_expected[time] = symbols;
+  }
+  void capture_history(uint32_t time)
+  {
+    auto iter = m_expected.find(time);
+    assert(iter != m_expected.end());
+    m_captured[time] = m_engines.copy_books(iter->second);
+    m_expected.erase(iter);
+  }
+  void release_history(uint32_t time)
+  {
+    m_expected.erase(time);
+    m_captured.erase(time);
+  }
+  void dump_stats(const std::string& symb, std::ostream& out) const
+  {
+    m_engines.dump_stats(symb, out);
+    if (symb.empty()) {
+      out << "history|stats|snapshots=" << m_history.size() << ",memory=" << m_history.get_memory_usage() << '\n';
+    }
+  }
+  engines_type& get_engines()
+  {
+    return m_engines;
+  }
+  history_type& get_history()
+  {
+    return m_history;
+  }
+  // mass cancels are followed by a cancel accept for every cancelled order
+  void set_report_cancelled(bool report)
+  {
+    m_report_cancelled = report;
+  }
+  // historical queries whose state the history can hand out as a view are
+  // answered by pool and leave a deferred record in their place
+  void set_query_pool(query_pool<history_type>* pool)
+  {
+    m_query_pool = pool;
+  }
+  // number of input commands executed, including the ones of a loaded snapshot
+  uint64_t get_sequence() const
+  {
+    return m_sequence;
+  }
+  void save_snapshot(const std::string& path) const
+  {
+    m_engines.save_snapshot(path, m_sequence);
+  }
+  // the history starts empty, queries for times before the snapshot find nothing
+  void load_snapshot(const std::string& path)
+  {
+    m_sequence = m_engines.load_snapshot(path);
+    m_history.clear();
+  }
+  // used by the command log replay to run a record under its original sequence
+  void set_sequence(uint64_t sequence)
+  {
+    m_sequence = sequence;
+  }
+private:
+  static void add_ack(output_kind kind, uint64_t id, std::vector<output_record>& out)
+  {
+    out.emplace_back();
+    out.back().m_kind = kind;
+    out.back().m_id = id;
+  }
+  static void add_reject(reject_reason reason, uint64_t id, std::vector<output_record>& out)
+  {
+    out.emplace_back();
+    out.back().m_kind = output_kind::reject;
+    out.back().m_reason = reason;
+    out.back().m_id = id;
+  }
+  // the state of time as the history would give it, with the planned states only
+  const engines_type* find_planned(uint32_t time) const
+  {
+    if (m_first_time > time) {
+      return nullptr;
+    }
+    auto captured = m_captured.upper_bound(time);
+    auto expected = m_expected.upper_bound(time);
+    if (expected != m_expected.begin()
+      && (captured == m_captured.begin() || std::prev(expected)->first > std::prev(captured)->first)) {
+      return &m_engines;
+    }
+    return captured == m_captured.begin() ? nullptr : &std::prev(captured)->second;
+  }
+  void add_query(const query_data& q, bool levels, std::vector<output_record>& out)
+  {
+    const engines_type* state = &m_engines;
+    if (q.get_timestamp() != 0) {
+      typename history_type::view v;
+      if (m_query_pool != nullptr && !m_planned && m_history.get_view(q.get_timestamp(), v)) {
+        out.emplace_back();
+        out.back().m_kind = output_kind::deferred;
+        out.back().m_deferred = m_query_pool->submit(std::move(v), q, levels);
+        return;
+      }
+      state = m_planned ? find_planned(q.get_timestamp()) : m_history.find(q.get_timestamp());
+    }
+    if (state == nullptr) {
+      return;
+    }
+    append_query_records(*state, q, levels, m_depth_buffer, out);
+  }
+
+  engines_type m_engines;
+  history_type m_history;
+  depth_buffer m_depth_buffer;
+  uint64_t m_sequence = 0;
+  bool m_report_cancelled = false;
+  // the states kept instead of the history once it is planned, and the first time
+  // the history would have recorded
+  bool m_planned = false;
+  std::map<uint32_t, std::vector<std::string>> m_expected;
+  std::map<uint32_t, engines_type> m_captured;
+  uint32_t m_first_time = UINT32_MAX;
+  query_pool<history_type>* m_query_pool = nullptr;
+  std::vector<uint64_t> m_expired;
+};
+
+using command_processor = basic_command_processor<default_engine_policy>;
+
+#if defined(__unix__) || defined(__APPLE__)
+class io_error : public std::runtime_error
+{
+public:
+  io_error(const std::string& msg, int err)
+    :std::runtime_error(msg + ": " + std::strerror(err))
+  {
+
+  }
+};
+
+#if defined(__linux__)
+// the part of io_uring the file buffers use, set up with the raw system calls
+// so that liburing is not needed: reads and writes are queued and submitted at
+// once, their completions come back tagged in any order
+class io_ring
+{
+public:
+  explicit io_ring(unsigned entries)
+  {
+    io_uring_params params{};
+    m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (m_fd < 0) {
+      throw io_error("cannot set up io_uring", errno);
+    }
+    m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+      m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    }
+    m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    m_sq = map(m_sq_size, IORING_OFF_SQ_RING);
+    m_cq = (params.features & IORING_FEAT_SINGLE_MMAP) != 0 ? m_sq : map(m_cq_size, IORING_OFF_CQ_RING);
+    m_sqes = static_cast<io_uring_sqe*>(map(m_sqes_size, IORING_OFF_SQES));
+    auto sq = static_cast<char*>(m_sq);
+    auto cq = static_cast<char*>(m_cq);
+    m_sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    m_sq_entries = params.sq_entries;
+    m_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  }
+  io_ring(const io_ring&) = delete;
+  io_ring& operator=(const io_ring&) = delete;
+  ~io_ring()
+  {
+    unmap();
+  }
+  // queue and submit a read or write of len bytes at offset, or at the file
+  // position for UINT64_MAX; tag comes back with its completion
+  void submit_read(int fd, void* buf, uint32_t len, uint64_t offset, uint64_t tag)
+  {
+    submit(IORING_OP_READ, fd, buf, len, offset, tag);
+  }
+  void submit_write(int fd, const void* buf, uint32_t len, uint64_t offset, uint64_t tag)
+  {
+    submit(IORING_OP_WRITE, fd, const_cast<void*>(buf), len, offset, tag);
+  }
+  // takes the next completion, waiting for one if wait is set; false if there is none
+  bool complete(uint64_t& tag, int32_t& res, bool wait)
+  {
+    for (;;) {
+      auto head = *m_cq_head;
+      if (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+        const auto& cqe = m_cqes[head & m_cq_mask];
+        tag = cqe.user_data;
+        res = cqe.res;
+        __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+      if (!wait) {
+        return false;
+      }
+      enter(0, 1, IORING_ENTER_GETEVENTS);
+    }
+  }
+private:
+  void submit(uint8_t opcode, int fd, void* buf, uint32_t len, uint64_t offset, uint64_t tag)
+  {
+    auto tail = *m_sq_tail;
+    if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == m_sq_entries) {
+      throw io_error("io_uring submission queue is full", EBUSY);
+    }
+    auto idx = tail & m_sq_mask;
+    auto& sqe = m_sqes[idx];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(buf);
+    sqe.len = len;
+    sqe.off = offset;
+    sqe.user_data = tag;
+    m_sq_array[idx] = idx;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    enter(1, 0, 0);
+  }
+  void* map(size_t size, uint64_t offset)
+  {
+    auto ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, static_cast<off_t>(offset));
+    if (ptr == MAP_FAILED) {
+      io_error err("cannot map io_uring", errno);
+      unmap();
+      throw err;
+    }
+    return ptr;
+  }
+  void unmap()
+  {
+    if (m_sqes != nullptr) {
+      ::munmap(m_sqes, m_sqes_size);
+    }
+    if (m_cq != nullptr && m_cq != m_sq) {
+      ::munmap(m_cq, m_cq_size);
+    }
+    if (m_sq != nullptr) {
+      ::munmap(m_sq, m_sq_size);
+    }
+    ::close(m_fd);
+  }
+  void enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+  {
+    while (::syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0) < 0) {
+      if (errno != EINTR) {
+        throw io_error("io_uring_enter failed", errno);
+      }
+    }
+  }
+
+  int m_fd = -1;
+  void* m_sq = nullptr;
+  void* m_cq = nullptr;
+  io_uring_sqe* m_sqes = nullptr;
+  size_t m_sq_size = 0;
+  size_t m_cq_size = 0;
+  size_t m_sqes_size = 0;
+  unsigned* m_sq_head = nullptr;
+  unsigned* m_sq_tail = nullptr;
+  unsigned* m_sq_array = nullptr;
+  unsigned m_sq_mask = 0;
+  unsigned m_sq_entries = 0;
+  unsigned* m_cq_head = nullptr;
+  unsigned* m_cq_tail = nullptr;
+  io_uring_cqe* m_cqes = nullptr;
+  unsigned m_cq_mask = 0;
+};
+#else
+// io_uring is linux only, elsewhere the file buffers read and write synchronously
+class io_ring
+{
+public:
+  explicit io_ring(unsigned)
+  {
+    throw io_error("io_uring needs linux", ENOSYS);
+  }
+  void submit_read(int, void*, uint32_t, uint64_t, uint64_t)
+  {
+  }
+  void submit_write(int, const void*, uint32_t, uint64_t, uint64_t)
+  {
+  }
+  bool complete(uint64_t&, int32_t&, bool)
+  {
+    return false;
+  }
+};
+#endif
+
+// a ring for one file buffer, nullptr when io_uring is not wanted or cannot be set up
+inline std::unique_ptr<io_ring> make_io_ring(bool wanted, unsigned entries)
+{
+  if (!wanted) {
+    return nullptr;
+  }
+  try {
+    return std::unique_ptr<io_ring>(new io_ring(std::max(8u, entries)));
+  }
+  catch (const io_error&) {
+    return nullptr;
+  }
+}
+
+// offset of the next byte of fd when it is a regular file not opened for
+// appending, so reads and writes can go to explicit offsets out of order;
+// UINT64_MAX otherwise
+inline uint64_t file_offset(int fd)
+{
+  struct stat st{};
+  if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || (::fcntl(fd, F_GETFL) & O_APPEND) != 0) {
+    return UINT64_MAX;
+  }
+  auto pos = ::lseek(fd, 0, SEEK_CUR);
+  return pos < 0 ? UINT64_MAX : static_cast<uint64_t>(pos);
+}
+
+// input stream buffer over a file descriptor; with a ring the reads of the next
+// buffers are in flight while the current one is consumed, all of them for a
+// regular file and one at a time for a pipe whose reads must stay in order,
+// without a ring it reads synchronously
+class fd_input_buf : public std::streambuf
+{
+public:
+  fd_input_buf(int fd, bool use_ring, size_t buffer_count = 4, size_t buffer_size = 1 << 20)
+    :m_fd(fd)
+    ,m_ring(make_io_ring(use_ring, static_cast<unsigned>(buffer_count)))
+    ,m_offset(file_offset(fd))
+    ,m_read_offset(m_offset)
+    ,m_slots(m_ring != nullptr ? std::max<size_t>(2, buffer_count) : 1)
+  {
+    for (auto& s : m_slots) {
+      s.m_data.resize(buffer_size);
+    }
+    if (m_ring) {
+      for (size_t i = 0; i < (m_offset != UINT64_MAX ? m_slots.size() : 1); ++i) {
+        issue(i);
+      }
+    }
+  }
+  fd_input_buf(const fd_input_buf&) = delete;
+  fd_input_buf& operator=(const fd_input_buf&) = delete;
+  ~fd_input_buf()
+  {
+    // the kernel may still write to the buffers of reads in flight
+    try {
+      while (m_in_flight > 0) {
+        reap(true);
+      }
+    }
+    catch (const io_error&) {
+    }
+  }
+  // false when reads are synchronous as io_uring was not wanted or not available
+  bool uses_ring() const
+  {
+    return m_ring != nullptr;
+  }
+protected:
+  int_type underflow() override
+  {
+    if (m_eof) {
+      return traits_type::eof();
+    }
+    if (!m_ring) {
+      auto& s = m_slots[0];
+      ssize_t res;
+      while ((res = ::read(m_fd, s.m_data.data(), s.m_data.size())) < 0) {
+        if (errno != EINTR) {
+          throw io_error("cannot read input", errno);
+        }
+      }
+      return take(s, static_cast<int32_t>(res));
+    }
+    if (m_current) {
+      // the consumed buffer reads further ahead, after the ones in flight
+      m_current = false;
+      if (m_offset != UINT64_MAX) {
+        issue(m_head);
+      }
+      m_head = (m_head + 1) % m_slots.size();
+    }
+    for (;;) {
+      auto& s = m_slots[m_head];
+      if (!s.m_in_flight && !s.m_done) {
+        issue(m_head);
+      }
+      while (!s.m_done) {
+        reap(true);
+      }
+      s.m_done = false;
+      if (s.m_res < 0) {
+        throw io_error("cannot read input", -s.m_res);
+      }
+      if (m_offset != UINT64_MAX && s.m_offset != m_read_offset) {
+        // a short read left a gap before this buffer, it reads again from there
+        m_offset = m_read_offset;
+        issue(m_head);
+        continue;
+      }
+      if (m_offset == UINT64_MAX && s.m_res > 0) {
+        auto next = (m_head + 1) % m_slots.size();
+        if (!m_slots[next].m_in_flight) {
+          issue(next);
+        }
+      }
+      m_current = s.m_res > 0;
+      return take(s, s.m_res);
+    }
+  }
+  // positive when the next underflow does not wait for the file
+  std::streamsize showmanyc() override
+  {
+    if (m_eof) {
+      return -1;
+    }
+    if (!m_ring) {
+      pollfd fd{};
+      fd.fd = m_fd;
+      fd.events = POLLIN;
+      return ::poll(&fd, 1, 0) > 0 ? 1 : 0;
+    }
+    while (reap(false)) {
+    }
+    auto next = m_current ? (m_head + 1) % m_slots.size() : m_head;
+    return m_slots[next].m_done ? 1 : 0;
+  }
+private:
+  struct slot
+  {
+    std::vector<char> m_data;
+    uint64_t m_offset = 0;
+    int32_t m_res = 0;
+    bool m_in_flight = false;
+    bool m_done = false;
+  };
+
+  void issue(size_t idx)
+  {
+    auto& s = m_slots[idx];
+    s.m_offset = m_offset;
+    if (m_offset != UINT64_MAX) {
+      m_offset += s.m_data.size();
+    }
+    m_ring->submit_read(m_fd, s.m_data.data(), static_cast<uint32_t>(s.m_data.size()), s.m_offset, idx);
+    s.m_in_flight = true;
+    ++m_in_flight;
+  }
+  bool reap(bool wait)
+  {
+    uint64_t tag;
+    int32_t res;
+    if (!m_ring->complete(tag, res, wait)) {
+      return false;
+    }
+    auto& s = m_slots[tag];
+    s.m_in_flight = false;
+    s.m_done = true;
+    s.m_res = res;
+    --m_in_flight;
+    return true;
+  }
+  int_type take(slot& s, int32_t len)
+  {
+    if (len == 0) {
+      m_eof = true;
+      return traits_type::eof();
+    }
+    if (m_read_offset != UINT64_MAX) {
+      m_read_offset += len;
+    }
+    setg(s.m_data.data(), s.m_data.data(), s.m_data.data() + len);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  int m_fd;
+  std::unique_ptr<io_ring> m_ring;
+  // offset the next read is issued at and the one the consumer continues at
+  uint64_t m_offset;
+  uint64_t m_read_offset;
+  std::vector<slot> m_slots;
+  // buffer consumed or waited for next, m_current while it is the get area
+  size_t m_head = 0;
+  bool m_current = false;
+  size_t m_in_flight = 0;
+  bool m_eof = false;
+};
+
+// output stream buffer over a file descriptor; with a ring a full buffer is
+// submitted and filling goes on in the next one while the kernel writes it,
+// several at once to a regular file and one at a time to a pipe or a file
+// opened for appending, without a ring it writes synchronously; sync submits
+// what is buffered without waiting, finish waits until all of it is written
+class fd_output_buf : public std::streambuf
+{
+public:
+  fd_output_buf(int fd, bool use_ring, size_t buffer_count = 4, size_t buffer_size = 1 << 20)
+    :m_fd(fd)
+    ,m_ring(make_io_ring(use_ring, static_cast<unsigned>(buffer_count)))
+    ,m_offset(file_offset(fd))
+    ,m_slots(m_ring != nullptr ? std::max<size_t>(2, buffer_count) : 1)
+  {
+    for (auto& s : m_slots) {
+      s.m_data.resize(buffer_size);
+    }
+    start(0);
+  }
+  fd_output_buf(const fd_output_buf&) = delete;
+  fd_output_buf& operator=(const fd_output_buf&) = delete;
+  ~fd_output_buf()
+  {
+    try {
+      finish();
+    }
+    catch (const io_error&) {
+      // the buffers must outlive the writes in flight, however they end
+      uint64_t tag;
+      int32_t res;
+      for (; m_in_flight > 0; --m_in_flight) {
+        m_ring->complete(tag, res, true);
+      }
+    }
+  }
+  bool uses_ring() const
+  {
+    return m_ring != nullptr;
+  }
+  void finish()
+  {
+    flush_current();
+    while (m_in_flight > 0) {
+      reap(true);
+    }
+  }
+protected:
+  int_type overflow(int_type c) override
+  {
+    flush_current();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+  int sync() override
+  {
+    flush_current();
+    return 0;
+  }
+private:
+  struct slot
+  {
+    std::vector<char> m_data;
+    size_t m_len = 0;
+    size_t m_written = 0;
+    uint64_t m_offset = 0;
+    bool m_in_flight = false;
+  };
+
+  void start(size_t idx)
+  {
+    m_current = idx;
+    setp(m_slots[idx].m_data.data(), m_slots[idx].m_data.data() + m_slots[idx].m_data.size());
+  }
+  void flush_current()
+  {
+    auto& s = m_slots[m_current];
+    s.m_len = static_cast<size_t>(pptr() - pbase());
+    if (s.m_len == 0) {
+      return;
+    }
+    s.m_written = 0;
+    if (!m_ring) {
+      while (s.m_written < s.m_len) {
+        auto res = ::write(m_fd, s.m_data.data() + s.m_written, s.m_len - s.m_written);
+        if (res < 0 && errno != EINTR) {
+          throw io_error("cannot write output", errno);
+        }
+        s.m_written += res > 0 ? static_cast<size_t>(res) : 0;
+      }
+      start(m_current);
+      return;
+    }
+    if (m_offset == UINT64_MAX) {
+      // writes without an offset land in the order they run
+      while (m_in_flight > 0) {
+        reap(true);
+      }
+    }
+    s.m_offset = m_offset;
+    if (m_offset != UINT64_MAX) {
+      m_offset += s.m_len;
+    }
+    issue(m_current);
+    auto next = (m_current + 1) % m_slots.size();
+    while (m_slots[next].m_in_flight) {
+      reap(true);
+    }
+    start(next);
+  }
+  void issue(size_t idx)
+  {
+    auto& s = m_slots[idx];
+    auto offset = s.m_offset == UINT64_MAX ? UINT64_MAX : s.m_offset + s.m_written;
+    m_ring->submit_write(m_fd, s.m_data.data() + s.m_written, static_cast<uint32_t>(s.m_len - s.m_written), offset, idx);
+    if (!s.m_in_flight) {
+      s.m_in_flight = true;
+      ++m_in_flight;
+    }
+  }
+  bool reap(bool wait)
+  {
+    uint64_t tag;
+    int32_t res;
+    if (!m_ring->complete(tag, res, wait)) {
+      return false;
+    }
+    auto& s = m_slots[tag];
+    if (res < 0 && res != -EINTR && res != -EAGAIN) {
+      s.m_in_flight = false;
+      --m_in_flight;
+      throw io_error("cannot write output", -res);
+    }
+    s.m_written += res > 0 ? static_cast<size_t>(res) : 0;
+    if (s.m_written < s.m_len) {
+      // the rest of a short write goes out again
+      issue(tag);
+    }
+    else {
+      s.m_in_flight = false;
+      --m_in_flight;
+    }
+    return true;
+  }
+
+  int m_fd;
+  std::unique_ptr<io_ring> m_ring;
+  // offset the next buffer is written at, UINT64_MAX to write at the file position
+  uint64_t m_offset;
+  std::vector<slot> m_slots;
+  size_t m_current = 0;
+  size_t m_in_flight = 0;
+};
+#endif
+
+enum class durability {
+    none
+  , buffered
+  , fsync_batch
+};
+
+// append only log of the commands that change the engines, replayed on start to
+// recover from a crash; every record carries the input sequence of its command and
+// is framed by its size and checksum, so a record torn by a crash ends the replay.
+// Records collect in memory and commit writes a whole group with one call:
+// none writes when the buffer fills and never holds acks, buffered holds acks
+// until the group is handed to the os, fsync_batch until it reached the disk.
+// With use_ring none submits its writes to io_uring and does not wait for them
+class command_log
+{
+public:
+  command_log(const std::string& path, durability level, size_t group_size, bool use_ring = false)
+    :m_level(level)
+    ,m_group_size(std::max<size_t>(1, group_size))
+  {
+    m_file = std::fopen(path.c_str(), "ab");
+    if (m_file == nullptr) {
+      throw snapshot_error("cannot open command log " + path);
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    if (use_ring && level == durability::none) {
+      m_async.reset(new fd_output_buf(fileno(m_file), true, 4, unbuffered_limit));
+    }
+#else
+    (void)use_ring;
+#endif
+  }
+  command_log(const command_log&) = delete;
+  command_log& operator=(const command_log&) = delete;
+  ~command_log()
+  {
+    try {
+      commit();
+#if defined(__unix__) || defined(__APPLE__)
+      if (m_async) {
+        m_async->finish();
+      }
+#endif
+    }
+    catch (const std::runtime_error&) {
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    m_async.reset();
+#endif
+    std::fclose(m_file);
+  }
+  // queries and stats leave the engines as they are and are not logged
+  static bool is_logged(const command& cmd)
+  {
+    switch (cmd.m_type) {
+    case command_type::new_order:
+    case command_type::amend_order:
+    case command_type::cancel_order:
+    case command_type::mass_cancel:
+    case command_type::match:
+    case command_type::rejected:
+      return true;
+    default:
+      return false;
+    }
+  }
+  void append(const command& cmd, uint64_t sequence)
+  {
+    if (!is_logged(cmd)) {
+      return;
+    }
+    m_record.clear();
+    encode(cmd, sequence, m_record);
+    auto size = static_cast<uint32_t>(m_record.size());
+    auto sum = checksum(m_record.data(), m_record.size());
+    m_pending.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    m_pending.append(reinterpret_cast<const char*>(&sum), sizeof(sum));
+    m_pending.append(m_record);
+    ++m_pending_count;
+    if (m_level == durability::none && m_pending.size() >= unbuffered_limit) {
+      commit();
+    }
+  }
+  // acks of logged commands may only be written after their group is committed
+  bool holds_acks() const
+  {
+    return m_level != durability::none;
+  }
+  bool is_group_full() const
+  {
+    return m_pending_count >= m_group_size;
+  }
+  void commit()
+  {
+    if (m_pending.empty()) {
+      return;
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    if (m_async) {
+      try {
+        m_async->sputn(m_pending.data(), static_cast<std::streamsize>(m_pending.size()));
+        m_async->pubsync();
+      }
+      catch (const io_error& err) {
+        throw snapshot_error(std::string("cannot write command log: ") + err.what());
+      }
+      m_pending.clear();
+      m_pending_count = 0;
+      ++m_commits;
+      return;
+    }
+#endif
+    if (std::fwrite(m_pending.data(), 1, m_pending.size(), m_file) != m_pending.size() || std::fflush(m_file) != 0) {
+      throw snapshot_error("cannot write command log");
+    }
+    if (m_level == durability::fsync_batch) {
+      sync();
+    }
+    m_pending.clear();
+    m_pending_count = 0;
+    ++m_commits;
+  }
+  uint64_t get_commits() const
+  {
+    return m_commits;
+  }
+  // executes the records of path whose sequence is above the one of processor,
+  // their output is dropped; a torn tail is cut off so appending can go on after
+  // the last whole record, returns the number of replayed records
+  template <class Processor>
+  static uint64_t replay(const std::string& path, Processor& processor)
+  {
+    uint64_t replayed = 0;
+    {
+      std::ifstream probe(path, std::ios::binary);
+      if (!probe) {
+        return 0;
+      }
+    }
+    size_t size = 0;
+    size_t good = 0;
+    {
+      mapped_file file(path);
+      size = file.get_size();
+      std::vector<output_record> records;
+      const char* data = file.get_data();
+      while (size - good >= 2 * sizeof(uint32_t)) {
+        uint32_t rec_size;
+        uint32_t sum;
+        std::memcpy(&rec_size, data + good, sizeof(rec_size));
+        std::memcpy(&sum, data + good + sizeof(rec_size), sizeof(sum));
+        const char* rec = data + good + 2 * sizeof(uint32_t);
+        if (size - good - 2 * sizeof(uint32_t) < rec_size || checksum(rec, rec_size) != sum) {
+          break;
+        }
+        snapshot_reader r(rec, rec_size);
+        uint64_t sequence = 0;
+        auto cmd = decode(r, sequence);
+        if (sequence > processor.get_sequence()) {
+          processor.set_sequence(sequence - 1);
+          processor.execute(cmd, records);
+          records.clear();
+          ++replayed;
+        }
+        good += 2 * sizeof(uint32_t) + rec_size;
+      }
+    }
+    if (good != size) {
+      truncate(path, good);
+    }
+    return replayed;
+  }
+private:
+  static const size_t unbuffered_limit = 1 << 16;
+
+  // cuts the log at size in place and syncs it, the records before the cut are
+  // never rewritten so a crash on the way cannot lose them
+  static void truncate(const std::string& path, size_t size)
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    bool done = fd >= 0 && ::ftruncate(fd, static_cast<off_t>(size)) == 0 && ::fsync(fd) == 0;
+    if (fd >= 0) {
+      ::close(fd);
+    }
+#elif defined(_WIN32)
+    int fd = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+    bool done = fd >= 0 && _chsize_s(fd, static_cast<__int64>(size)) == 0 && _commit(fd) == 0;
+    if (fd >= 0) {
+      _close(fd);
+    }
+#else
+    // without a way to cut a file the prefix goes to a new file which replaces the log
+    bool done = false;
+    {
+      mapped_file file(path);
+      std::ofstream out(path + ".tmp", std::ios::binary | std::ios::trunc);
+      out.write(file.get_data(), static_cast<std::streamsize>(size));
+      done = static_cast<bool>(out.flush());
+    }
+    done = done && std::rename((path + ".tmp").c_str(), path.c_str()) == 0;
+#endif
+    if (!done) {
+      throw snapshot_error("cannot truncate command log " + path);
+    }
+  }
+
+  static uint32_t checksum(const char* data, size_t size)
+  {
+    // fnv-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+      h = (h ^ static_cast<uint8_t>(data[i])) * 16777619u;
+    }
+    return h;
+  }
+  static void encode(const command& cmd, uint64_t sequence, std::string& out)
+  {
+    snapshot_writer w;
+    w.put(sequence);
+    w.put(static_cast<uint8_t>(cmd.m_type));
+    switch (cmd.m_type) {
+    case command_type::new_order:
+    case command_type::amend_order:
+    {
+      const auto& od = cmd.m_order;
+      w.put(od.get_id());
+      w.put(od.get_time());
+      w.put_string(od.get_symbol());
+      w.put(od.get_price());
+      w.put(od.get_q());
+      w.put(static_cast<uint8_t>(od.get_order_side()));
+      w.put(static_cast<uint8_t>(od.get_order_type()));
+      w.put(od.get_expire_time());
+      w.put(od.get_stop_price());
+      w.put(od.get_min_q());
+      w.put(od.get_peak());
+      break;
+    }
+    case command_type::cancel_order:
+      w.put(cmd.m_cancel.m_id);
+      w.put(cmd.m_cancel.m_timestamp);
+      break;
+    case command_type::mass_cancel:
+    {
+      const auto& mc = cmd.m_mass_cancel;
+      w.put(mc.m_timestamp);
+      w.put_string(mc.m_symb);
+      w.put(static_cast<uint8_t>(mc.m_all_sides));
+      w.put(static_cast<uint8_t>(mc.m_side));
+      w.put(static_cast<uint8_t>(mc.m_range));
+      w.put(mc.m_low);
+      w.put(mc.m_high);
+      break;
+    }
+    case command_type::match:
+      w.put(cmd.m_match.m_time);
+      w.put_string(cmd.m_match.m_symb);
+      break;
+    case command_type::rejected:
+      w.put(static_cast<uint8_t>(cmd.m_reason));
+      w.put(static_cast<int32_t>(cmd.m_reject_code));
+      w.put(cmd.m_reject_id);
+      break;
+    default:
+      break;
+    }
+    out = w.get_data();
+  }
+  static command decode(snapshot_reader& r, uint64_t& sequence)
+  {
+    command cmd;
+    sequence = r.get<uint64_t>();
+    cmd.m_type = static_cast<command_type>(r.get<uint8_t>());
+    switch (cmd.m_type) {
+    case command_type::new_order:
+    case command_type::amend_order:
+    {
+      auto id = r.get<uint64_t>();
+      auto tim = r.get<uint32_t>();
+      auto symb = r.get_string();
+      auto price = r.get<float>();
+      auto q = r.get<uint64_t>();
+      auto side = r.get<uint8_t>();
+      auto type = r.get<uint8_t>();
+      // a whole record of an older or broken writer is checked as a snapshot is
+      if (side > to_underlying(order_side::buy) || type > to_underlying(order_type::limit_fok)) {
+        throw snapshot_error("command log order side or type out of range");
+      }
+      cmd.m_order = order_data(id, tim, symb, price, q, static_cast<order_side>(side), static_cast<order_type>(type));
+      // records written before orders could expire or stop end here
+      if (r.get_remaining() != 0) {
+        cmd.m_order.set_expire_time(r.get<uint32_t>());
+      }
+      if (r.get_remaining() != 0) {
+        cmd.m_order.set_stop_price(r.get<float>());
+      }
+      if (r.get_remaining() != 0) {
+        cmd.m_order.set_min_q(r.get<uint64_t>());
+      }
+      if (r.get_remaining() != 0) {
+        cmd.m_order.set_peak(r.get<uint64_t>());
+      }
+      break;
+    }
+    case command_type::cancel_order:
+      cmd.m_cancel.m_id = r.get<uint64_t>();
+      cmd.m_cancel.m_timestamp = r.get<uint32_t>();
+      break;
+    case command_type::mass_cancel:
+    {
+      auto& mc = cmd.m_mass_cancel;
+      mc.m_timestamp = r.get<uint32_t>();
+      mc.m_symb = r.get_string();
+      mc.m_all_sides = r.get<uint8_t>() != 0;
+      auto side = r.get<uint8_t>();
+      if (side > to_underlying(order_side::buy)) {
+        throw snapshot_error("command log mass cancel side out of range");
+      }
+      mc.m_side = static_cast<order_side>(side);
+      mc.m_range = r.get<uint8_t>() != 0;
+      mc.m_low = r.get<float>();
+      mc.m_high = r.get<float>();
+      break;
+    }
+    case command_type::match:
+      cmd.m_match.m_time = r.get<uint32_t>();
+      cmd.m_match.m_symb = r.get_string();
+      break;
+    case command_type::rejected:
+    {
+      auto reason = r.get<uint8_t>();
+      if (reason > to_underlying(reject_reason::mass_cancel_invalid)) {
+        throw snapshot_error("command log reject reason out of range");
+      }
+      cmd.m_reason = static_cast<reject_reason>(reason);
+      cmd.m_reject_code = r.get<int32_t>();
+      cmd.m_reject_id = r.get<uint64_t>();
+      break;
+    }
+    default:
+      throw snapshot_error("unknown command log record");
+    }
+    return cmd;
+  }
+  void sync()
+  {
+#if defined(__unix__) || defined(__APPLE__)
+    if (::fsync(fileno(m_file)) != 0) {
+      throw snapshot_error("cannot sync command log");
+    }
+#elif defined(_WIN32)
+    if (_commit(_fileno(m_file)) != 0) {
+      throw snapshot_error("cannot sync command log");
+    }
+#endif
+  }
+
+  durability m_level;
+  size_t m_group_size;
+  FILE* m_file = nullptr;
+#if defined(__unix__) || defined(__APPLE__)
+  std::unique_ptr<fd_output_buf> m_async;
+#endif
+  std::string m_pending;
+  std::string m_record;
+  size_t m_pending_count = 0;
+  uint64_t m_commits = 0;
+};
+
+// true when reading stdin would not block, so an ack group can wait for more commands
+bool stdin_has_data()
+{
+#if defined(__unix__) || defined(__APPLE__)
+  pollfd fd{};
+  fd.fd = 0;
+  fd.events = POLLIN;
+  return ::poll(&fd, 1, 0) > 0;
+#else
+  return false;
+#endif
+}
+
+// reads the commands of in line by line and hands their output to sink; with a
+// log the acks of a group are held back until it is committed
+template <class Processor, class Sink>
+void run_serial(Processor& processor, std::istream& in, Sink& sink_out, command_log* log)
+{
+  // the answers of the query pool keep the place of their query
+  deferred_sink<Sink> sink(sink_out);
+  std::string line;
+  std::vector<output_record> records;
+  while (std::getline(in, line)) {
+    auto cmd = parse_command(line);
+    processor.execute(cmd, records);
+    if (log) {
+      log->append(cmd, processor.get_sequence());
+      // keep collecting the group while more input is at hand
+      if (log->holds_acks() && !log->is_group_full() && (&in == &std::cin ? stdin_has_data() : in.rdbuf()->in_avail() > 0)) {
+        continue;
+      }
+      if (log->holds_acks()) {
+        log->commit();
+      }
+    }
+    for (const auto& rec : records) {
+      sink.put(rec);
+    }
+    records.clear();
+  }
+  if (log) {
+    log->commit();
+  }
+  for (const auto& rec : records) {
+    sink.put(rec);
+  }
+  sink.flush(true);
+}
+
+// bytes per order event of the delta history with its key frames, history-bench
+// measures 22 to 26
+const uint64_t delta_event_bytes = 32;
+
+// two pass replay of the rest of in: the first pass collects the times and
+// symbols of the historical queries, the second executes the commands with the
+// history planned so that the state of a queried time is kept once, after the
+// last command carrying the latest command time at or before it, for the
+// queried symbols only and until the last query for it. A state whose queries
+// all come before it is never kept. The resting orders are estimated in the
+// first pass as the orders entered less the cancels, when the states kept at
+// once would take more than the delta history of all commands at event_bytes
+// per command the commands run with the history instead
+template <class Processor, class Sink>
+void run_prescan(Processor& processor, std::istream& in, Sink& sink, uint64_t event_bytes = delta_event_bytes)
+{
+  std::vector<std::string> lines;
+  std::string line;
+  while (std::getline(in, line)) {
+    lines.push_back(line);
+  }
+  // last line of every command time with the resting orders estimated after it,
+  // the symbols queried at every time, an empty name stands for all of them, and
+  // the line of the last query for every time
+  std::map<uint32_t, std::pair<size_t, uint64_t>> last_lines;
+  std::map<uint32_t, std::vector<std::string>> queried;
+  std::map<uint32_t, size_t> last_queries;
+  uint64_t resting = 0;
+  uint64_t timed = 0;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    auto cmd = parse_command(lines[i]);
+    auto time = command_time(cmd);
+    if (cmd.m_type == command_type::new_order) {
+      auto type = cmd.m_order.get_order_type();
+      resting += type != order_type::limit_ioc && type != order_type::limit_fok ? 1 : 0;
+    }
+    else if (cmd.m_type == command_type::cancel_order) {
+      resting -= resting > 0 ? 1 : 0;
+    }
+    if (time > 0) {
+      last_lines[time] = std::make_pair(i, resting);
+      ++timed;
+    }
+    else if ((cmd.m_type == command_type::query || cmd.m_type == command_type::levels) && cmd.m_query.get_timestamp() != 0) {
+      queried[cmd.m_query.get_timestamp()].push_back(cmd.m_query.get_symb());
+      last_queries[cmd.m_query.get_timestamp()] = i;
+    }
+  }
+  std::map<uint32_t, std::vector<std::string>> needed;
+  std::map<uint32_t, size_t> releases;
+  for (auto& q : queried) {
+    auto iter = last_lines.upper_bound(q.first);
+    if (iter == last_lines.begin()) {
+      continue;
+    }
+    auto time = std::prev(iter)->first;
+    auto& symbols = needed[time];
+    symbols.insert(symbols.end(), q.second.begin(), q.second.end());
+    auto& release = releases[time];
+    release = std::max(release, last_queries[q.first]);
+  }
+  // (line, time) of the captures and of the releases, with the estimated bytes held from one to the other
+  std::vector<std::pair<size_t, uint32_t>> captures;
+  std::vector<std::pair<size_t, uint32_t>> released;
+  std::vector<std::pair<size_t, int64_t>> held;
+  for (auto& n : needed) {
+    auto& symbols = n.second;
+    std::sort(symbols.begin(), symbols.end());
+    symbols.erase(std::unique(symbols.begin(), symbols.end()), symbols.end());
+    if (symbols.front().empty()) {
+      symbols.clear();
+    }
+    auto capture = last_lines[n.first];
+    auto release = releases[n.first];
+    if (release > capture.first) {
+      captures.emplace_back(capture.first, n.first);
+      order_engine_stats st;
+      st.m_buy_orders = capture.second;
+      held.emplace_back(capture.first, static_cast<int64_t>(st.get_memory_usage()));
+      held.emplace_back(release, -static_cast<int64_t>(st.get_memory_usage()));
+    }
+    released.emplace_back(release, n.first);
+  }
+  std::sort(held.begin(), held.end());
+  int64_t bytes = 0;
+  int64_t peak = 0;
+  for (const auto& h : held) {
+    bytes += h.second;
+    peak = std::max(peak, bytes);
+  }
+  bool planned = static_cast<uint64_t>(peak) / std::max<uint64_t>(event_bytes, 1) <= timed;
+  if (planned) {
+    for (auto& n : needed) {
+      processor.expect_history(n.first, n.second);
+    }
+  }
+  else {
+    captures.clear();
+    released.clear();
+  }
+  std::sort(captures.begin(), captures.end());
+  std::sort(released.begin(), released.end());
+  auto next = captures.begin();
+  auto next_release = released.begin();
+  std::vector<output_record> records;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    processor.execute(parse_command(lines[i]), records);
+    for (const auto& rec : records) {
+      sink.put(rec);
+    }
+    records.clear();
+    if (next != captures.end() && next->first == i) {
+      processor.capture_history(next->second);
+      ++next;
+    }
+    for (; next_release != released.end() && next_release->first == i; ++next_release) {
+      processor.release_history(next_release->second);
+    }
+  }
+}
+
+// runs the same generated command stream through processors of several engine
+// policies and prints the time per command of each; their output must agree
+// unless historical queries are answered differently
+void engine_policy_benchmark(size_t count)
+{
+  const std::array<const char*, 8> symbols = { { "AA", "BB", "CC", "DD", "EE", "FF", "GG", "HH" } };
+  std::mt19937_64 gen(5);
+  std::vector<command> cmds;
+  cmds.reserve(count);
+  uint64_t next_id = 1;
+  // symbols with a book, only they can be matched and queried
+  uint32_t known = 0;
+  char buf[128];
+  for (size_t i = 0; i < count; ++i) {
+    // commands share timestamps in groups, the history holds a state per group
+    auto time = static_cast<unsigned>(1 + i / 1024);
+    auto symb_idx = gen() % symbols.size();
+    const char* symb = symbols[symb_idx];
+    auto kind = gen() % 32;
+    auto side = gen() % 2 ? 'B' : 'S';
+    auto price = 100.0 + static_cast<double>(gen() % 200) / 100.0;
+    bool has_book = (known >> symb_idx & 1) != 0;
+    if (kind == 0 && has_book) {
+      std::snprintf(buf, sizeof(buf), "M,%u,%s", time, symb);
+    }
+    else if (kind == 1 && has_book) {
+      std::snprintf(buf, sizeof(buf), "Q,%s", symb);
+    }
+    else if (kind < 10 && next_id > 1) {
+      std::snprintf(buf, sizeof(buf), "X,%" PRIu64 ",%u", 1 + gen() % (next_id - 1), time);
+    }
+    else if (kind < 12 && next_id > 1) {
+      std::snprintf(buf, sizeof(buf), "A,%" PRIu64 ",%u,%s,L,%c,%.2f,%u", 1 + gen() % (next_id - 1), time, symb, side, price,
+        static_cast<unsigned>(1 + gen() % 500));
+    }
+    else {
+      std::snprintf(buf, sizeof(buf), "N,%" PRIu64 ",%u,%s,%s,%c,%.2f,%u", next_id++, time, symb, kind == 12 ? "M" : kind == 13 ? "I" : "L",
+        side, kind == 12 ? 0.0 : price, static_cast<unsigned>(1 + gen() % 500));
+      known |= 1u << symb_idx;
+    }
+    cmds.push_back(parse_command(buf));
+  }
+  // each processor is dropped after its run to keep the peak memory down
+  auto run = [&](auto&& processor, checksum_sink& sink) {
+    std::vector<output_record> records;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& cmd : cmds) {
+      processor.execute(cmd, records);
+      for (const auto& rec : records) {
+        sink.put(rec);
+      }
+      records.clear();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e9 / count;
+  };
+  std::array<checksum_sink, 8> sinks;
+  std::array<double, 8> ns;
+  ns[0] = run(basic_command_processor<default_engine_policy>(), sinks[0]);
+  ns[1] = run(basic_command_processor<tick_engine_policy>(), sinks[1]);
+  ns[2] = run(basic_command_processor<map_engine_policy>(), sinks[2]);
+  ns[3] = run(basic_command_processor<std_hash_engine_policy>(), sinks[3]);
+  ns[4] = run(basic_command_processor<no_history_policy<default_engine_policy>>(), sinks[4]);
+  ns[5] = run(basic_command_processor<no_history_policy<tick_engine_policy>>(), sinks[5]);
+  ns[6] = run(basic_command_processor<no_history_policy<map_engine_policy>>(), sinks[6]);
+  ns[7] = run(basic_command_processor<no_history_policy<std_hash_engine_policy>>(), sinks[7]);
+  for (const auto& sink : sinks) {
+    assert(sink.m_sum == sinks[0].m_sum && sink.m_count == sinks[0].m_count);
+  }
+  const std::array<const char*, 8> names = { {
+    "default", "tick", "map", "std_hash", "default_no_history", "tick_no_history", "map_no_history", "std_hash_no_history"
+  } };
+  std::cout << "policy-bench|commands=" << count;
+  for (size_t i = 0; i < names.size(); ++i) {
+    std::cout << ',' << names[i] << "_ns=" << static_cast<uint64_t>(ns[i]);
+  }
+  std::cout << ",records=" << sinks[0].m_count << ",checksum=" << sinks[0].m_sum << '\n';
+}
+
+// records a generated stream of count commands, a timestamp per 8 of them, with
+// key frames after several numbers of order events, and times historical queries
+// at random past times in random and in ascending order; the memory is per order
+// event in the deltas
+void history_benchmark(size_t count)
+{
+  const std::array<const char*, 4> symbols = { { "AA", "BB", "CC", "DD" } };
+  std::mt19937_64 gen(13);
+  std::vector<command> cmds;
+  cmds.reserve(count);
+  uint64_t next_id = 1;
+  char buf[128];
+  for (size_t i = 0; i < count; ++i) {
+    auto time = static_cast<unsigned>(1 + i / 8);
+    const char* symb = symbols[gen() % symbols.size()];
+    auto kind = gen() % 16;
+    auto side = gen() % 2 ? 'B' : 'S';
+    auto price = 100.0 + static_cast<double>(gen() % 200) / 100.0;
+    if (kind == 0 && next_id > 1) {
+      std::snprintf(buf, sizeof(buf), "M,%u", time);
+    }
+    else if (kind < 6 && next_id > 1) {
+      std::snprintf(buf, sizeof(buf), "X,%" PRIu64 ",%u", 1 + gen() % (next_id - 1), time);
+    }
+    else {
+      std::snprintf(buf, sizeof(buf), "N,%" PRIu64 ",%u,%s,L,%c,%.2f,%u", next_id++, time, symb, side, price,
+        static_cast<unsigned>(1 + gen() % 500));
+    }
+    cmds.push_back(parse_command(buf));
+  }
+  auto last_time = static_cast<uint32_t>(1 + count / 8);
+  std::vector<command> queries;
+  for (int i = 0; i < 1000; ++i) {
+    queries.push_back(parse_command("Q," + std::to_string(1 + gen() % last_time)));
+  }
+  auto sorted = queries;
+  std::sort(sorted.begin(), sorted.end(), [](const command& c1, const command& c2) {
+    return c1.m_query.get_timestamp() < c2.m_query.get_timestamp();
+  });
+  std::cout << "history-bench|commands=" << count;
+  // the last run keeps no chunk in memory but the open one
+  const std::array<uint64_t, 6> intervals = { { 64, 256, 1024, 4096, 16384, 1024 } };
+  for (size_t run = 0; run < intervals.size(); ++run) {
+    auto interval = intervals[run];
+    bool spilled = run + 1 == intervals.size();
+    command_processor processor;
+    processor.get_history().set_key_interval(interval);
+    if (spilled) {
+      processor.get_history().set_spill("history_benchmark.spill", 0);
+    }
+    std::vector<output_record> records;
+    for (const auto& cmd : cmds) {
+      processor.execute(cmd, records);
+      records.clear();
+    }
+    checksum_sink sink;
+    auto time_queries = [&](const std::vector<command>& qs) {
+      auto start = std::chrono::steady_clock::now();
+      for (const auto& cmd : qs) {
+        processor.execute(cmd, records);
+        for (const auto& rec : records) {
+          sink.put(rec);
+        }
+        records.clear();
+      }
+      return static_cast<uint64_t>(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e9 / qs.size());
+    };
+    auto random_ns = time_queries(queries);
+    auto ascending_ns = time_queries(sorted);
+    const auto& history = processor.get_history();
+    if (spilled) {
+      std::cout << ",spilled_bytes=" << history.get_spilled_bytes()
+        << ",spilled_memory=" << history.get_memory_usage()
+        << ",spilled_random_query_ns=" << random_ns
+        << ",spilled_ascending_query_ns=" << ascending_ns;
+      continue;
+    }
+    std::cout << ",interval_" << interval << "_bytes_per_event="
+      << history.get_memory_usage() / std::max<uint64_t>(history.get_delta_events(), 1)
+      << ",interval_" << interval << "_random_query_ns=" << random_ns
+      << ",interval_" << interval << "_ascending_query_ns=" << ascending_ns;
+  }
+  std::cout << '\n';
+}
+
+// bounded lock-free single producer single consumer queue
+template <class T>
+class spsc_ring
+{
+public:
+  explicit spsc_ring(size_t capacity)
+  {
+    size_t size = 2;
+    while (size < capacity) {
+      size *= 2;
+    }
+    m_buf.resize(size);
+    m_mask = size - 1;
+  }
+  bool try_push(T& val)
+  {
+    auto tail = m_tail.load(std::memory_order_relaxed);
+    if (tail - m_head.load(std::memory_order_acquire) == m_buf.size()) {
+      return false;
+    }
+    m_buf[tail & m_mask] = std::move(val);
+    m_tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+  bool try_pop(T& val)
+  {
+    auto head = m_head.load(std::memory_order_relaxed);
+    if (head == m_tail.load(std::memory_order_acquire)) {
+      return false;
     }
-    return amend_result::not_found;
+    val = std::move(m_buf[head & m_mask]);
+    m_head.store(head + 1, std::memory_order_release);
+    return true;
   }
-
-  bool cancel_order(uint64_t id)
+  void push(T& val)
   {
-    if (m_limit_buy_queue.cancel_order(id)) {
-      return true;
+    while (!try_push(val)) {
+      std::this_thread::yield();
     }
-    if (m_limit_sell_queue.cancel_order(id)) {
-      return true;
+  }
+  void pop(T& val)
+  {
+    while (!try_pop(val)) {
+      std::this_thread::yield();
     }
-    if (m_market_order_buy_cont.cancel_order(id)) {
-      return true;
+  }
+private:
+  std::vector<T> m_buf;
+  size_t m_mask = 0;
+  alignas(64) std::atomic<size_t> m_head{ 0 };
+  alignas(64) std::atomic<size_t> m_tail{ 0 };
+};
+
+// answers historical queries on reader threads from views of the history,
+// which stay valid while it records on; every reader has its own ring of jobs
+// and its own cursor, the jobs go to the readers in turn and hand their records
+// back through the deferred_output the submitting thread gets
+template <class History>
+class query_pool
+{
+public:
+  query_pool(size_t threads, size_t depth)
+    :m_readers(std::max<size_t>(threads, 1), nullptr)
+  {
+    std::atomic<size_t> started{ 0 };
+    for (size_t i = 0; i < m_readers.size(); ++i) {
+      m_threads.emplace_back([this, i, depth, &started]() {
+        // on the stack of its thread, where the ring gets its alignment
+        reader rd(depth);
+        m_readers[i] = &rd;
+        started.fetch_add(1, std::memory_order_release);
+        rd.run();
+      });
     }
-    if (m_market_order_sell_cont.cancel_order(id)) {
-      return true;
+    while (started.load(std::memory_order_acquire) < m_readers.size()) {
+      std::this_thread::yield();
     }
-    return false;
   }
-
-  std::vector<matched_result_detail> run_matching()
+  query_pool(const query_pool&) = delete;
+  query_pool& operator=(const query_pool&) = delete;
+  // a job without output stops its reader
+  ~query_pool()
   {
-    std::vector<matched_result_detail> ret;
-    {
-      // first check market orders
-      std::vector<market_order_buy_cont::iterator> market_buy_orders_to_remove;
-      for (auto buy_iter = m_market_order_buy_cont.begin(); buy_iter != m_market_order_buy_cont.end(); ) {
-        if (m_limit_sell_queue.empty()) {
-          break;
-        }
-        auto best_price = m_limit_sell_queue.get_best_price();
-        limit_order_buy& market_buy_order = buy_iter->second;
-        market_buy_order.set_price(best_price);
-        auto& sell_order = m_limit_sell_queue.top_order();
-        auto match_result = match_limit_orders(market_buy_order, sell_order);
-
-        auto matched_count = match_result.get_matched_count();
-        ret.push_back(fill_details(sell_order, market_buy_order, matched_count));
-
-        if (match_result.m_count_buy) {
-          // buy market buy order is fully matched, move to the next market buy order
-          market_buy_orders_to_remove.push_back(buy_iter);
-          ++buy_iter;
-        }
-        if (match_result.m_count_sell) {
-          //limit sell order is fully matched, remove it from the queue
-          m_limit_sell_queue.pop_order();
-        }
-      }
-      for (auto iter : market_buy_orders_to_remove) {
-        m_market_order_buy_cont.erase(iter);
-      }
+    for (auto rd : m_readers) {
+      job end;
+      rd->m_jobs.push(end);
     }
+    for (auto& t : m_threads) {
+      t.join();
+    }
+  }
+  std::shared_ptr<deferred_output> submit(typename History::view v, const query_data& q, bool levels)
+  {
+    job j;
+    j.m_view = std::move(v);
+    j.m_query = q;
+    j.m_levels = levels;
+    j.m_out = std::make_shared<deferred_output>();
+    auto out = j.m_out;
+    m_readers[m_next]->m_jobs.push(j);
+    m_next = (m_next + 1) % m_readers.size();
+    return out;
+  }
+  size_t get_threads() const
+  {
+    return m_readers.size();
+  }
+private:
+  struct job
+  {
+    typename History::view m_view;
+    query_data m_query;
+    bool m_levels = false;
+    std::shared_ptr<deferred_output> m_out;
+  };
+  struct reader
+  {
+    explicit reader(size_t depth)
+      :m_jobs(64)
+      ,m_depth_buffer(depth)
     {
-      // check market sell orders
-      std::vector<market_order_sell_cont::iterator> market_sell_orders_to_remove;
-
-      for (auto sell_iter = m_market_order_sell_cont.begin(); sell_iter != m_market_order_sell_cont.end(); ) {
-        if (m_limit_buy_queue.empty()) {
-          break;
-        }
-
-        auto best_price = m_limit_buy_queue.get_best_price();
-        limit_order_sell& market_sell_order = sell_iter->second;
-        market_sell_order.set_price(best_price);
-
-        auto& buy_order = m_limit_buy_queue.top_order();
-
-        auto match_result = match_limit_orders(buy_order, market_sell_order);
 
-        auto matched_count = match_result.get_matched_count();
-        ret.push_back(fill_details(market_sell_order, buy_order, matched_count));
-
-        if (match_result.m_count_buy) {
-          // buy market buy order is fully matched, move to the next market buy order
-
-          m_limit_buy_queue.pop_order();
-        }
-        if (match_result.m_count_sell) {
-          //limit sell order is fully matched, remove it from the queue
-          market_sell_orders_to_remove.push_back(sell_iter);
-          ++sell_iter;
-        }
-      }
-      for (auto iter : market_sell_orders_to_remove) {
-        m_market_order_sell_cont.erase(iter);
-      }
     }
+    void run()
     {
-      // now match limit orders
+      job j;
       for (;;) {
-        if (m_limit_buy_queue.empty()) {
-          break;
-        }
-        if (m_limit_sell_queue.empty()) {
-          break;
-        }
-        auto& buy_order = m_limit_buy_queue.top_order();
-        auto& sell_order = m_limit_sell_queue.top_order();
-        auto match_result = match_limit_orders(buy_order, sell_order);
-        if (match_result.no_match()) {
-          break;
-        }
-        auto matched_count = match_result.get_matched_count();
-        ret.push_back(fill_details(sell_order, buy_order, matched_count));
-        if (match_result.m_count_buy) {
-          // buy order fully matched
-          m_limit_buy_queue.pop_order();
-        }
-        if (match_result.m_count_sell) {
-          // sell order fully matched
-          m_limit_sell_queue.pop_order();
+        m_jobs.pop(j);
+        if (!j.m_out) {
+          return;
         }
+        auto state = m_cursor.seek(j.m_view);
+        append_query_records(*state, j.m_query, j.m_levels, m_depth_buffer, j.m_out->m_records);
+        j.m_out->m_done.store(true, std::memory_order_release);
+        // the chunk of the view may be freed once it is spilled
+        j = job();
       }
     }
-    {
-      // cancel all ioc orders
-      m_limit_buy_queue.drop_ioc();
-      m_limit_sell_queue.drop_ioc();
-    }
-    return ret;
-  }
-  void dump_data(uint64_t time)
-  {
-    auto limit_buy_queue_iter = m_limit_buy_queue.begin();
-    auto limit_sell_queue_iter = m_limit_sell_queue.begin();
-
-    auto market_buy_queue_iter = m_market_order_buy_cont.begin();
-    auto market_sell_queue_iter = m_market_order_sell_cont.begin();
-
-    for (size_t i = 0; i < 5; ++i) {
-      std::string symb;
-      std::string buy_state;
-      if (market_buy_queue_iter != m_market_order_buy_cont.end()) {
-        symb = market_buy_queue_iter->second.get_data().get_symbol();
+    spsc_ring<job> m_jobs;
+    typename History::cursor m_cursor;
+    depth_buffer m_depth_buffer;
+  };
 
-        buy_state += std::to_string(market_buy_queue_iter->second.get_id());
-        buy_state += ',';
-        buy_state += order_type_to_char(market_buy_queue_iter->second.get_data().get_order_type());
-        buy_state += ',';
-        buy_state += std::to_string(market_buy_queue_iter->second.get_q());
-        buy_state += ',';
-        buy_state += float_to_string(market_buy_queue_iter->second.get_price());
+  std::vector<reader*> m_readers;
+  std::vector<std::thread> m_threads;
+  size_t m_next = 0;
+};
 
-        ++market_buy_queue_iter;
-      }
-      else {
-        if (limit_buy_queue_iter != m_limit_buy_queue.end()) {
-          symb = limit_buy_queue_iter->second.get_data().get_symbol();
-
-          buy_state += std::to_string(limit_buy_queue_iter->second.get_id());
-          buy_state += ',';
-          buy_state += order_type_to_char(limit_buy_queue_iter->second.get_data().get_order_type());
-          buy_state += ',';
-          buy_state += std::to_string(limit_buy_queue_iter->second.get_q());
-          buy_state += ',';
-          buy_state += float_to_string(limit_buy_queue_iter->second.get_price());
-
-          ++limit_buy_queue_iter;
-        }
+// parses lines of in on one thread, executes them on another and formats the
+// output on the calling thread; batches are handed over through spsc rings and
+// an empty batch marks the end of the input, the output is the same as in serial mode;
+// with a log every batch is one commit group
+template <class Processor>
+void run_pipeline(Processor& processor, std::istream& in, std::ostream& out, size_t batch_size, command_log* log)
+{
+  const size_t ring_size = 64;
+  spsc_ring<std::vector<command>> commands(ring_size);
+  spsc_ring<std::vector<output_record>> records(ring_size);
+
+  std::thread parser([&]() {
+    std::vector<command> batch;
+    batch.reserve(batch_size);
+    std::string line;
+    while (std::getline(in, line)) {
+      batch.push_back(parse_command(line));
+      if (batch.size() == batch_size) {
+        commands.push(batch);
+        batch.clear();
+        batch.reserve(batch_size);
       }
-
-      std::string sell_state;
-      if (market_sell_queue_iter != m_market_order_sell_cont.end()) {
-        symb = market_sell_queue_iter->second.get_data().get_symbol();
-
-        sell_state += float_to_string(market_sell_queue_iter->second.get_price());
-        sell_state += ',';
-        sell_state += std::to_string(market_sell_queue_iter->second.get_q());
-        sell_state += ',';
-        sell_state += order_type_to_char(market_sell_queue_iter->second.get_data().get_order_type());
-        sell_state += ',';
-        sell_state += std::to_string(market_sell_queue_iter->second.get_id());
-
-        ++market_sell_queue_iter;
+    }
+    if (!batch.empty()) {
+      commands.push(batch);
+    }
+    std::vector<command> end;
+    commands.push(end);
+  });
+
+  std::thread engine([&]() {
+    std::vector<command> batch;
+    for (;;) {
+      commands.pop(batch);
+      if (batch.empty()) {
+        break;
       }
-      else {
-        if (limit_sell_queue_iter != m_limit_sell_queue.end()) {
-          symb = limit_sell_queue_iter->second.get_data().get_symbol();
-
-          sell_state += float_to_string(limit_sell_queue_iter->second.get_price());
-          sell_state += ',';
-          sell_state += std::to_string(limit_sell_queue_iter->second.get_q());
-          sell_state += ',';
-          sell_state += order_type_to_char(limit_sell_queue_iter->second.get_data().get_order_type());
-          sell_state += ',';
-          sell_state += std::to_string(limit_sell_queue_iter->second.get_id());
-
-          ++limit_sell_queue_iter;
+      std::vector<output_record> recs;
+      for (const auto& cmd : batch) {
+        processor.execute(cmd, recs);
+        if (log != nullptr) {
+          log->append(cmd, processor.get_sequence());
         }
       }
-      if (!symb.empty()) {
-        std::cout << symb << '|' << buy_state << '|' << sell_state << '\n';
+      if (log != nullptr && log->holds_acks()) {
+        log->commit();
       }
-      else {
-        break;
+      if (!recs.empty()) {
+        records.push(recs);
       }
     }
+    std::vector<output_record> end;
+    records.push(end);
+  });
+
+  std::vector<output_record> recs;
+  for (;;) {
+    records.pop(recs);
+    if (recs.empty()) {
+      break;
+    }
+    for (const auto& rec : recs) {
+      write_record(rec, out);
+    }
   }
-private:
-  matched_result_detail fill_details(const order_sell& sell_order, const order_buy& buy_order, uint64_t matched_count) const
-  {
-    matched_result_detail det;
+  parser.join();
+  engine.join();
+}
 
-    det.m_symb = sell_order.get_data().get_symbol();
+// runs the same generated input of count command lines serially and through the
+// pipeline with several batch sizes and prints the time per command of each,
+// parsing and output formatting included; their output must be the same
+void pipeline_benchmark(size_t count)
+{
+  const std::array<const char*, 8> symbols = { { "AA", "BB", "CC", "DD", "EE", "FF", "GG", "HH" } };
+  std::mt19937_64 gen(17);
+  std::string input;
+  input.reserve(count * 40);
+  uint64_t next_id = 1;
+  char buf[128];
+  for (size_t i = 0; i < count; ++i) {
+    auto time = static_cast<unsigned>(1 + i / 1024);
+    const char* symb = symbols[gen() % symbols.size()];
+    auto kind = gen() % 32;
+    auto side = gen() % 2 ? 'B' : 'S';
+    auto price = 100.0 + static_cast<double>(gen() % 200) / 100.0;
+    if (kind == 0 && next_id > 1) {
+      std::snprintf(buf, sizeof(buf), "M,%u,%s", time, symb);
+    }
+    else if (kind == 1 && next_id > 1) {
+      std::snprintf(buf, sizeof(buf), "Q,%s", symb);
+    }
+    else if (kind < 10 && next_id > 1) {
+      std::snprintf(buf, sizeof(buf), "X,%" PRIu64 ",%u", 1 + gen() % (next_id - 1), time);
+    }
+    else if (kind < 12 && next_id > 1) {
+      std::snprintf(buf, sizeof(buf), "A,%" PRIu64 ",%u,%s,L,%c,%.2f,%u", 1 + gen() % (next_id - 1), time, symb, side, price,
+        static_cast<unsigned>(1 + gen() % 500));
+    }
+    else {
+      std::snprintf(buf, sizeof(buf), "N,%" PRIu64 ",%u,%s,%s,%c,%.2f,%u", next_id++, time, symb, kind == 12 ? "M" : "L",
+        side, kind == 12 ? 0.0 : price, static_cast<unsigned>(1 + gen() % 500));
+    }
+    input += buf;
+    input += '\n';
+  }
+  // each processor is dropped after its run to keep the peak memory down
+  auto run = [&](size_t batch_size, std::string& output) {
+    command_processor processor;
+    std::istringstream in(input);
+    std::ostringstream out;
+    auto start = std::chrono::steady_clock::now();
+    if (batch_size == 0) {
+      stream_sink sink(out);
+      run_serial(processor, in, sink, nullptr);
+    }
+    else {
+      run_pipeline(processor, in, out, batch_size, nullptr);
+    }
+    auto ns = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e9 / count;
+    output = out.str();
+    return static_cast<uint64_t>(ns);
+  };
+  std::string serial_out;
+  auto serial_ns = run(0, serial_out);
+  std::cout << "pipeline-bench|commands=" << count << ",serial_ns=" << serial_ns;
+  for (size_t batch_size : { 16, 256, 4096 }) {
+    std::string pipeline_out;
+    auto ns = run(batch_size, pipeline_out);
+    assert(pipeline_out == serial_out);
+    std::cout << ",batch_" << batch_size << "_ns=" << ns;
+  }
+  std::cout << ",output_bytes=" << serial_out.size() << '\n';
+}
 
-    det.m_matched_buy.m_order_id = buy_order.get_id();
-    det.m_matched_buy.m_order_type = buy_order.get_data().get_order_type();
-    det.m_matched_buy.m_price = sell_order.get_price();//buy_order.get_price();
-    det.m_matched_buy.m_q = matched_count;
+// a market order resting through several matches counts as unfilled once, and
+// the history of full copies keeps its memory estimate from the changed books
+void basic_stats_tests()
+{
+  order_engines engines;
+  engines.add_order_from_order_data({ 1, 1, "AB", 0.0f, 10, order_side::buy, order_type::market });
+  engines.match_all();
+  engines.match_all();
+  engines.add_order_from_order_data({ 2, 2, "AB", 10.0f, 4, order_side::sell, order_type::limit });
+  engines.match_all();
+  assert(engines.get_stats().m_total.m_market_unfilled == 1);
+  engines.add_order_from_order_data({ 3, 3, "AB", 0.0f, 5, order_side::buy, order_type::market });
+  engines.add_order_from_order_data({ 4, 3, "CD", 0.0f, 5, order_side::sell, order_type::market });
+  engines.match_all();
+  assert(engines.get_stats().m_total.m_market_unfilled == 3);
+
+  snapshot_history<order_engines> history;
+  order_engines recorded;
+  history.attach(recorded);
+  recorded.add_order_from_order_data({ 1, 1, "AB", 10.0f, 4, order_side::sell, order_type::limit });
+  history.record(1, recorded);
+  recorded.add_order_from_order_data({ 2, 2, "CD", 10.0f, 4, order_side::sell, order_type::limit });
+  recorded.add_order_from_order_data({ 3, 2, "CD", 11.0f, 4, order_side::sell, order_type::limit });
+  history.record(2, recorded);
+  recorded.cancel_order(1);
+  history.record(2, recorded);
+  uint64_t expected = 0;
+  for (uint32_t time : { 1, 2 }) {
+    expected += history.find(time)->get_stats().get_memory_usage();
+  }
+  assert(history.get_memory_usage() == expected && history.size() == 2);
+}
 
-    det.m_matched_sell.m_id = sell_order.get_id();
-    det.m_matched_sell.m_order_type = sell_order.get_data().get_order_type();
-    det.m_matched_sell.m_price = sell_order.get_price();
-    det.m_matched_sell.m_q = matched_count;
+void basic_snapshot_tests()
+{
+  order_engines engines;
+  engines.add_order_from_order_data({ 1, 1, "AB", 0.0f, 100, order_side::buy, order_type::market });
+  engines.add_order_from_order_data({ 2, 2, "AB", 10.0f, 30, order_side::sell, order_type::limit });
+  engines.add_order_from_order_data({ 3, 3, "AB", 9.0f, 20, order_side::buy, order_type::limit });
+  engines.add_order_from_order_data({ 4, 4, "XY", 5.0f, 20, order_side::sell, order_type::limit_ioc });
+  engines.add_order_from_order_data({ 5, 5, "XY", 5.0f, 10, order_side::sell, order_type::limit });
+  engines.match_all();
+  engines.add_order_from_order_data({ 6, 6, "XY", 6.0f, 10, order_side::sell, order_type::limit });
+
+  snapshot_writer w;
+  engines.save_snapshot(w, 42);
+  order_engines restored;
+  snapshot_reader r(w.get_data().data(), w.get_data().size());
+  auto sequence = restored.load_snapshot(r);
+  assert(sequence == 42);
+  assert(r.get_remaining() == 0);
+  assert(restored.get_stats().to_string() == engines.get_stats().to_string());
+
+  // both continue the same way
+  for (auto* eng : { &engines, &restored }) {
+    eng->add_order_from_order_data({ 7, 7, "AB", 10.0f, 100, order_side::sell, order_type::limit });
+    eng->amend_order_from_order_data({ 5, 8, "XY", 5.0f, 5, order_side::sell, order_type::limit });
+    eng->cancel_order(3);
+  }
+  auto fills = engines.match_all();
+  auto restored_fills = restored.match_all();
+  assert(!fills.empty());
+  assert(fills.size() == restored_fills.size());
+  for (size_t i = 0; i < fills.size(); ++i) {
+    assert(fills[i].to_string() == restored_fills[i].to_string());
+  }
 
-    return det;
+  snapshot_reader truncated(w.get_data().data(), w.get_data().size() - 1);
+  bool thrown = false;
+  try {
+    order_engines e;
+    e.load_snapshot(truncated);
   }
+  catch (const snapshot_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+
+  // an order type out of range in the bytes of a saved order
+  snapshot_order_record rec{};
+  bool found = false;
+  engines.for_each_queried(query_data("XY"), [&](const std::string&, const order_engine& eng) {
+    found = eng.find_record(6, rec);
+  });
+  assert(found);
+  std::string bad = w.get_data();
+  auto rec_bytes = reinterpret_cast<const char*>(&rec);
+  auto pos = bad.find(std::string(rec_bytes, sizeof(rec)));
+  assert(pos != std::string::npos);
+  bad[pos + offsetof(snapshot_order_record, m_order_type)] = 9;
+  snapshot_reader corrupt(bad.data(), bad.size());
+  thrown = false;
+  try {
+    order_engines e;
+    e.load_snapshot(corrupt);
+  }
+  catch (const snapshot_error&) {
+    thrown = true;
+  }
+  assert(thrown);
+}
 
-  template <class Q>
-  amend_result try_amend_order_in_market_queue(Q& q, const order_data& new_order_data) const
-  {
-    auto iter = q.find_order_iter(new_order_data.get_id());
-    if (iter == q.end()) {
-      return amend_result::not_found;
-    }
-    auto amend_typ = check_amend_type(iter->second.get_data(), new_order_data);
-    switch (amend_typ) {
-    case amend_type::invalid:
-      return amend_result::failed;
-    case amend_type::q:
-      iter->second.set_q(new_order_data.get_q());
+// runs a generated stream once through execute_batch and once command by command
+// and checks that acks, rejects, fills, expiries and the final books are the same
+void basic_batch_tests()
+{
+  const std::array<const char*, 3> symbols = { { "AA", "BB", "CC" } };
+  std::mt19937 gen(7);
+  std::vector<command> cmds;
+  // every book exists before it is matched on its own
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    cmds.push_back(parse_command("N," + std::to_string(1000 + i) + ",1," + symbols[i] + ",L,B,1.00,1"));
+  }
+  uint32_t time = 1;
+  for (uint64_t i = 0; i < 2000; ++i) {
+    std::string line;
+    auto id = std::to_string(1 + gen() % 300);
+    auto tim = std::to_string(time);
+    auto symb = symbols[gen() % symbols.size()];
+    auto price = std::to_string(100 + gen() % 5);
+    auto q = std::to_string(1 + gen() % 50);
+    // some orders expire a few timestamps later
+    auto expire = gen() % 3 == 0 ? std::to_string(time + gen() % 4) : std::string();
+    // the line has all of its optional fields already
+    bool complete = false;
+    switch (gen() % 12) {
+    case 0:
+      line = "M," + tim;
       break;
-    case amend_type::price:
-      iter->second.set_price(new_order_data.get_price());
+    case 1:
+      line = std::string("M,") + tim + "," + symb;
       break;
-    case amend_type::price_and_q:
-      iter->second.set_q(new_order_data.get_q());
-      iter->second.set_price(new_order_data.get_price());
+    case 2:
+      line = "X," + id + "," + tim;
       break;
-    }
-    return amend_result::ok;
-  }
-
-  template <class Q>
-  amend_result try_amend_order_in_limit_queue(Q& q, const order_data& new_order_data) const
-  {
-    auto iter = q.find_order_iter(new_order_data.get_id());
-    if (iter == q.end()) {
-      return amend_result::not_found;
-    }
-    auto amend_typ = check_amend_type(iter->second.get_data(), new_order_data);
-    order_data cur_data = iter->second.get_data();
-
-    switch (amend_typ) {
-    case amend_type::invalid:
-      return amend_result::failed;
-    case amend_type::q:
-    {
-      if (new_order_data.get_q() <= cur_data.get_matched_q()) {
-        q.cancel_order(cur_data.get_id());
-        return amend_result::executed;
+    case 3:
+      line = "A," + id + "," + tim + "," + symb + ",L,B," + price + "," + q;
+      break;
+    case 4:
+      line = "C," + tim + "," + symb + (gen() % 2 ? ",S" : ",B,101,103");
+      break;
+    case 5:
+      line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",S,B,0.00," : ",T,S," + price + ",") + q
+        + "," + expire + "," + std::to_string(100 + gen() % 5);
+      complete = true;
+      break;
+    case 6:
+      if (gen() % 2) {
+        line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",F,B," : ",F,S,") + price + "," + q;
       }
-      auto old_q = cur_data.get_q();
-      cur_data.set_q(new_order_data.get_q() - cur_data.get_matched_q());
-      if (cur_data.get_q() > old_q) {
-        cur_data.set_time(new_order_data.get_time());
+      else {
+        line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",L,B," : ",I,S,") + price + "," + q
+          + "," + expire + ",," + std::to_string(1 + gen() % std::stoull(q));
+        complete = true;
       }
       break;
-    }
-    case amend_type::price:
-      cur_data.set_price(new_order_data.get_price());
-      cur_data.set_time(new_order_data.get_time());
+    case 7:
+      line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",L,B," : ",L,S,") + price + "," + q
+        + "," + expire + ",,," + std::to_string(1 + gen() % 10);
+      complete = true;
       break;
-    case amend_type::price_and_q:
-      if (new_order_data.get_q() <= cur_data.get_matched_q()) {
-        q.cancel_order(cur_data.get_id());
-        return amend_result::executed;
-      }
-      cur_data.set_q(new_order_data.get_q() - cur_data.get_matched_q());
-      cur_data.set_price(new_order_data.get_price());
-      cur_data.set_time(new_order_data.get_time());
+    default:
+      line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",L,B," : ",L,S,") + price + "," + q;
       break;
-    };
-    //cur_data.set_time(new_order_data.get_time());
-    // remove the order
-    q.cancel_order(cur_data.get_id());
-    // put it again
-    q.put_order(cur_data);
-    return amend_result::ok;
+    }
+    if ((line[0] == 'N' || line[0] == 'A') && !complete && !expire.empty()) {
+      line += "," + expire;
+    }
+    cmds.push_back(parse_command(line));
+    time += gen() % 2;
   }
 
-  enum class amend_type {
-      invalid
-    , q
-    , price
-    , price_and_q
-  };
-  amend_type check_amend_type(const order_data& old_data, const order_data& new_data) const
-  {
-    if (new_data.get_order_type() == order_type::market) {
-      if (new_data.get_price() != 0.0) {
-        return amend_type::invalid;
+  order_engines batch_engines;
+  std::vector<command_result> results(cmds.size());
+  std::vector<matched_result_detail> fills;
+  std::vector<uint64_t> batch_expired;
+  batch_engines.execute_batch(cmds.data(), cmds.size(), results.data(), fills, batch_expired);
+
+  order_engines engines;
+  std::vector<uint64_t> expired;
+  for (size_t i = 0; i < cmds.size(); ++i) {
+    const auto& cmd = cmds[i];
+    const auto& res = results[i];
+    expired.clear();
+    engines.expire_orders(command_time(cmd), expired);
+    assert(expired.size() == res.m_expired_count);
+    assert(std::equal(expired.begin(), expired.end(), batch_expired.begin() + res.m_expired_begin));
+    try {
+      switch (cmd.m_type) {
+      case command_type::new_order:
+        engines.add_order_from_order_data(cmd.m_order);
+        assert(res.m_kind == output_kind::accept);
+        break;
+      case command_type::amend_order:
+        engines.amend_order_from_order_data(cmd.m_order);
+        assert(res.m_kind == output_kind::amend_accept);
+        break;
+      case command_type::cancel_order:
+        engines.cancel_order(cmd.m_cancel.m_id);
+        assert(res.m_kind == output_kind::cancel_accept);
+        break;
+      case command_type::mass_cancel:
+        assert(res.m_kind == output_kind::mass_cancel_accept);
+        assert(res.m_id == engines.mass_cancel(cmd.m_mass_cancel, nullptr));
+        break;
+      case command_type::match:
+      {
+        auto cur = cmd.m_match.m_symb.empty() ? engines.match_all() : engines.match_one(cmd.m_match.m_symb);
+        assert(res.m_kind == output_kind::fill);
+        assert(cur.size() == res.m_fill_count);
+        for (size_t f = 0; f < cur.size(); ++f) {
+          assert(cur[f].to_string() == fills[res.m_fill_begin + f].to_string());
+        }
+        break;
       }
-    }
-    if (old_data.get_id() != new_data.get_id()) {
-      return amend_type::invalid;
-    }
-    if (old_data.get_order_side() != new_data.get_order_side()) {
-      return amend_type::invalid;
-    }
-    if (old_data.get_order_type() != new_data.get_order_type()) {
-      return amend_type::invalid;
-    }
-    if (old_data.get_price() != new_data.get_price()) {
-      if (old_data.get_q() != new_data.get_q()) {
-        return amend_type::price_and_q;
+      default:
+        break;
       }
-      return amend_type::price;
     }
-    if (old_data.get_q() != new_data.get_q()) {
-      return amend_type::q;
+    catch (const parse_error& err) {
+      assert(res.m_kind == output_kind::reject);
+      assert(res.m_reason == err.get_reason());
     }
-    return amend_type::invalid;
   }
-  bool id_exists(uint64_t id) const
-  {
-    // check all queues for the id
-    if (m_limit_buy_queue.id_exists(id)) {
-      return true;
+
+  depth_buffer buf1(1000);
+  depth_buffer buf2(1000);
+  engines.for_each_queried(query_data(), [&](const std::string& symb, const order_engine& eng) {
+    query_data q(symb);
+    batch_engines.for_each_queried(q, [&](const std::string&, const order_engine& batch_eng) {
+      auto count = buf1.read_depth(eng);
+      auto batch_count = buf2.read_depth(batch_eng);
+      assert(count == batch_count);
+      for (size_t i = 0; i < count; ++i) {
+        assert(buf1.get_depth_row(i).m_buy.m_id == buf2.get_depth_row(i).m_buy.m_id);
+        assert(buf1.get_depth_row(i).m_sell.m_q == buf2.get_depth_row(i).m_sell.m_q);
+      }
+    });
+  });
+  assert(engines.get_stats().m_total.to_string() == batch_engines.get_stats().m_total.to_string());
+  assert(!batch_expired.empty());
+  assert(engines.get_stats().m_total.m_stops_triggered > 0);
+  assert(engines.get_stats().m_total.m_min_q_killed > 0);
+  assert(engines.get_stats().m_total.m_replenished > 0);
+  // a symbol without a book answers nothing
+  engines.for_each_queried(query_data("ZZ"), [](const std::string&, const order_engine&) {
+    assert(false);
+  });
+}
+
+// the same input through processors of every engine policy prints the same,
+// except that without a history historical queries print nothing
+void basic_policy_tests()
+{
+  const std::array<const char*, 3> symbols = { { "AA", "BB", "CC" } };
+  std::mt19937 gen(9);
+  std::string input;
+  std::string current_input;
+  for (uint32_t time = 1; time <= 400; ++time) {
+    auto id = std::to_string(1 + gen() % 150);
+    auto tim = std::to_string(time);
+    auto symb = symbols[gen() % symbols.size()];
+    auto price = std::to_string(100 + gen() % 3) + "." + std::to_string(10 + gen() % 90);
+    auto q = std::to_string(1 + gen() % 50);
+    std::string line;
+    switch (gen() % 11) {
+    case 0:
+      line = "M," + tim;
+      break;
+    case 1:
+      line = "X," + id + "," + tim;
+      break;
+    case 2:
+      line = "A," + id + "," + tim + "," + symb + ",L,S," + price + "," + q;
+      break;
+    case 3:
+      line = "N," + id + "," + tim + "," + symb + ",M,B,0.00," + q;
+      break;
+    case 4:
+      line = "N," + id + "," + tim + "," + symb + ",I,S," + price + "," + q;
+      break;
+    case 6:
+      line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",S,S,0.00," : ",T,B," + price + ",") + q + ",,"
+        + std::to_string(100 + gen() % 3) + ".50";
+      break;
+    case 7:
+      line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",F,S," + price + "," + q
+        : ",L,B," + price + "," + q + ",,," + std::to_string(1 + gen() % std::stoull(q)));
+      break;
+    case 8:
+      line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",L,B," : ",L,S,") + price + "," + q
+        + ",,,," + std::to_string(1 + gen() % 10);
+      break;
+    case 5:
+      if (gen() % 4 == 0) {
+        line = "C," + tim + "," + symb + (gen() % 2 ? ",B" : "");
+      }
+      else {
+        line = "C," + tim + "," + symb + (gen() % 2 ? ",B,101.00," : ",S,100.50,") + price;
+      }
+      break;
+    default:
+      line = "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",L,B," : ",L,S,") + price + "," + q;
+      break;
     }
-    if (m_limit_sell_queue.id_exists(id)) {
-      return true;
+    input += line + '\n';
+    current_input += line + '\n';
+    if (time % 50 == 0) {
+      input += "Q\nL\nQ," + std::to_string(time - 25) + '\n';
+      current_input += "Q\nL\n";
     }
+  }
+  auto run = [](auto&& processor, const std::string& text) {
+    std::istringstream in(text);
+    std::ostringstream out;
+    stream_sink sink(out);
+    run_serial(processor, in, sink, nullptr);
+    return out.str();
+  };
+  auto expected = run(command_processor(5), input);
+  assert(run(basic_command_processor<tick_engine_policy>(5), input) == expected);
+  assert(run(basic_command_processor<map_engine_policy>(5), input) == expected);
+  assert(run(basic_command_processor<std_hash_engine_policy>(5), input) == expected);
+  assert(run(basic_command_processor<no_history_policy<tick_engine_policy>>(5), input)
+    == run(command_processor(5), current_input));
+}
 
-    if (m_market_order_buy_cont.id_exists(id)) {
-      return true;
+// historical queries answered from deltas against the same queries answered
+// from full copies, with chunks of a few events up to a single chunk, from
+// chunks spilled to a file, on reader threads, and by a prescan replay which
+// keeps only the queried states
+void basic_history_tests()
+{
+  const std::array<const char*, 3> symbols = { { "AA", "BB", "CC" } };
+  std::mt19937 gen(11);
+  // every book exists from the first time on, the queries may name any of them
+  std::string input = "N,1001,1,AA,L,B,1.00,1\nN,1002,1,BB,L,B,1.00,1\nN,1003,1,CC,L,B,1.00,1\n";
+  uint32_t time = 1;
+  for (int i = 0; i < 3000; ++i) {
+    auto id = std::to_string(1 + gen() % 200);
+    auto tim = std::to_string(time);
+    auto symb = symbols[gen() % symbols.size()];
+    auto price = std::to_string(100 + gen() % 3) + "." + std::to_string(10 + gen() % 90);
+    auto q = std::to_string(1 + gen() % 50);
+    switch (gen() % 13) {
+    case 0:
+      input += "M," + tim + '\n';
+      break;
+    case 1:
+      input += "X," + id + "," + tim + '\n';
+      break;
+    case 2:
+      input += "A," + id + "," + tim + "," + symb + ",L,B," + price + "," + q + '\n';
+      break;
+    case 3:
+      input += "N," + id + "," + tim + "," + symb + ",M,S,0.00," + q + '\n';
+      break;
+    case 4:
+      input += "N," + id + "," + tim + "," + symb + ",I,B," + price + "," + q + '\n';
+      break;
+    case 5:
+      input += "C," + tim + "," + symb + ",S," + price + ",101.50\n";
+      break;
+    case 7:
+      input += "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",S,B,0.00," : ",T,S," + price + ",") + q + ",,"
+        + std::to_string(100 + gen() % 3) + ".50\n";
+      break;
+    case 8:
+      input += "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",F,B," + price + "," + q
+        : ",L,S," + price + "," + q + ",,," + std::to_string(1 + gen() % std::stoull(q))) + '\n';
+      break;
+    case 9:
+      input += "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",L,B," : ",L,S,") + price + "," + q
+        + ",,,," + std::to_string(1 + gen() % 10) + '\n';
+      break;
+    case 6:
+    {
+      // past times in any order, so the decoded state is reused and rebuilt,
+      // and a few times which are not reached yet
+      auto past = std::to_string(1 + gen() % (time + 2));
+      input += (gen() % 2 ? "Q," : "L,") + past + (gen() % 2 ? std::string() : std::string(",") + symb) + '\n';
+      break;
     }
-    if (m_market_order_sell_cont.id_exists(id)) {
-      return true;
+    default:
+      input += "N," + id + "," + tim + "," + symb + (gen() % 2 ? ",L,B," : ",L,S,") + price + "," + q + '\n';
+      break;
     }
-    return false;
+    time += gen() % 3 == 0 ? 1 : 0;
   }
-  
-  bool put_order_sell_market(const order_data& d)
-  {
-    auto ret = m_market_order_sell_cont.put_order(d);
-    return ret;
+  auto run = [&](auto&& processor) {
+    std::istringstream in(input);
+    std::ostringstream out;
+    stream_sink sink(out);
+    run_serial(processor, in, sink, nullptr);
+    return out.str();
+  };
+  auto expected = run(basic_command_processor<snapshot_history_policy<default_engine_policy>>(5));
+  for (uint64_t interval : { 1, 7, 64, 1000000 }) {
+    command_processor processor(5);
+    processor.get_history().set_key_interval(interval);
+    assert(run(processor) == expected);
   }
-  bool put_order_sell_limit(const order_data& d)
-  {
-    auto ret = m_limit_sell_queue.put_order(limit_order_sell(d));
-    return ret;
+  basic_command_processor<tick_engine_policy> tick_processor(5);
+  tick_processor.get_history().set_key_interval(16);
+  assert(run(tick_processor) == expected);
+  // every closed chunk in the spill file, and a budget keeping some of them
+  for (uint64_t budget : { 0, 4096 }) {
+    command_processor spill_processor(5);
+    spill_processor.get_history().set_key_interval(7);
+    spill_processor.get_history().set_spill("basic_history_tests.spill", budget);
+    assert(run(spill_processor) == expected);
+    assert(spill_processor.get_history().get_spilled_bytes() > 0);
   }
-  bool put_order_sell_limit_ioc(const order_data& d)
-  {
-    auto ret = m_limit_sell_queue.put_order(limit_order_sell(d, true));
-    return ret;
+  // closed chunks decoded by reader threads, in memory and spilled
+  for (uint64_t budget : { UINT64_MAX, uint64_t(0) }) {
+    query_pool<command_processor::history_type> pool(3, 5);
+    command_processor pool_processor(5);
+    pool_processor.get_history().set_key_interval(7);
+    pool_processor.get_history().set_spill("basic_history_tests.spill", budget);
+    pool_processor.set_query_pool(&pool);
+    assert(run(pool_processor) == expected);
   }
-  bool put_order_buy_market(const order_data& d)
-  {
-    auto ret = m_market_order_buy_cont.put_order(d);
-    return ret;
+  // states kept and released by a prescan, and the history recorded instead when
+  // the states would take more than a byte per command
+  for (uint64_t event_bytes : { UINT64_MAX, uint64_t(1) }) {
+    command_processor prescan_processor(5);
+    std::istringstream in(input);
+    std::ostringstream out;
+    stream_sink sink(out);
+    run_prescan(prescan_processor, in, sink, event_bytes);
+    assert(out.str() == expected);
+    assert((prescan_processor.get_history().size() == 0) == (event_bytes == UINT64_MAX));
   }
-  bool put_order_buy_limit(const order_data& d)
+}
+
+// a processor fed one input line at a time for the order type tests
+struct order_test_processor
+{
+  command_processor m_processor{ 5 };
+  std::vector<output_record> m_records;
+
+  // the output of line as it would be written
+  std::string run(const std::string& line)
   {
-    auto ret = m_limit_buy_queue.put_order(limit_order_buy(d));
-    return ret;
+    m_records.clear();
+    m_processor.execute(parse_command(line), m_records);
+    std::ostringstream out;
+    for (const auto& rec : m_records) {
+      write_record(rec, out);
+    }
+    return out.str();
   }
-  bool put_order_buy_limit_ioc(const order_data& d)
+  // the engines loaded from a snapshot of the processor, which agree on the totals
+  order_engines restore_snapshot()
   {
-    auto ret = m_limit_buy_queue.put_order(limit_order_buy(d, true));
-    return ret;
+    snapshot_writer w;
+    m_processor.get_engines().save_snapshot(w, 0);
+    order_engines restored;
+    snapshot_reader r(w.get_data().data(), w.get_data().size());
+    restored.load_snapshot(r);
+    assert(restored.get_stats().m_total.to_string() == m_processor.get_engines().get_stats().m_total.to_string());
+    return restored;
   }
-  void init_put_func()
-  {
-    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::limit)) = [this](const auto& od) {return put_order_buy_limit(od); };
-    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::market)) = [this](const auto& od) {return put_order_buy_market(od); };
-    m_put_func.at(to_underlying(order_side::buy)).at(to_underlying(order_type::limit_ioc)) = [this](const auto& od) {return put_order_buy_limit_ioc(od); };
+};
 
-    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::limit)) = [this](const auto& od) {return put_order_sell_limit(od); };
-    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::market)) = [this](const auto& od) {return put_order_sell_market(od); };
-    m_put_func.at(to_underlying(order_side::sell)).at(to_underlying(order_type::limit_ioc)) = [this](const auto& od) {return put_order_sell_limit_ioc(od); };
+// the timing wheel against a sorted list of the same entries with small steps and
+// jumps across every level, then good till time orders through the processor
+void basic_expiry_tests()
+{
+  std::mt19937 gen(17);
+  timing_wheel wheel;
+  std::multimap<uint32_t, uint64_t> expected;
+  std::vector<timing_wheel::entry> due;
+  uint32_t now = 0;
+  for (uint64_t id = 0; id < 20000; ++id) {
+    const std::array<uint32_t, 4> spans = { { 4, 300, 70000, 20000000 } };
+    uint64_t time = static_cast<uint64_t>(now) + 1 + gen() % spans[gen() % spans.size()];
+    if (time <= UINT32_MAX) {
+      wheel.insert(static_cast<uint32_t>(time), id);
+      expected.emplace(static_cast<uint32_t>(time), id);
+    }
+    if (gen() % 4 == 0) {
+      now = static_cast<uint32_t>(std::min<uint64_t>(UINT32_MAX, static_cast<uint64_t>(now) + gen() % spans[gen() % spans.size()]));
+      due.clear();
+      wheel.advance(now, due);
+      std::vector<timing_wheel::entry> ref;
+      while (!expected.empty() && expected.begin()->first <= now) {
+        ref.push_back(*expected.begin());
+        expected.erase(expected.begin());
+      }
+      std::sort(ref.begin(), ref.end());
+      assert(due == ref);
+      assert(wheel.get_time() == now);
+      assert(wheel.size() == expected.size());
+      assert(expected.empty() || wheel.next_due() <= expected.begin()->first);
+    }
   }
-  limit_order_buy_queue m_limit_buy_queue;
-  limit_order_sell_queue m_limit_sell_queue;
 
-  market_order_buy_cont m_market_order_buy_cont;
-  market_order_sell_cont m_market_order_sell_cont;
+  order_test_processor t;
+  assert(t.run("N,1,1,AB,L,B,10.00,100,5") == "1 - Accept\n");
+  assert(t.run("N,2,1,AB,L,B,10.00,100,3") == "2 - Accept\n");
+  assert(t.run("N,3,2,AB,L,S,11.00,100,3") == "3 - Accept\n");
+  // an expiry has to be later than the order
+  assert(t.run("N,4,2,AB,L,S,11.00,100,2") == "4 - Reject - 303 - Invalid order details\n");
+  // an amend still has to change the price or quantity, its expiry replaces the
+  // one of the order
+  assert(t.run("A,2,2,AB,L,B,10.00,100,6") == "2 - AmendReject - 101 - Invalid amendment details\n");
+  assert(t.run("A,2,2,AB,L,B,10.00,90,6") == "2 - AmendAccept\n");
+  // a cancel moves the clock as well, expiries come by time and id
+  assert(t.run("X,1,3") == "3 - Expired\n1 - CancelAccept\n");
+  assert(t.run("N,5,4,AB,L,B,9.00,10") == "5 - Accept\n");
+  assert(t.run("M,9") == "2 - Expired\n");
+  assert(t.run("X,2,9") == "2 - CancelReject - 404 - Order does not exist\n");
+  auto st = t.m_processor.get_engines().get_stats();
+  assert(st.m_total.get_resting_orders() == 1);
+  // historical queries see the books before and after the expiries
+  assert(t.run("Q,2,AB").find("|11.00,100,L,3") != std::string::npos);
+  assert(t.run("Q,9,AB").find("|11.00,100,L,3") == std::string::npos);
+  // the expiries and the clock survive a snapshot
+  assert(t.run("N,6,10,AB,L,S,12.00,10,20") == "6 - Accept\n");
+  auto restored = t.restore_snapshot();
+  std::vector<uint64_t> ids;
+  restored.expire_orders(19, ids);
+  assert(ids.empty());
+  restored.expire_orders(25, ids);
+  assert(ids.size() == 1 && ids[0] == 6);
+}
 
-  std::array<std::array<std::function<bool(const order_data&)>, 3>, 2> m_put_func;
-};
+// stop and stop limit orders through the processor: a trade releasing a stop
+// which trades in the same match, stops triggered on entry, cancels and amends
+// of pending stops and the trigger index in a snapshot
+void basic_stop_tests()
+{
+  order_test_processor t;
+  // a stop price is required for stop orders and refused for the others
+  assert(t.run("N,9,1,AB,S,B,0.00,10") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,9,1,AB,L,B,10.00,10,,9.00") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,9,1,AB,T,B,10.00,10,,0") == "9 - Reject - 303 - Invalid order details\n");
+  // nothing traded yet, so no stop triggers
+  assert(t.run("N,1,1,AB,L,S,10.00,100") == "1 - Accept\n");
+  assert(t.run("N,2,1,AB,S,B,0.00,50,,10.00") == "2 - Accept\n");
+  assert(t.run("N,3,1,AB,L,S,10.50,50") == "3 - Accept\n");
+  assert(t.run("N,4,1,AB,S,B,0.00,30,,10.50") == "4 - Accept\n");
+  assert(t.run("N,5,1,AB,T,S,9.00,20,,9.50") == "5 - Accept\n");
+  assert(t.run("N,6,1,AB,L,B,10.50,60") == "6 - Accept\n");
+  // pending stops are not in the book
+  assert(t.run("Q,AB") == "AB|6,L,60,10.50|10.00,100,L,1\nAB||10.50,50,L,3\n");
+  auto st = t.m_processor.get_engines().get_stats().m_total;
+  assert(st.m_buy_stop_orders == 2 && st.m_sell_stop_orders == 1 && st.m_stops_triggered == 0);
+  // the trade at 10.00 releases stop 2, which buys the rest of order 1 and then
+  // from order 3; that last trade at 10.50 releases stop 4 in the same match
+  assert(t.run("M,2") ==
+    "AB|6,L,60,10.00|10.00,60,L,1\n"
+    "AB|2,M,40,10.00|10.00,40,L,1\n"
+    "AB|2,M,10,10.50|10.50,10,L,3\n"
+    "AB|4,M,30,10.50|10.50,30,L,3\n");
+  st = t.m_processor.get_engines().get_stats().m_total;
+  assert(st.m_buy_stop_orders == 0 && st.m_sell_stop_orders == 1 && st.m_stops_triggered == 2);
+  // the last trade is above 10.00 already, this stop enters the book at once
+  assert(t.run("N,7,3,AB,T,B,10.60,5,,10.00") == "7 - Accept\n");
+  assert(t.run("Q,AB") == "AB|7,L,5,10.60|10.50,10,L,3\n");
+  // a pending stop is cancelled, not amended
+  assert(t.run("A,5,3,AB,T,S,9.00,10,,9.50") == "5 - AmendReject - 101 - Invalid amendment details\n");
+  // the trigger index and the last price survive a snapshot
+  auto restored = t.restore_snapshot();
+  restored.add_order_from_order_data({ 8, 4, "AB", 9.50f, 20, order_side::buy, order_type::limit });
+  restored.add_order_from_order_data({ 9, 4, "AB", 9.50f, 5, order_side::sell, order_type::limit });
+  // 7 buys from 9 at 9.50, which releases the sell stop limit; it sells to 8 at 9.00
+  auto fills = restored.match_all();
+  assert(fills.size() == 2 && fills[1].to_string() == "AB|8,L,20,9.00|9.00,20,L,5");
+  auto rst = restored.get_stats().m_total;
+  assert(rst.m_sell_stop_orders == 0 && rst.m_stops_triggered == 4 && rst.m_sell_orders == 1 && rst.m_buy_orders == 0);
+  assert(t.run("X,5,4") == "5 - CancelAccept\n");
+  assert(t.m_processor.get_engines().get_stats().m_total.m_sell_stop_orders == 0);
+}
 
-class parse_error
+// fill or kill and minimum quantity orders through the processor: orders short
+// of their minimum leave the book untraded, the minimum ends with the first trade
+// and a pending one survives a snapshot
+void basic_fok_tests()
 {
-public:
-  virtual std::string get_msg() const = 0;
-};
+  order_test_processor t;
+  // a minimum from 1 to the quantity, for limit and ioc orders only
+  assert(t.run("N,9,1,AB,F,B,10.00,10,,,5") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,9,1,AB,M,B,0.00,10,,,5") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,9,1,AB,L,B,10.00,10,,,11") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,9,1,AB,I,B,10.00,10,,,0") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,1,1,AB,L,S,10.00,30") == "1 - Accept\n");
+  assert(t.run("N,2,1,AB,L,S,10.50,30") == "2 - Accept\n");
+  // only 30 are offered at 10.20 or less, the whole order goes
+  assert(t.run("N,3,1,AB,F,B,10.20,40") == "3 - Accept\n");
+  assert(t.run("M,1") == "");
+  assert(t.m_processor.get_engines().get_stats().m_total.m_min_q_killed == 1);
+  assert(t.run("N,4,2,AB,F,B,10.50,50") == "4 - Accept\n");
+  assert(t.run("M,2") == "AB|4,F,30,10.00|10.00,30,L,1\nAB|4,F,20,10.50|10.50,20,L,2\n");
+  // a resting order waits for a cross and is killed at the first one short of its minimum
+  assert(t.run("N,5,3,AB,L,B,10.40,20,,,5") == "5 - Accept\n");
+  assert(t.run("M,3") == "");
+  assert(t.run("N,6,3,AB,L,S,10.40,3") == "6 - Accept\n");
+  assert(t.run("M,3") == "");
+  assert(t.m_processor.get_engines().get_stats().m_total.m_min_q_killed == 2);
+  assert(t.run("Q,AB") == "AB||10.40,3,L,6\nAB||10.50,10,L,2\n");
+  // enough for the minimum, the rest keeps resting without one
+  assert(t.run("N,7,4,AB,L,B,10.40,20,,,3") == "7 - Accept\n");
+  assert(t.run("M,4") == "AB|7,L,3,10.40|10.40,3,L,6\n");
+  assert(t.run("A,7,4,AB,L,B,10.40,10") == "7 - AmendAccept\n");
+  assert(t.run("A,7,4,AB,L,B,10.40,10,,,5") == "7 - AmendReject - 101 - Invalid amendment details\n");
+  // a pending minimum survives a snapshot
+  assert(t.run("N,8,5,AB,L,S,11.00,10,,,10") == "8 - Accept\n");
+  auto restored = t.restore_snapshot();
+  // 9 buys the rest of 2 and has 5 left for 8, which needs 10
+  restored.add_order_from_order_data({ 9, 6, "AB", 11.00f, 15, order_side::buy, order_type::limit });
+  auto fills = restored.match_all();
+  assert(fills.size() == 1 && fills[0].to_string() == "AB|9,L,10,10.50|10.50,10,L,2");
+  auto rst = restored.get_stats().m_total;
+  assert(rst.m_min_q_killed == 3 && rst.m_sell_orders == 0 && rst.m_buy_orders == 2);
+}
 
-class dummy_parse_error : public parse_error
+// iceberg orders through the processor: only the shown slice is in the book and
+// in the views, a traded slice is replaced from the reserve behind the orders
+// of its level, and the reserve survives amends and snapshots
+void basic_iceberg_tests()
 {
-public:
-  std::string get_msg() const override
-  {
-    assert(false);
-    return std::string("");
+  order_test_processor t;
+  // a peak from 1 to the quantity, for limit orders without a minimum
+  assert(t.run("N,9,1,AB,I,S,10.00,10,,,,5") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,9,1,AB,L,S,10.00,10,,,,11") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,9,1,AB,L,S,10.00,10,,,2,5") == "9 - Reject - 303 - Invalid order details\n");
+  assert(t.run("N,1,1,AB,L,S,10.00,50,,,,20") == "1 - Accept\n");
+  assert(t.run("N,2,1,AB,L,S,10.00,15") == "2 - Accept\n");
+  assert(t.run("Q,AB") == "AB||10.00,20,L,1\nAB||10.00,15,L,2\n");
+  // the first slice of 1 trades, the next one waits behind 2
+  assert(t.run("N,3,2,AB,L,B,10.00,30") == "3 - Accept\n");
+  assert(t.run("M,2") == "AB|3,L,20,10.00|10.00,20,L,1\nAB|3,L,10,10.00|10.00,10,L,2\n");
+  assert(t.run("Q,AB") == "AB||10.00,5,L,2\nAB||10.00,20,L,1\n");
+  assert(t.m_processor.get_engines().get_stats().m_total.m_replenished == 1);
+  // the last slice is what is left of the reserve
+  assert(t.run("N,4,3,AB,M,B,0.00,35") == "4 - Accept\n");
+  assert(t.run("M,3") ==
+    "AB|4,M,5,10.00|10.00,5,L,2\n"
+    "AB|4,M,20,10.00|10.00,20,L,1\n"
+    "AB|4,M,10,10.00|10.00,10,L,1\n");
+  assert(t.run("Q,AB") == "");
+  assert(t.m_processor.get_engines().get_stats().m_total.m_replenished == 2);
+  // an amended iceberg is sliced again and goes behind its level
+  assert(t.run("N,5,4,AB,L,B,9.00,30,,,,10") == "5 - Accept\n");
+  assert(t.run("N,6,4,AB,L,B,9.00,10") == "6 - Accept\n");
+  assert(t.run("A,5,4,AB,L,B,9.00,20") == "5 - AmendAccept\n");
+  assert(t.run("A,5,4,AB,L,B,9.00,20,,,,5") == "5 - AmendReject - 101 - Invalid amendment details\n");
+  assert(t.run("Q,AB") == "AB|6,L,10,9.00|\nAB|5,L,10,9.00|\n");
+  // the reserve survives a snapshot
+  auto restored = t.restore_snapshot();
+  restored.add_order_from_order_data({ 7, 5, "AB", 9.00f, 25, order_side::sell, order_type::limit });
+  auto fills = restored.match_all();
+  assert(fills.size() == 3 && fills[2].to_string() == "AB|5,L,5,9.00|9.00,5,L,7");
+  auto rst = restored.get_stats().m_total;
+  assert(rst.m_replenished == 3 && rst.m_buy_orders == 1 && rst.m_sell_orders == 0);
+  // the reserve counts towards what a fill or kill order can trade and what an auction executes
+  assert(t.run("N,11,6,CD,L,S,10.00,100,,,,10") == "11 - Accept\n");
+  assert(t.run("N,12,6,CD,F,B,10.00,50") == "12 - Accept\n");
+  std::string fok_fills;
+  std::string auction_fills;
+  for (int i = 0; i < 5; ++i) {
+    fok_fills += "CD|12,F,10,10.00|10.00,10,L,11\n";
+    auction_fills += "CD|13,L,10,10.00|10.00,10,L,11\n";
   }
-};
+  assert(t.run("M,6,CD") == fok_fills);
+  t.m_processor.get_engines().set_auction(true);
+  assert(t.run("N,13,7,CD,L,B,10.00,60") == "13 - Accept\n");
+  assert(t.run("M,7,CD") == auction_fills);
+  assert(t.run("Q,CD") == "CD|13,L,10,10.00|\n");
+}
 
-class new_parse_error : public parse_error
+// mass cancels through the command processor, whole books, sides and price ranges
+void basic_mass_cancel_tests()
 {
-public:
-  new_parse_error(uint64_t order_id)
-    :m_order_id(order_id)
-  {
-
-  }
-  std::string get_msg() const override
-  {
-    std::string msg;
-    msg += std::to_string(m_order_id);
-    msg += " - Reject - 303 - Invalid order details";
-    return msg;
+  auto run = [](auto&& processor, const std::string& text) {
+    processor.set_report_cancelled(true);
+    std::istringstream in(text);
+    std::ostringstream out;
+    stream_sink sink(out);
+    run_serial(processor, in, sink, nullptr);
+    return out.str();
+  };
+  const std::string input =
+    "N,1,1,AB,L,B,10.00,100\n"
+    "N,2,1,AB,I,B,9.90,100\n"
+    "N,3,1,AB,L,B,9.80,100\n"
+    "N,4,1,AB,M,B,0.00,100\n"
+    "N,5,1,AB,L,S,10.50,100\n"
+    "N,6,1,AB,L,S,10.60,100\n"
+    "N,7,1,XY,L,S,5.00,100\n"
+    "N,8,1,AB,L,B,9.90,50\n"
+    "C,2,AB,B,9.95,9.85\n"
+    "C,2,AB,B,9.85,9.95\n"
+    "C,2,AB,S\n"
+    "C,2,ZZ\n"
+    "X,2,2\n"
+    "L,AB\n"
+    "C,3,AB\n"
+    "N,9,3,AB,L,B,10.00,10\n"
+    "L\n";
+  const std::string expected =
+    "1 - Accept\n2 - Accept\n3 - Accept\n4 - Accept\n5 - Accept\n6 - Accept\n7 - Accept\n8 - Accept\n"
+    "MassCancelReject - 303 - Invalid mass cancel details\n"
+    "AB - MassCancelAccept - 2\n2 - CancelAccept\n8 - CancelAccept\n"
+    "AB - MassCancelAccept - 2\n5 - CancelAccept\n6 - CancelAccept\n"
+    "ZZ - MassCancelAccept - 0\n"
+    "2 - CancelReject - 404 - Order does not exist\n";
+  auto out = run(command_processor(5), input);
+  assert(out.compare(0, expected.size(), expected) == 0);
+  // the books are the same with the tick bitmap
+  assert(run(basic_command_processor<tick_engine_policy>(5), input) == out);
+  auto whole = out.find("AB - MassCancelAccept - 3\n1 - CancelAccept\n3 - CancelAccept\n4 - CancelAccept\n");
+  assert(whole != std::string::npos);
+  assert(out.find("9 - Accept\n", whole) != std::string::npos);
+
+  command_processor processor(5);
+  std::vector<output_record> recs;
+  for (const char* line : { "N,1,1,AB,L,B,10.00,100", "N,2,1,AB,L,S,11.00,100", "C,2,AB" }) {
+    processor.execute(parse_command(line), recs);
   }
-private:
-  uint64_t m_order_id;
-};
+  // without the report only the summary is written
+  assert(recs.size() == 3 && recs.back().m_kind == output_kind::mass_cancel_accept && recs.back().m_id == 2);
+  auto st = processor.get_engines().get_stats();
+  assert(st.m_total.get_resting_orders() == 0 && st.m_total.m_buy_levels == 0 && st.m_total.m_sell_levels == 0);
+  // as after single cancels the ids can be used again
+  recs.clear();
+  processor.execute(parse_command("N,1,2,AB,L,B,10.00,100"), recs);
+  assert(recs.size() == 1 && recs[0].m_kind == output_kind::accept);
+  assert(processor.get_engines().get_stats().m_total.m_buy_levels == 1);
+}
 
-class amend_not_found_error : public parse_error
+// logs a stream, replays it into a fresh processor and checks both end in the
+// same state, also after a torn record is appended to the log
+void basic_log_tests()
 {
-public:
-  amend_not_found_error(uint64_t order_id)
-    :m_order_id(order_id)
+  const std::string path = "basic_log_tests.log";
+  std::remove(path.c_str());
+  const std::array<const char*, 9> lines = { {
+      "N,1,1,AB,L,B,10.00,100"
+    , "N,2,2,AB,L,S,11.00,50"
+    , "N,2,3,AB,L,S,11.00,50"
+    , "A,1,4,AB,L,B,11.00,80"
+    , "Q"
+    , "M,5"
+    , "N,3,6,XY,L,S,5.00,20,7"
+    , "X,2,7"
+    , "C,7,AB,B,9.00,12.00"
+  } };
+  command_processor processor(5);
+  std::vector<output_record> records;
   {
+    command_log log(path, durability::fsync_batch, 3);
+    for (auto line : lines) {
+      auto cmd = parse_command(line);
+      processor.execute(cmd, records);
+      log.append(cmd, processor.get_sequence());
+      if (log.is_group_full()) {
+        log.commit();
+      }
+    }
+    log.commit();
+    assert(log.get_commits() == 3);
+  }
 
+  command_processor recovered(5);
+  auto replayed = command_log::replay(path, recovered);
+  assert(replayed == 8);
+  assert(recovered.get_sequence() == processor.get_sequence());
+  std::ostringstream expected;
+  std::ostringstream actual;
+  processor.dump_stats(std::string(), expected);
+  recovered.dump_stats(std::string(), actual);
+  assert(expected.str() == actual.str());
+
+  auto read_log = [&]() {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  };
+  auto durable = read_log();
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::app);
+    out.write("\x10\x00\x00\x00torn", 8);
   }
-  std::string get_msg() const override
+  command_processor torn(5);
+  replayed = command_log::replay(path, torn);
+  assert(replayed == 8);
+  // the repair only cuts the torn tail, the committed records stay as they were
+  assert(read_log() == durable);
   {
-    std::string msg;
-    msg += std::to_string(m_order_id);
-    msg += " - AmendReject - 404 - Order does not exist";
-    return msg;
+    command_log log(path, durability::buffered, 1);
+    auto cmd = parse_command("X,1,8");
+    torn.execute(cmd, records);
+    log.append(cmd, torn.get_sequence());
   }
-private:
-  uint64_t m_order_id;
-};
-
-class amend_parse_error : public parse_error
-{
-public:
-  amend_parse_error(uint64_t order_id)
-    :m_order_id(order_id)
+  command_processor appended(5);
+  replayed = command_log::replay(path, appended);
+  assert(replayed == 9);
+  // records already reflected by the processor are skipped
+  replayed = command_log::replay(path, appended);
+  assert(replayed == 0);
+  std::remove(path.c_str());
+
+  // a whole record with a side out of range is refused like a broken snapshot
   {
+    command_log log(path, durability::buffered, 1);
+    auto cmd = parse_command("N,1,1,AB,L,B,10.00,100");
+    cmd.m_order = order_data(1, 1, "AB", 10.0f, 100, static_cast<order_side>(7), order_type::limit);
+    log.append(cmd, 1);
+  }
+  command_processor bad(5);
+  bool refused = false;
+  try {
+    command_log::replay(path, bad);
+  }
+  catch (const snapshot_error&) {
+    refused = true;
+  }
+  assert(refused && bad.get_engines().get_stats().m_symbols == 0);
+  std::remove(path.c_str());
+}
 
+#if defined(__unix__) || defined(__APPLE__)
+void basic_file_io_tests()
+{
+  const std::string path = "basic_file_io_tests.txt";
+  std::string text;
+  for (int i = 0; i < 200; ++i) {
+    text += "N," + std::to_string(i) + ",1,AB,L,B,10.00," + std::to_string(i * 7) + '\n';
   }
-  std::string get_msg() const override
+  text += "no newline at the end";
+  for (bool use_ring : { false, true }) {
+    // buffers far smaller than a line make every read and write span several
+    {
+      int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      assert(fd >= 0);
+      {
+        fd_output_buf buf(fd, use_ring, 3, 7);
+        std::ostream out(&buf);
+        out << text.substr(0, 100);
+        out.flush();
+        out << text.substr(100);
+        buf.finish();
+      }
+      ::close(fd);
+    }
+    std::string read_back;
+    {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      assert(fd >= 0);
+      fd_input_buf buf(fd, use_ring, 3, 5);
+      std::istream in(&buf);
+      std::string line;
+      while (std::getline(in, line)) {
+        read_back += line + '\n';
+      }
+      ::close(fd);
+    }
+    assert(read_back == text + '\n');
+
+    // a pipe keeps its reads and writes in order
+    int fds[2];
+    int piped_fds = ::pipe(fds);
+    assert(piped_fds == 0);
+    std::thread writer([&] {
+      fd_output_buf buf(fds[1], use_ring, 3, 11);
+      std::ostream out(&buf);
+      out << text;
+      buf.finish();
+      ::close(fds[1]);
+    });
+    std::string piped;
+    {
+      fd_input_buf buf(fds[0], use_ring, 3, 13);
+      std::istream in(&buf);
+      std::copy(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>(), std::back_inserter(piped));
+    }
+    writer.join();
+    ::close(fds[0]);
+    assert(piped == text);
+  }
+  std::remove(path.c_str());
+
+  // a log without durability hands its groups to the ring and still replays
+  const std::string log_path = "basic_file_io_tests.log";
+  std::remove(log_path.c_str());
+  command_processor processor(5);
+  std::vector<output_record> records;
   {
-    std::string msg;
-    msg += std::to_string(m_order_id);
-    msg += " - AmendReject - 101 - Invalid amendment details";
-    return msg;
+    command_log log(log_path, durability::none, 1, true);
+    for (int i = 1; i <= 3000; ++i) {
+      auto cmd = parse_command("N," + std::to_string(i) + "," + std::to_string(i) + ",AB,L,B,10.00,100");
+      processor.execute(cmd, records);
+      log.append(cmd, processor.get_sequence());
+    }
   }
-private:
-  uint64_t m_order_id;
-};
+  command_processor recovered(5);
+  auto replayed = command_log::replay(log_path, recovered);
+  assert(replayed == 3000);
+  std::remove(log_path.c_str());
+}
+#endif
 
-class cancel_not_found_error : public parse_error
+#if defined(__linux__)
+class gateway_error : public std::runtime_error
 {
 public:
-  cancel_not_found_error(uint64_t order_id)
-    :m_order_id(order_id)
+  explicit gateway_error(const std::string& msg)
+    :std::runtime_error(msg + ": " + std::strerror(errno))
   {
 
   }
-  std::string get_msg() const override
-  {
-    std::string msg;
-    msg += std::to_string(m_order_id);
-    msg += " - CancelReject - 404 - Order does not exist";
-    return msg;
-  }
-private:
-  uint64_t m_order_id;
 };
 
-class query_data
+// splits [addr:]port, the address defaults to the loopback one
+sockaddr_in parse_socket_address(const std::string& text)
+{
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  auto colon = text.rfind(':');
+  auto host = colon == std::string::npos ? std::string("127.0.0.1") : text.substr(0, colon);
+  auto port = std::stoul(colon == std::string::npos ? text : text.substr(colon + 1));
+  if (port > 65535 || ::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+    throw std::invalid_argument("bad socket address " + text);
+  }
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  return addr;
+}
+
+// order entry over tcp: clients send the command lines of the input and get the
+// output lines of their commands back, fills also go to the sessions which entered
+// the matched orders. One thread runs the sessions and the engines off an epoll
+// loop, so commands are sequenced in the order their lines are read. The output
+// of every round of events is held until the command log committed its commands
+template <class Processor>
+class order_gateway
 {
 public:
-  query_data()
+  order_gateway(Processor& processor, command_log* log, const sockaddr_in& addr)
+    :m_processor(processor)
+    ,m_log(log)
   {
-
+    m_epoll = ::epoll_create1(EPOLL_CLOEXEC);
+    m_wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_listen = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_epoll < 0 || m_wake < 0 || m_listen < 0) {
+      gateway_error err("cannot create gateway descriptors");
+      close_all();
+      throw err;
+    }
+    int one = 1;
+    ::setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (::bind(m_listen, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(m_listen, 128) != 0) {
+      gateway_error err("cannot listen for order entry");
+      close_all();
+      throw err;
+    }
+    watch(m_listen, listen_token, EPOLLIN);
+    watch(m_wake, wake_token, EPOLLIN);
   }
-  query_data(const std::string& symb)
-    :m_symbol(symb)
+  order_gateway(const order_gateway&) = delete;
+  order_gateway& operator=(const order_gateway&) = delete;
+  ~order_gateway()
   {
-
+    for (auto& s : m_sessions) {
+      ::close(s.second.m_fd);
+    }
+    close_all();
   }
-  query_data(uint32_t time)
-    :m_timestamp(time)
+  // the bound port, useful when listening on port 0
+  uint16_t get_port() const
   {
-
+    sockaddr_in addr{};
+    socklen_t len = sizeof(addr);
+    ::getsockname(m_listen, reinterpret_cast<sockaddr*>(&addr), &len);
+    return ntohs(addr.sin_port);
   }
-  query_data(const std::string& symb, uint32_t time)
-    :m_symbol(symb)
-    , m_timestamp(time)
+  // writing to it ends run, from any thread or a signal handler
+  int get_wake_fd() const
   {
-
+    return m_wake;
   }
-  std::string get_symb() const
+  void stop()
   {
-    return m_symbol;
+    uint64_t one = 1;
+    ssize_t ret = ::write(m_wake, &one, sizeof(one));
+    (void)ret;
   }
-  uint32_t get_timestamp() const
+  size_t get_session_count() const
   {
-    return m_timestamp;
+    return m_sessions.size();
+  }
+  // serves the sessions until stop is called, the open ones are closed then
+  void run()
+  {
+    std::array<epoll_event, 64> events;
+    bool stopping = false;
+    while (!stopping) {
+      int n = ::epoll_wait(m_epoll, events.data(), static_cast<int>(events.size()), -1);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw gateway_error("epoll_wait failed");
+      }
+      for (int i = 0; i < n; ++i) {
+        auto token = events[i].data.u64;
+        if (token == listen_token) {
+          accept_sessions();
+        }
+        else if (token == wake_token) {
+          stopping = true;
+        }
+        else {
+          if (m_sessions.count(token) == 0) {
+            continue;
+          }
+          if ((events[i].events & EPOLLIN) != 0) {
+            read_session(token);
+          }
+          else if ((events[i].events & (EPOLLERR | EPOLLHUP)) != 0) {
+            m_sessions.find(token)->second.m_closing = true;
+            mark_dirty(token);
+          }
+          if ((events[i].events & EPOLLOUT) != 0) {
+            mark_dirty(token);
+          }
+        }
+      }
+      if (m_log != nullptr && m_log->holds_acks()) {
+        m_log->commit();
+      }
+      flush_dirty();
+    }
+    if (m_log != nullptr) {
+      m_log->commit();
+    }
+    flush_dirty();
   }
 private:
-  std::string m_symbol;
-  uint32_t    m_timestamp = 0;
-};
+  static const uint64_t listen_token = 0;
+  static const uint64_t wake_token = 1;
+  static const size_t read_chunk = 64 * 1024;
+  // a line longer than that is not a command, more pending output than that
+  // means the client does not read its acks
+  static const size_t max_line = 64 * 1024;
+  static const size_t max_pending = 64 * 1024 * 1024;
+
+  struct session
+  {
+    int m_fd = -1;
+    std::string m_in;
+    std::string m_out;
+    size_t m_out_pos = 0;
+    bool m_dirty = false;
+    bool m_writable_wait = false;
+    bool m_closing = false;
+  };
 
-class order_engines //: public 
-{
-public:
-  void add_order_from_order_data(const order_data& od)
+  void close_all()
   {
-    if (od.get_time() < m_current_time) {
-      throw new_parse_error(od.get_id());
+    for (auto fd : { m_listen, m_wake, m_epoll }) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
     }
-    m_current_time = od.get_time();
-    auto res = m_engines[od.get_symbol()].put_order(od, od.get_order_side(), od.get_order_type());
-    if (res == false) {
-      throw new_parse_error(od.get_id());
+  }
+  void watch(int fd, uint64_t token, uint32_t mask, int op = EPOLL_CTL_ADD)
+  {
+    epoll_event ev{};
+    ev.events = mask;
+    ev.data.u64 = token;
+    if (::epoll_ctl(m_epoll, op, fd, &ev) != 0) {
+      throw gateway_error("epoll_ctl failed");
     }
-
-    m_symbols[od.get_id()] = od.get_symbol();
-    std::cout << od.get_id() << " - Accept\n";
   }
-  void amend_order_from_order_data(const order_data& od)
+  void accept_sessions()
   {
-    if (od.get_time() < m_current_time) {
-      throw amend_parse_error(od.get_id());
+    for (;;) {
+      int fd = ::accept4(m_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // EAGAIN, or out of descriptors which leaves the client waiting in the backlog
+        return;
+      }
+      int one = 1;
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      auto token = m_next_token++;
+      session s;
+      s.m_fd = fd;
+      m_sessions.emplace(token, std::move(s));
+      watch(fd, token, EPOLLIN);
     }
-    m_current_time = od.get_time();
-
-    auto symbol_iter = m_symbols.find(od.get_id());
-    if (symbol_iter == m_symbols.end()) {
-      throw amend_not_found_error(od.get_id());
+  }
+  // reads one chunk, level triggered epoll brings the session back if there is more,
+  // so one busy client does not hold the others up
+  void read_session(uint64_t token)
+  {
+    auto& s = m_sessions.find(token)->second;
+    auto n = ::read(s.m_fd, m_buf.data(), m_buf.size());
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      s.m_closing = true;
+      mark_dirty(token);
+      return;
     }
-    if (symbol_iter->second != od.get_symbol()) {
-      throw amend_parse_error(od.get_id());
+    if (n < 0) {
+      return;
     }
-    auto engine_iter = m_engines.find(od.get_symbol());
-    assert(engine_iter != m_engines.end());
-    amend_result amend_res = engine_iter->second.amend_order(od);
-    if (amend_res == amend_result::not_found) {
-      throw amend_not_found_error(od.get_id());
+    s.m_in.append(m_buf.data(), static_cast<size_t>(n));
+    size_t start = 0;
+    for (;;) {
+      auto end = s.m_in.find('\n', start);
+      if (end == std::string::npos) {
+        break;
+      }
+      auto len = end - start;
+      if (len > 0 && s.m_in[end - 1] == '\r') {
+        --len;
+      }
+      if (len > 0) {
+        execute(token, s.m_in.substr(start, len));
+      }
+      start = end + 1;
     }
-    else if (amend_res == amend_result::failed) {
-      throw amend_parse_error(od.get_id());
+    // execute does not add sessions, s is still valid
+    s.m_in.erase(0, start);
+    if (s.m_in.size() > max_line) {
+      s.m_closing = true;
+      mark_dirty(token);
     }
-    std::cout << od.get_id() << " - AmendAccept\n";
   }
-  void cancel_order(uint64_t id)
+  void execute(uint64_t token, const std::string& line)
   {
-    auto symb_iter = m_symbols.find(id);
-    if (symb_iter == m_symbols.end()) {
-      throw cancel_not_found_error(id);
+    auto cmd = parse_command(line);
+    m_processor.execute(cmd, m_records);
+    if (m_log != nullptr) {
+      m_log->append(cmd, m_processor.get_sequence());
     }
-    auto eng_iter = m_engines.find(symb_iter->second);
-    assert(eng_iter != m_engines.end());
-    auto res = eng_iter->second.cancel_order(id);
-    if (!res) {
-      throw cancel_not_found_error(id);
+    for (const auto& rec : m_records) {
+      if (rec.m_kind == output_kind::expired) {
+        // only the owner of an expired order hears of it
+        auto owner = m_owners.find(rec.m_id);
+        if (owner != m_owners.end() && m_sessions.count(owner->second) != 0) {
+          send_record(owner->second, rec);
+        }
+        if (owner != m_owners.end()) {
+          m_owners.erase(owner);
+        }
+        continue;
+      }
+      send_record(token, rec);
+      if (rec.m_kind == output_kind::accept && cmd.m_type == command_type::new_order) {
+        m_owners[rec.m_id] = token;
+      }
+      else if (rec.m_kind == output_kind::cancel_accept) {
+        // the orders of a mass cancel may belong to other sessions
+        auto owner = m_owners.find(rec.m_id);
+        if (cmd.m_type == command_type::mass_cancel && owner != m_owners.end()
+          && owner->second != token && m_sessions.count(owner->second) != 0) {
+          send_record(owner->second, rec);
+        }
+        m_owners.erase(rec.m_id);
+      }
+      else if (rec.m_kind == output_kind::fill) {
+        for (auto id : { rec.m_fill.m_matched_buy.m_order_id, rec.m_fill.m_matched_sell.m_id }) {
+          auto owner = m_owners.find(id);
+          if (owner != m_owners.end() && owner->second != token && m_sessions.count(owner->second) != 0) {
+            send_record(owner->second, rec);
+          }
+        }
+      }
     }
-    std::cout << id << " - CancelAccept\n";
+    m_records.clear();
   }
-  std::vector<matched_result_detail> match_one(const std::string& symb)
+  void send_record(uint64_t token, const output_record& rec)
   {
-    auto iter = m_engines.find(symb);
-    assert(iter != m_engines.end());
-    auto ret = iter->second.run_matching();
-    return ret;
+    m_format.str(std::string());
+    write_record(rec, m_format);
+    m_sessions.find(token)->second.m_out += m_format.str();
+    mark_dirty(token);
   }
-  std::vector<matched_result_detail> match_all()
+  void mark_dirty(uint64_t token)
   {
-    std::vector<matched_result_detail> ret;
-    for (auto& eng : m_engines) {
-      auto cur = eng.second.run_matching();
-      ret.insert(ret.end(), cur.begin(), cur.end());
+    auto& s = m_sessions.find(token)->second;
+    if (!s.m_dirty) {
+      s.m_dirty = true;
+      m_dirty.push_back(token);
     }
-    return ret;
   }
-  void dump_data(const query_data& q)
+  void flush_dirty()
   {
-    auto symb = q.get_symb();
-    auto time = q.get_timestamp();
-    if (symb.empty()) {
-      for (auto& eng : m_engines) {
-        eng.second.dump_data(time);
+    std::vector<uint64_t> closed;
+    for (auto token : m_dirty) {
+      auto& s = m_sessions.find(token)->second;
+      s.m_dirty = false;
+      if (!flush(token, s) || (s.m_closing && s.m_out_pos == s.m_out.size())) {
+        closed.push_back(token);
       }
     }
-    else {
-      auto iter = m_engines.find(symb);
-      assert(iter != m_engines.end());
-      iter->second.dump_data(time);
+    m_dirty.clear();
+    for (auto token : closed) {
+      auto iter = m_sessions.find(token);
+      ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, iter->second.m_fd, nullptr);
+      ::close(iter->second.m_fd);
+      m_sessions.erase(iter);
+    }
+  }
+  // false when the session is to be dropped
+  bool flush(uint64_t token, session& s)
+  {
+    while (s.m_out_pos < s.m_out.size()) {
+      auto n = ::send(s.m_fd, s.m_out.data() + s.m_out_pos, s.m_out.size() - s.m_out_pos, MSG_NOSIGNAL);
+      if (n > 0) {
+        s.m_out_pos += static_cast<size_t>(n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0 && errno != EAGAIN) {
+        return false;
+      }
+      if (s.m_out.size() - s.m_out_pos > max_pending) {
+        return false;
+      }
+      if (!s.m_writable_wait) {
+        s.m_writable_wait = true;
+        watch(s.m_fd, token, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+      }
+      return true;
+    }
+    s.m_out.clear();
+    s.m_out_pos = 0;
+    if (s.m_writable_wait) {
+      s.m_writable_wait = false;
+      watch(s.m_fd, token, EPOLLIN, EPOLL_CTL_MOD);
     }
+    return true;
   }
-private:
-  uint32_t m_current_time = 0;
-  std::map<std::string, order_engine> m_engines;
-  std::unordered_map<uint64_t, std::string> m_symbols;
-};
 
+  Processor& m_processor;
+  command_log* m_log;
+  int m_epoll = -1;
+  int m_wake = -1;
+  int m_listen = -1;
+  uint64_t m_next_token = 2;
+  flat_id_map<session> m_sessions;
+  std::vector<uint64_t> m_dirty;
+  // session of the accepted orders for routing fills, cancelled ones are dropped
+  flat_id_map<uint64_t> m_owners;
+  std::vector<char> m_buf = std::vector<char>(read_chunk);
+  std::vector<output_record> m_records;
+  std::ostringstream m_format;
+};
 
-std::vector<std::string> split_string(const std::string& line)
-{
-  std::vector<std::string> tokens;
-  std::string token;
-  std::istringstream tokenStream(line);
-  while (std::getline(tokenStream, token, ','))
-  {
-    tokens.push_back(token);
-  }
-  return tokens;
-}
-
-order_type string_to_order_type(const std::string& s)
+int connect_socket(const sockaddr_in& addr)
 {
-  if (s.length() != 1) {
-    throw dummy_parse_error();
+  int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw gateway_error("cannot create client socket");
   }
-  switch (s[0]) {
-  case 'M' :
-    return order_type::market;
-  case 'L':
-    return order_type::limit;
-  case 'I':
-    return order_type::limit_ioc;
+  if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+    ::close(fd);
+    throw gateway_error("cannot connect to the gateway");
   }
-  throw dummy_parse_error();
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
 }
 
-order_side string_to_order_side(const std::string& s)
+// loopback load generator: every client keeps a window of commands in flight,
+// a new limit order followed by its cancel, and times each command until its
+// response line; the book stays near empty and time 0 keeps the commands out of
+// the per timestamp history, so the numbers are about the gateway. Meant for a
+// fresh gateway, one whose time has moved on rejects the orders and the cancels
+void gateway_load_test(const sockaddr_in& addr, size_t client_count, uint64_t command_count)
 {
-  if (s.length() != 1) {
-    throw dummy_parse_error();
+  const size_t window = 16;
+  struct client
+  {
+    int m_fd = -1;
+    uint64_t m_sent = 0;
+    uint64_t m_received = 0;
+    uint64_t m_total = 0;
+    std::string m_in;
+    std::vector<std::chrono::steady_clock::time_point> m_sent_at;
+  };
+  std::vector<client> clients(client_count);
+  int epoll = ::epoll_create1(EPOLL_CLOEXEC);
+  for (size_t c = 0; c < client_count; ++c) {
+    auto& cl = clients[c];
+    cl.m_fd = connect_socket(addr);
+    // the new order and its cancel go together
+    cl.m_total = command_count / client_count / 2 * 2;
+    cl.m_sent_at.resize(cl.m_total);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = c;
+    ::epoll_ctl(epoll, EPOLL_CTL_ADD, cl.m_fd, &ev);
   }
+  auto send_window = [&](size_t c) {
+    auto& cl = clients[c];
+    std::string out;
+    while (cl.m_sent < cl.m_total && cl.m_sent - cl.m_received < window) {
+      auto id = 1000000000 + (c * cl.m_total + cl.m_sent) / 2;
+      if (cl.m_sent % 2 == 0) {
+        out += "N," + std::to_string(id) + ",0,LG,L," + (c % 2 == 0 ? "B,99.00" : "S,101.00") + ",100\n";
+      }
+      else {
+        out += "X," + std::to_string(id) + ",0\n";
+      }
+      cl.m_sent_at[cl.m_sent++] = std::chrono::steady_clock::now();
+    }
+    // blocking send, the window keeps it small
+    size_t pos = 0;
+    while (pos < out.size()) {
+      auto n = ::send(cl.m_fd, out.data() + pos, out.size() - pos, MSG_NOSIGNAL);
+      if (n <= 0) {
+        throw gateway_error("gateway closed the connection");
+      }
+      pos += static_cast<size_t>(n);
+    }
+  };
 
-  switch (s[0]) {
-  case 'S':
-    return order_side::sell;
-  case 'B':
-    return order_side::buy;
+  std::vector<double> rtt_us;
+  rtt_us.reserve(command_count);
+  uint64_t rejects = 0;
+  size_t done = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t c = 0; c < client_count; ++c) {
+    send_window(c);
+    done += clients[c].m_total == 0 ? 1 : 0;
   }
-
-  throw dummy_parse_error();
+  std::array<epoll_event, 64> events;
+  std::vector<char> buf(64 * 1024);
+  while (done < client_count) {
+    int n = ::epoll_wait(epoll, events.data(), static_cast<int>(events.size()), -1);
+    for (int i = 0; i < n; ++i) {
+      auto c = static_cast<size_t>(events[i].data.u64);
+      auto& cl = clients[c];
+      auto r = ::read(cl.m_fd, buf.data(), buf.size());
+      if (r <= 0) {
+        throw gateway_error("gateway closed the connection");
+      }
+      auto now = std::chrono::steady_clock::now();
+      cl.m_in.append(buf.data(), static_cast<size_t>(r));
+      size_t pos = 0;
+      for (auto end = cl.m_in.find('\n'); end != std::string::npos; end = cl.m_in.find('\n', pos)) {
+        if (cl.m_in.find("Reject", pos) < end) {
+          ++rejects;
+        }
+        rtt_us.push_back(std::chrono::duration<double, std::micro>(now - cl.m_sent_at[cl.m_received++]).count());
+        pos = end + 1;
+      }
+      cl.m_in.erase(0, pos);
+      if (cl.m_received == cl.m_total) {
+        ++done;
+      }
+      else {
+        send_window(c);
+      }
+    }
+  }
+  auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (auto& cl : clients) {
+    ::close(cl.m_fd);
+  }
+  ::close(epoll);
+  std::sort(rtt_us.begin(), rtt_us.end());
+  auto pct = [&](double p) {
+    return rtt_us.empty() ? 0.0 : rtt_us[static_cast<size_t>(p * (rtt_us.size() - 1))];
+  };
+  std::cout << "gateway-bench|clients=" << client_count << ",commands=" << rtt_us.size()
+    << ",commands_per_sec=" << static_cast<uint64_t>(rtt_us.size() / elapsed)
+    << ",rtt_p50_us=" << static_cast<uint64_t>(pct(0.5))
+    << ",rtt_p99_us=" << static_cast<uint64_t>(pct(0.99))
+    << ",rtt_max_us=" << static_cast<uint64_t>(pct(1.0))
+    << ",rejects=" << rejects << '\n';
 }
 
-order_data parse_new_order_string(const std::string& line)
+// the fd a SIGINT or SIGTERM wakes to stop the gateway
+int g_gateway_wake_fd = -1;
+
+extern "C" void stop_gateway_on_signal(int)
 {
-  auto tok = split_string(line);
-  assert(tok.size() == 8);
+  uint64_t one = 1;
+  ssize_t ret = ::write(g_gateway_wake_fd, &one, sizeof(one));
+  (void)ret;
+}
 
-  uint64_t order_id = std::stoull(tok[1]);
-  try {
-    uint32_t time_stamp = std::stoul(tok[2]);
-    std::string symb = tok[3];
-    order_type ord_type = string_to_order_type(tok[4]);
-    order_side ord_side = string_to_order_side(tok[5]);
-    float price = std::stof(tok[6]);
-    uint64_t q = std::stoull(tok[7]);
+// serves order entry on listen until SIGINT or SIGTERM
+template <class Processor>
+void serve_order_entry(Processor& processor, command_log* log, const std::string& listen)
+{
+  order_gateway<Processor> gateway(processor, log, parse_socket_address(listen));
+  g_gateway_wake_fd = gateway.get_wake_fd();
+  std::signal(SIGINT, stop_gateway_on_signal);
+  std::signal(SIGTERM, stop_gateway_on_signal);
+  std::cerr << "order entry on port " << gateway.get_port() << '\n';
+  gateway.run();
+  std::signal(SIGINT, SIG_DFL);
+  std::signal(SIGTERM, SIG_DFL);
+  g_gateway_wake_fd = -1;
+}
 
-    return order_data(order_id, time_stamp, symb, price, q, ord_side, ord_type);
-  }
-  catch (const dummy_parse_error&) {
-    throw new_parse_error(order_id);
-  }
-  catch (const std::exception&) {
-    throw new_parse_error(order_id);
+// runs the load generator against the gateway at connect, or against one started
+// in process on a loopback port when connect is empty
+void gateway_benchmark(const std::string& connect, size_t client_count, uint64_t command_count)
+{
+  if (!connect.empty()) {
+    gateway_load_test(parse_socket_address(connect), client_count, command_count);
+    return;
   }
+  command_processor processor(5);
+  order_gateway<command_processor> gateway(processor, nullptr, parse_socket_address("127.0.0.1:0"));
+  std::thread server([&]() {
+    gateway.run();
+  });
+  gateway_load_test(parse_socket_address("127.0.0.1:" + std::to_string(gateway.get_port())), client_count, command_count);
+  gateway.stop();
+  server.join();
 }
 
-order_data parse_amend_order_string(const std::string& line)
+// a gateway on a loopback port, two sessions whose orders cross; the acks go to
+// the sender and the fill to both
+void basic_gateway_tests()
 {
-  return parse_new_order_string(line);
+  command_processor processor(5);
+  order_gateway<command_processor> gateway(processor, nullptr, parse_socket_address("127.0.0.1:0"));
+  std::thread server([&]() {
+    gateway.run();
+  });
+  auto addr = parse_socket_address("127.0.0.1:" + std::to_string(gateway.get_port()));
+  int buyer = connect_socket(addr);
+  int seller = connect_socket(addr);
+  auto send_text = [](int fd, const std::string& text) {
+    auto n = ::send(fd, text.data(), text.size(), MSG_NOSIGNAL);
+    assert(n == static_cast<ssize_t>(text.size()));
+    (void)n;
+  };
+  auto read_lines = [](int fd, size_t count) {
+    std::string text;
+    char buf[256];
+    while (static_cast<size_t>(std::count(text.begin(), text.end(), '\n')) < count) {
+      auto n = ::read(fd, buf, sizeof(buf));
+      assert(n > 0);
+      text.append(buf, static_cast<size_t>(n));
+    }
+    return text;
+  };
+  // the line arrives in two parts
+  send_text(buyer, "N,1,1,AB,L,B,10.00,");
+  send_text(buyer, "100\r\nN,1,2,AB,L,B,10.00,100\n");
+  assert(read_lines(buyer, 2) == "1 - Accept\n" + new_parse_error(1).get_msg() + "\n");
+  send_text(seller, "N,2,3,AB,L,S,10.00,40\nM,4\n");
+  assert(read_lines(seller, 2) == "2 - Accept\nAB|1,L,40,10.00|10.00,40,L,2\n");
+  assert(read_lines(buyer, 1) == "AB|1,L,40,10.00|10.00,40,L,2\n");
+  ::close(seller);
+  send_text(buyer, "X,1,5\n");
+  assert(read_lines(buyer, 1) == "1 - CancelAccept\n");
+  // malformed lines are rejected and queries and matches of a symbol without a book give nothing
+  send_text(buyer, "X,abc,1\nQ,5,ZZ\nN,1\nM,6,ZZ\nL,ZZ\nN,3,6,AB,L,B,9.00,10\n");
+  assert(read_lines(buyer, 3) == new_parse_error(0).get_msg() + "\n" + new_parse_error(1).get_msg() + "\n3 - Accept\n");
+  ::close(buyer);
+  gateway.stop();
+  server.join();
 }
+#endif
+
+// how replays read stdin and write stdout: through the iostreams, with plain
+// reads and writes of large buffers, or with those buffers in flight on io_uring
+enum class io_mode {
+    stream
+  , plain
+  , uring
+};
 
-struct cancel_command
-{
-  uint64_t m_id;
-  uint32_t m_timestamp;
+// the price level index of the books: the sorted array, the tick bitmap for
+// books dense on the cent grid or the tree for books spread over many levels
+enum class level_mode {
+    index
+  , tick
+  , map
 };
 
-cancel_command parse_cancel_string(const std::string& line)
+struct run_options
 {
-  auto tok = split_string(line);
-  assert(tok.size() == 3);
+  // dump engine statistics to stderr once the input is processed
+  bool m_stats = false;
+  // number of rows printed per symbol by Q and L
+  size_t m_depth = 5;
+  // run the market data publication stress test with that many readers instead of reading input
+  size_t m_md_stress_readers = 0;
+  // benchmark the price level index on a book that deep instead of reading input
+  size_t m_level_bench_levels = 0;
+  // benchmark the order id tables with that many ids instead of reading input
+  size_t m_hash_bench_count = 0;
+  // run that many generated commands through engines of each policy instead of reading input
+  size_t m_policy_bench_count = 0;
+  // run historical queries against histories of that many generated commands instead of reading input
+  size_t m_history_bench_count = 0;
+  // time serial against pipelined runs of that many generated command lines instead of reading input
+  size_t m_pipeline_bench_count = 0;
+  // ids known across all symbols and resting orders per side of a book the
+  // id tables are sized for up front
+  uint64_t m_expected_orders = 0;
+  uint64_t m_expected_book_orders = 0;
+  // run parsing, matching and output formatting on separate threads
+  bool m_pipeline = false;
+  // commands handed over between pipeline stages at once
+  size_t m_pipeline_batch = 256;
+  // restore this snapshot and skip the input commands it already reflects
+  std::string m_load_snapshot;
+  // save a snapshot once the input is processed
+  std::string m_save_snapshot;
+  // replay this command log on start and append the executed commands to it
+  std::string m_log;
+  durability m_log_durability = durability::fsync_batch;
+  // commands committed to the log at once at most
+  size_t m_log_group = 64;
+  // serve order entry on this [addr:]port instead of reading stdin
+  std::string m_listen;
+  // run the gateway load generator with that many clients instead of reading input,
+  // against the gateway at m_connect or one started in process
+  size_t m_gateway_bench_clients = 0;
+  std::string m_connect;
+  io_mode m_io = io_mode::stream;
+  level_mode m_levels = level_mode::index;
+  // M uncrosses the books in a single price call auction
+  bool m_auction = false;
+  // C lists every cancelled order after its summary
+  bool m_report_cancelled = false;
+  // read the whole input first and keep the history only for the times it queries
+  bool m_prescan = false;
+  // history chunks beyond the budget in MB go to this file
+  std::string m_history_spill;
+  uint64_t m_history_budget = 256;
+  // answer historical queries on that many reader threads
+  size_t m_query_threads = 0;
+};
 
-  auto id = std::stoull(tok[1]);
-  auto tim = std::stoul(tok[2]);
-  return {id, tim};
+run_options parse_run_options(int argc, char* argv[])
+{
+  run_options opts;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--stats") {
+      opts.m_stats = true;
+    }
+    else if (arg.compare(0, 8, "--depth=") == 0) {
+      opts.m_depth = std::stoul(arg.substr(8));
+    }
+    else if (arg.compare(0, 12, "--md-stress=") == 0) {
+      opts.m_md_stress_readers = std::stoul(arg.substr(12));
+    }
+    else if (arg.compare(0, 14, "--level-bench=") == 0) {
+      opts.m_level_bench_levels = std::stoul(arg.substr(14));
+    }
+    else if (arg.compare(0, 9, "--listen=") == 0) {
+      opts.m_listen = arg.substr(9);
+    }
+    else if (arg.compare(0, 16, "--gateway-bench=") == 0) {
+      opts.m_gateway_bench_clients = std::stoul(arg.substr(16));
+    }
+    else if (arg.compare(0, 10, "--connect=") == 0) {
+      opts.m_connect = arg.substr(10);
+    }
+    else if (arg.compare(0, 13, "--hash-bench=") == 0) {
+      opts.m_hash_bench_count = std::stoul(arg.substr(13));
+    }
+    else if (arg.compare(0, 15, "--policy-bench=") == 0) {
+      opts.m_policy_bench_count = std::stoul(arg.substr(15));
+    }
+    else if (arg.compare(0, 16, "--history-bench=") == 0) {
+      opts.m_history_bench_count = std::stoul(arg.substr(16));
+    }
+    else if (arg.compare(0, 17, "--pipeline-bench=") == 0) {
+      opts.m_pipeline_bench_count = std::stoul(arg.substr(17));
+    }
+    else if (arg.compare(0, 18, "--expected-orders=") == 0) {
+      opts.m_expected_orders = std::stoull(arg.substr(18));
+    }
+    else if (arg.compare(0, 23, "--expected-book-orders=") == 0) {
+      opts.m_expected_book_orders = std::stoull(arg.substr(23));
+    }
+    else if (arg == "--pipeline") {
+      opts.m_pipeline = true;
+    }
+    else if (arg.compare(0, 16, "--load-snapshot=") == 0) {
+      opts.m_load_snapshot = arg.substr(16);
+    }
+    else if (arg.compare(0, 16, "--save-snapshot=") == 0) {
+      opts.m_save_snapshot = arg.substr(16);
+    }
+    else if (arg.compare(0, 6, "--log=") == 0) {
+      opts.m_log = arg.substr(6);
+    }
+    else if (arg.compare(0, 17, "--log-durability=") == 0) {
+      auto level = arg.substr(17);
+      if (level == "none") {
+        opts.m_log_durability = durability::none;
+      }
+      else if (level == "buffered") {
+        opts.m_log_durability = durability::buffered;
+      }
+      else if (level == "fsync") {
+        opts.m_log_durability = durability::fsync_batch;
+      }
+      else {
+        std::cerr << "unknown log durability " << level << '\n';
+      }
+    }
+    else if (arg.compare(0, 8, "--match=") == 0) {
+      auto mode = arg.substr(8);
+      if (mode == "continuous") {
+        opts.m_auction = false;
+      }
+      else if (mode == "auction") {
+        opts.m_auction = true;
+      }
+      else {
+        std::cerr << "unknown match mode " << mode << '\n';
+      }
+    }
+    else if (arg == "--prescan") {
+      opts.m_prescan = true;
+    }
+    else if (arg.compare(0, 16, "--history-spill=") == 0) {
+      opts.m_history_spill = arg.substr(16);
+    }
+    else if (arg.compare(0, 17, "--history-budget=") == 0) {
+      opts.m_history_budget = std::stoull(arg.substr(17));
+    }
+    else if (arg.compare(0, 16, "--query-threads=") == 0) {
+      opts.m_query_threads = std::stoul(arg.substr(16));
+    }
+    else if (arg.compare(0, 14, "--mass-cancel=") == 0) {
+      auto mode = arg.substr(14);
+      if (mode == "summary") {
+        opts.m_report_cancelled = false;
+      }
+      else if (mode == "orders") {
+        opts.m_report_cancelled = true;
+      }
+      else {
+        std::cerr << "unknown mass cancel mode " << mode << '\n';
+      }
+    }
+    else if (arg.compare(0, 5, "--io=") == 0) {
+      auto mode = arg.substr(5);
+      if (mode == "stream") {
+        opts.m_io = io_mode::stream;
+      }
+      else if (mode == "plain") {
+        opts.m_io = io_mode::plain;
+      }
+      else if (mode == "uring") {
+        opts.m_io = io_mode::uring;
+      }
+      else {
+        std::cerr << "unknown io mode " << mode << '\n';
+      }
+    }
+    else if (arg.compare(0, 9, "--levels=") == 0) {
+      auto mode = arg.substr(9);
+      if (mode == "index") {
+        opts.m_levels = level_mode::index;
+      }
+      else if (mode == "tick") {
+        opts.m_levels = level_mode::tick;
+      }
+      else if (mode == "map") {
+        opts.m_levels = level_mode::map;
+      }
+      else {
+        std::cerr << "unknown level index " << mode << '\n';
+      }
+    }
+    else if (arg.compare(0, 12, "--log-group=") == 0) {
+      opts.m_log_group = std::max<size_t>(1, std::stoul(arg.substr(12)));
+    }
+    else if (arg.compare(0, 17, "--pipeline-batch=") == 0) {
+      opts.m_pipeline = true;
+      opts.m_pipeline_batch = std::max<size_t>(1, std::stoul(arg.substr(17)));
+    }
+    else {
+      std::cerr << "unknown option " << arg << '\n';
+    }
+  }
+  return opts;
 }
 
-struct match_command
+// replays the input, or serves order entry, on engines of Policy
+template <class Policy>
+int run_engines(const run_options& opts)
 {
-  match_command(uint32_t t)
-    :m_time(t)
-  {
-
+  basic_command_processor<Policy> processor(opts.m_depth);
+  processor.get_engines().reserve(opts.m_expected_orders, opts.m_expected_book_orders);
+  processor.get_engines().set_auction(opts.m_auction);
+  processor.set_report_cancelled(opts.m_report_cancelled);
+  if (!opts.m_history_spill.empty()) {
+    try {
+      processor.get_history().set_spill(opts.m_history_spill, opts.m_history_budget << 20);
+    }
+    catch (const snapshot_error& err) {
+      std::cerr << err.what() << '\n';
+      return 1;
+    }
   }
-  match_command() {
-
+  // destroyed after the output is written, all its answers are in by then
+  std::unique_ptr<query_pool<typename basic_command_processor<Policy>::history_type>> pool;
+  if (opts.m_query_threads > 0) {
+    pool.reset(new query_pool<typename basic_command_processor<Policy>::history_type>(opts.m_query_threads, opts.m_depth));
+    processor.set_query_pool(pool.get());
   }
-  match_command(const std::string& s, uint32_t tim)
-    :m_symb(s)
-    ,m_time(tim)
-  {
 
+#if defined(__unix__) || defined(__APPLE__)
+  std::unique_ptr<fd_input_buf> in_buf;
+  std::unique_ptr<fd_output_buf> out_buf;
+  if (opts.m_io != io_mode::stream && opts.m_listen.empty()) {
+    in_buf.reset(new fd_input_buf(0, opts.m_io == io_mode::uring));
+    out_buf.reset(new fd_output_buf(1, opts.m_io == io_mode::uring));
+    if (opts.m_io == io_mode::uring && !in_buf->uses_ring()) {
+      std::cerr << "io_uring is not available, using plain reads and writes\n";
+    }
   }
-  std::string m_symb;
-  uint32_t m_time = 0;
-};
-match_command parse_match_string(const std::string& line)
-{
-  auto tok = split_string(line);
-  if (tok.size() == 2) {
-    return match_command{ std::stoul(tok[1]) };
-  }
-  else if (tok.size() == 3) {
-    return match_command(tok[2], std::stoul(tok[1]));
+  std::istream file_in(in_buf.get());
+  std::ostream file_out(out_buf.get());
+  std::istream& in = in_buf ? file_in : std::cin;
+  std::ostream& out = out_buf ? file_out : std::cout;
+#else
+  if (opts.m_io != io_mode::stream) {
+    std::cerr << "plain and io_uring io need a posix system, using the iostreams\n";
   }
-  assert(false);
-  return match_command{};
-}
+  std::istream& in = std::cin;
+  std::ostream& out = std::cout;
+#endif
 
-query_data parse_query_string(const std::string& s)
-{
-  auto tok = split_string(s);
-  if (tok.empty()) {
-    assert(false);
+  std::string line;
+  if (opts.m_listen.empty()) {
+    // skip first line
+    std::getline(in, line);
   }
-  if (tok.size() == 1) {
-    return query_data{};
+  if (!opts.m_load_snapshot.empty()) {
+    try {
+      processor.load_snapshot(opts.m_load_snapshot);
+    }
+    catch (const snapshot_error& err) {
+      std::cerr << err.what() << '\n';
+      return 1;
+    }
   }
-  if (tok.size() == 2) {
+  std::unique_ptr<command_log> log;
+  if (!opts.m_log.empty()) {
     try {
-      uint32_t time = std::stoul(tok[1]);
-      return query_data{time};
+      command_log::replay(opts.m_log, processor);
+      log.reset(new command_log(opts.m_log, opts.m_log_durability, opts.m_log_group, opts.m_io == io_mode::uring));
     }
-    catch (...) {
-      // if cannot convert to number, then it is symbol name
-      return query_data{ tok[1] };
+    catch (const snapshot_error& err) {
+      std::cerr << err.what() << '\n';
+      return 1;
     }
   }
-  if (tok.size() == 3) {
+  for (uint64_t i = 0; opts.m_listen.empty() && i < processor.get_sequence() && std::getline(in, line); ++i) {
+  }
+  if (!opts.m_listen.empty()) {
+#if defined(__linux__)
     try {
-      uint32_t time = std::stoul(tok[1]);
-      std::string symb = tok[2];
-      return query_data(symb, time);
+      serve_order_entry(processor, log.get(), opts.m_listen);
     }
-    catch (...) {
-      // if not able to convert to number, try other way around
+    catch (const std::exception& err) {
+      std::cerr << err.what() << '\n';
+      return 1;
     }
+#else
+    std::cerr << "order entry over tcp needs linux\n";
+    return 1;
+#endif
+  }
+  else if (opts.m_prescan) {
+    stream_sink sink(out);
+    run_prescan(processor, in, sink);
+  }
+  else if (opts.m_pipeline) {
+    run_pipeline(processor, in, out, opts.m_pipeline_batch, log.get());
+  }
+  else {
+    stream_sink sink(out);
+    run_serial(processor, in, sink, log.get());
+  }
+  log.reset();
+#if defined(__unix__) || defined(__APPLE__)
+  if (out_buf) {
     try {
-      uint32_t time = std::stoul(tok[2]);
-      std::string symb = tok[1];
-      return query_data(symb, time);
+      out_buf->finish();
     }
-    catch (...) {
-      assert(false);
+    catch (const io_error& err) {
+      std::cerr << err.what() << '\n';
+      return 1;
     }
   }
-  return query_data{};
+#endif
+  if (opts.m_stats) {
+    processor.dump_stats(std::string(), std::cerr);
+  }
+  if (!opts.m_save_snapshot.empty()) {
+    try {
+      processor.save_snapshot(opts.m_save_snapshot);
+    }
+    catch (const snapshot_error& err) {
+      std::cerr << err.what() << '\n';
+      return 1;
+    }
+  }
+  return 0;
 }
 
-int main()
+int main(int argc, char* argv[])
 {
   //basic_limit_orders_matching_tests();
   //basic_buy_queue_tests();
   //basic_sell_queue_tests();
+  //basic_queue_level_tests();
+  //basic_level_index_tests();
+  //basic_id_table_tests();
+  //basic_depth_tests();
+  //basic_stats_tests();
+  //basic_auction_tests();
+  //basic_batch_tests();
+  //basic_policy_tests();
+  //basic_history_tests();
+  //basic_mass_cancel_tests();
+  //basic_expiry_tests();
+  //basic_stop_tests();
+  //basic_fok_tests();
+  //basic_iceberg_tests();
+  //basic_snapshot_tests();
+  //basic_log_tests();
+  //basic_file_io_tests();
+  //basic_gateway_tests();
 
   //assert(false);
 
-  order_engines engines;
-
-  std::map<uint32_t, order_engines> history;
-  
-  std::string line;
-  // skip first line
-  std::getline(std::cin, line);
-  while (std::getline(std::cin, line)) {
-    if (line.size() == 0) {
-      assert(false);
-    }
-    uint32_t time_stamp = 0;
+  run_options opts = parse_run_options(argc, argv);
+  if (opts.m_prescan && (!opts.m_log.empty() || !opts.m_listen.empty() || opts.m_pipeline)) {
+    std::cerr << "a prescan replay reads the input serially and writes no command log\n";
+    return 1;
+  }
+  if (opts.m_query_threads > 0 && !opts.m_listen.empty()) {
+    std::cerr << "historical queries are answered on reader threads only for a replayed input\n";
+    return 1;
+  }
+  if (opts.m_md_stress_readers > 0) {
+    market_data_stress_test(opts.m_md_stress_readers, 200000);
+    return 0;
+  }
+  if (opts.m_level_bench_levels > 0) {
+    level_index_benchmark(opts.m_level_bench_levels, 1000000);
+    return 0;
+  }
+  if (opts.m_hash_bench_count > 0) {
+    id_table_benchmark(opts.m_hash_bench_count);
+    return 0;
+  }
+  if (opts.m_policy_bench_count > 0) {
+    engine_policy_benchmark(opts.m_policy_bench_count);
+    return 0;
+  }
+  if (opts.m_history_bench_count > 0) {
+    history_benchmark(opts.m_history_bench_count);
+    return 0;
+  }
+  if (opts.m_pipeline_bench_count > 0) {
+    pipeline_benchmark(opts.m_pipeline_bench_count);
+    return 0;
+  }
+  if (opts.m_gateway_bench_clients > 0) {
+#if defined(__linux__)
     try {
-      switch (line[0]) {
-      case 'N': {
-        order_data od = parse_new_order_string(line);
-        engines.add_order_from_order_data(od);
-        time_stamp = od.get_time();
-        break;
-      }
-      case 'A': {
-        order_data od = parse_amend_order_string(line);
-        engines.amend_order_from_order_data(od);
-        time_stamp = od.get_time();
-        break;
-      }
-      case 'X':
-      {
-        cancel_command cmd = parse_cancel_string(line);
-        engines.cancel_order(cmd.m_id);
-        time_stamp = cmd.m_timestamp;
-        break;
-      }
-      case 'M':
-      {
-        match_command cmd  = parse_match_string(line);
-        std::vector<matched_result_detail> result;
-        if (!cmd.m_symb.empty()) {
-          result = engines.match_one(cmd.m_symb);
-        }
-        else {
-          result = engines.match_all();
-        }
-
-        for (const auto& res : result) {
-          std::cout << res.to_string() << std::endl;
-        }
-        time_stamp = cmd.m_time;
-        break;
-      }
-      case 'Q':
-      {
-        query_data d = parse_query_string(line);
-        if (d.get_timestamp() == 0) {
-          engines.dump_data(d);
-        }
-        else {
-          //auto iter = history.find(d.get_timestamp());
-          //if (iter != history.end()) {
-          //  iter->second.dump_data(d);
-          //}
-          auto iter = history.lower_bound(d.get_timestamp());
-          if (iter == history.end()) {
-            if (history.size() > 0) {
-              --iter;
-            }
-          }
-          else if (iter->first > d.get_timestamp()) {
-            --iter;
-          }
-          if (iter != history.end()) {
-            iter->second.dump_data(d);
-          }
-        }
-        break;
-      }
-      }
-    }
-    catch (const parse_error& err) {
-      std::cout << err.get_msg() << '\n';
+      gateway_benchmark(opts.m_connect, opts.m_gateway_bench_clients, 200000);
     }
-    if (time_stamp > 0) {
-      history[time_stamp] = engines;
+    catch (const std::exception& err) {
+      std::cerr << err.what() << '\n';
+      return 1;
     }
+    return 0;
+#else
+    std::cerr << "order entry over tcp needs linux\n";
+    return 1;
+#endif
   }
 
+  switch (opts.m_levels) {
+  case level_mode::tick:
+    return run_engines<tick_engine_policy>(opts);
+  case level_mode::map:
+    return run_engines<map_engine_policy>(opts);
+  default:
+    return run_engines<default_engine_policy>(opts);
+  }
 }